@@ -0,0 +1,520 @@
+// Loopback benchmark for the whole tunnel:
+//
+//   client threads -> tunnel_frontend_server -> HTTP stand-in (this process)
+//     -> tunnel_backend_server (SCGI) -> target server (this process)
+//
+// The stand-in plays the role of lighttpd: it turns each HTTP/1.1 POST into
+// an SCGI request and relays the reply. The target understands three
+// one-line commands so every workload runs over plain tunnel connections:
+//   "S <n>\n"  sink n bytes, then answer one byte
+//   "D <n>\n"  send n bytes
+//   "E\n"      echo everything
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST 16
+#define MAX_ARGS 16
+#define IO_BUF 65536
+#define CLIENT_TIMEOUT_SECS 30
+
+static int scgi_port, target_port, http_port, front_port;
+static unsigned long http_requests = 0;     // relayed by the stand-in
+
+static double now_s(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    int one = 1; setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1); }
+    if (listen(fd, 128) < 0) { perror("listen"); exit(1); }
+    return fd;
+}
+
+static int connect_port(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(fd); return -1; }
+    int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int write_all(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0) { if (errno == EINTR) continue; return -1; }
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r; n -= (size_t)r;
+    }
+    return 0;
+}
+
+static void spawn_detached(void *(*fn)(void *), intptr_t arg) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, fn, (void*)arg) != 0) { close((int)arg); return; }
+    pthread_detach(t);
+}
+
+// === Target server ===
+static void *target_conn_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char line[64]; size_t l = 0;
+    while (l < sizeof(line) - 1) {
+        if (read(fd, line + l, 1) != 1) { close(fd); return NULL; }
+        if (line[l++] == '\n') break;
+    }
+    line[l] = 0;
+    char *buf = malloc(IO_BUF);
+    if (line[0] == 'S') {
+        size_t left = strtoull(line + 2, NULL, 10);
+        while (left > 0) {
+            ssize_t r = read(fd, buf, left < IO_BUF ? left : IO_BUF);
+            if (r <= 0) break;
+            left -= (size_t)r;
+        }
+        if (left == 0) write_all(fd, "k", 1);
+    } else if (line[0] == 'D') {
+        size_t left = strtoull(line + 2, NULL, 10);
+        memset(buf, 'd', IO_BUF);
+        while (left > 0) {
+            size_t n = left < IO_BUF ? left : IO_BUF;
+            if (write_all(fd, buf, n) < 0) break;
+            left -= n;
+        }
+    } else if (line[0] == 'E') {
+        for (;;) {
+            ssize_t r = read(fd, buf, IO_BUF);
+            if (r <= 0 || write_all(fd, buf, (size_t)r) < 0) break;
+        }
+    }
+    // hold the connection until the client is done so nothing is cut short
+    while (read(fd, buf, IO_BUF) > 0) {}
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void *target_server_thread(void *arg) {
+    int srv = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(srv, NULL, NULL);
+        if (fd < 0) { if (errno == EINTR) continue; break; }
+        int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        spawn_detached(target_conn_thread, fd);
+    }
+    return NULL;
+}
+
+// === HTTP -> SCGI stand-in ===
+struct reader { int fd; char buf[IO_BUF]; size_t off, len; };
+
+static ssize_t reader_fill(struct reader *r) {
+    if (r->off > 0) { memmove(r->buf, r->buf + r->off, r->len - r->off); r->len -= r->off; r->off = 0; }
+    if (r->len == sizeof(r->buf)) return -1;
+    ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+    if (n > 0) r->len += (size_t)n;
+    return n;
+}
+
+// Read up to the blank line; returns the header block length (0 on EOF).
+static size_t read_head(struct reader *r, char *out, size_t cap) {
+    for (;;) {
+        char *end = memmem(r->buf + r->off, r->len - r->off, "\r\n\r\n", 4);
+        if (end) {
+            size_t n = (size_t)(end - (r->buf + r->off)) + 4;
+            if (n >= cap) return 0;
+            memcpy(out, r->buf + r->off, n);
+            out[n] = 0;
+            r->off += n;
+            return n;
+        }
+        if (reader_fill(r) <= 0) return 0;
+    }
+}
+
+// Copy n body bytes from the reader to fd (or discard them when fd < 0).
+static int copy_body(struct reader *r, int fd, size_t n) {
+    while (n > 0) {
+        if (r->off == r->len && reader_fill(r) <= 0) return -1;
+        size_t k = r->len - r->off < n ? r->len - r->off : n;
+        if (fd >= 0 && write_all(fd, r->buf + r->off, k) < 0) return -1;
+        r->off += k; n -= k;
+    }
+    return 0;
+}
+
+// Turn "Name: value" request headers into the SCGI header block
+static size_t scgi_headers(const char *head, size_t clen, char *out, size_t cap) {
+    size_t o = (size_t)snprintf(out, cap, "CONTENT_LENGTH%c%zu%cSCGI%c1%cREQUEST_METHOD%cPOST%c",
+                                0, clen, 0, 0, 0, 0, 0);
+    const char *line = strstr(head, "\r\n");
+    while (line && line[2] != '\r') {
+        line += 2;
+        const char *colon = strchr(line, ':'), *eol = strstr(line, "\r\n");
+        if (!colon || !eol || colon > eol) break;
+        if (strncasecmp(line, "Content-Length", 14) != 0 && o + 80 + (size_t)(eol - line) < cap) {
+            bool ctype = strncasecmp(line, "Content-Type", 12) == 0;
+            if (!ctype) o += (size_t)snprintf(out + o, cap - o, "HTTP_");
+            for (const char *p = line; p < colon; p++) out[o++] = *p == '-' ? '_' : (char)toupper((unsigned char)*p);
+            out[o++] = 0;
+            const char *v = colon + 1;
+            while (*v == ' ') v++;
+            memcpy(out + o, v, (size_t)(eol - v)); o += (size_t)(eol - v);
+            out[o++] = 0;
+        }
+        line = eol;
+    }
+    return o;
+}
+
+static void *http_conn_thread(void *arg) {
+    struct reader *cr = calloc(1, sizeof(*cr)), *br = calloc(1, sizeof(*br));
+    cr->fd = (int)(intptr_t)arg;
+    char head[8192], scgi[8192], out[8192];
+    for (;;) {
+        if (read_head(cr, head, sizeof(head)) == 0) break;
+        const char *cl = strcasestr(head, "\r\nContent-Length:");
+        size_t clen = cl ? strtoull(cl + 17, NULL, 10) : 0;
+        int be = connect_port(scgi_port);
+        if (be < 0) break;
+        size_t hl = scgi_headers(head, clen, scgi, sizeof(scgi));
+        int pl = snprintf(out, sizeof(out), "%zu:", hl);
+        if (write_all(be, out, (size_t)pl) < 0 || write_all(be, scgi, hl) < 0 || write_all(be, ",", 1) < 0 ||
+            copy_body(cr, be, clen) < 0) { close(be); break; }
+        __atomic_fetch_add(&http_requests, 1, __ATOMIC_RELAXED);
+        br->fd = be; br->off = br->len = 0;
+        if (read_head(br, head, sizeof(head)) == 0) { close(be); break; }
+        // "Status: 200 OK" becomes the status line; the other headers pass through
+        const char *st = strncasecmp(head, "Status:", 7) == 0 ? head + 7 : " 200 OK\r\n";
+        while (*st == ' ') st++;
+        const char *rest = strstr(st, "\r\n") + 2;
+        bool sized = strcasestr(head, "\r\nContent-Length:") || strncasecmp(head, "Content-Length:", 15) == 0;
+        int ol = snprintf(out, sizeof(out), "HTTP/1.1 %.*s\r\n%s%s", (int)(rest - st - 2), st,
+                          sized ? "" : "Connection: close\r\n", rest);
+        if (write_all(cr->fd, out, (size_t)ol) < 0) { close(be); break; }
+        if (!sized) {
+            // a stream: relay until the backend ends it, then drop the connection
+            for (;;) {
+                size_t k = br->len - br->off;
+                if (k > 0 && write_all(cr->fd, br->buf + br->off, k) < 0) break;
+                br->off = br->len = 0;
+                if (reader_fill(br) <= 0) break;
+            }
+            close(be);
+            break;
+        }
+        const char *rcl = strcasestr(head, "Content-Length:");
+        if (copy_body(br, cr->fd, strtoull(rcl + 15, NULL, 10)) < 0) { close(be); break; }
+        close(be);
+    }
+    close(cr->fd);
+    free(cr); free(br);
+    return NULL;
+}
+
+static void *http_server_thread(void *arg) {
+    int srv = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(srv, NULL, NULL);
+        if (fd < 0) { if (errno == EINTR) continue; break; }
+        int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        spawn_detached(http_conn_thread, fd);
+    }
+    return NULL;
+}
+
+// === Clients ===
+enum workload { W_UPLOAD, W_DOWNLOAD, W_ECHO };
+
+struct client {
+    pthread_t tid;
+    enum workload kind;
+    size_t bytes;           // bulk size, or echo message size
+    int rounds;             // echo round trips
+    double *lat;            // per round trip, seconds
+    int ok;
+};
+
+static pthread_barrier_t start_barrier;
+
+static int open_tunnel(void) {
+    int fd = connect_port(front_port);
+    if (fd < 0) return -1;
+    struct timeval tv = { CLIENT_TIMEOUT_SECS, 0 };   // never hang on a stuck tunnel
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static void *client_thread(void *arg) {
+    struct client *c = arg;
+    int fd = open_tunnel();
+    char *buf = malloc(IO_BUF);
+    memset(buf, 'u', IO_BUF);
+    pthread_barrier_wait(&start_barrier);
+    if (fd < 0) goto out;
+    char cmd[64];
+    int cl = c->kind == W_UPLOAD ? snprintf(cmd, sizeof(cmd), "S %zu\n", c->bytes)
+           : c->kind == W_DOWNLOAD ? snprintf(cmd, sizeof(cmd), "D %zu\n", c->bytes)
+           : snprintf(cmd, sizeof(cmd), "E\n");
+    if (write_all(fd, cmd, (size_t)cl) < 0) goto out;
+    if (c->kind == W_UPLOAD) {
+        size_t left = c->bytes;
+        while (left > 0) {
+            size_t n = left < IO_BUF ? left : IO_BUF;
+            if (write_all(fd, buf, n) < 0) goto out;
+            left -= n;
+        }
+        c->ok = read_full(fd, buf, 1) == 0 && buf[0] == 'k';
+    } else if (c->kind == W_DOWNLOAD) {
+        size_t left = c->bytes;
+        while (left > 0) {
+            ssize_t r = read(fd, buf, left < IO_BUF ? left : IO_BUF);
+            if (r <= 0) goto out;
+            left -= (size_t)r;
+        }
+        c->ok = 1;
+    } else {
+        for (int i = 0; i < c->rounds; i++) {
+            double t0 = now_s();
+            if (write_all(fd, buf, c->bytes) < 0 || read_full(fd, buf, c->bytes) < 0) goto out;
+            c->lat[i] = now_s() - t0;
+        }
+        c->ok = 1;
+    }
+out:
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+struct result {
+    const char *test;
+    int sessions;
+    size_t bytes;
+    double seconds;
+    unsigned long requests;
+    double p50_ms, p99_ms;
+    int ok;
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static struct result run_phase(enum workload kind, int sessions, size_t bytes, int rounds) {
+    struct client *cs = calloc((size_t)sessions, sizeof(*cs));
+    double *lat = kind == W_ECHO ? calloc((size_t)sessions * (size_t)rounds, sizeof(double)) : NULL;
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)sessions + 1);
+    for (int i = 0; i < sessions; i++) {
+        cs[i].kind = kind; cs[i].bytes = bytes; cs[i].rounds = rounds;
+        cs[i].lat = lat ? lat + (size_t)i * (size_t)rounds : NULL;
+        pthread_create(&cs[i].tid, NULL, client_thread, &cs[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    unsigned long req0 = __atomic_load_n(&http_requests, __ATOMIC_RELAXED);
+    double t0 = now_s();
+    struct result r = { kind == W_UPLOAD ? "upload" : kind == W_DOWNLOAD ? "download" : "echo",
+                        sessions, bytes, 0, 0, 0, 0, 1 };
+    for (int i = 0; i < sessions; i++) { pthread_join(cs[i].tid, NULL); r.ok &= cs[i].ok; }
+    r.seconds = now_s() - t0;
+    r.requests = __atomic_load_n(&http_requests, __ATOMIC_RELAXED) - req0;
+    pthread_barrier_destroy(&start_barrier);
+    if (lat && r.ok) {
+        size_t n = (size_t)sessions * (size_t)rounds;
+        qsort(lat, n, sizeof(double), cmp_double);
+        r.p50_ms = lat[n / 2] * 1e3;
+        r.p99_ms = lat[n * 99 / 100 < n ? n * 99 / 100 : n - 1] * 1e3;
+    }
+    free(lat); free(cs);
+    return r;
+}
+
+static void print_result(const struct result *r, bool json, bool first) {
+    double mbs = r->seconds > 0 ? (double)r->bytes * r->sessions / r->seconds / 1e6 : 0;
+    double rps = r->seconds > 0 ? (double)r->requests / r->seconds : 0;
+    if (json) {
+        printf("%s\n    {\"test\": \"%s\", \"sessions\": %d, \"bytes\": %zu, \"seconds\": %.4f, "
+               "\"requests\": %lu, \"req_per_s\": %.1f, ", first ? "" : ",", r->test, r->sessions,
+               r->bytes, r->seconds, r->requests, rps);
+        if (strcmp(r->test, "echo") == 0) printf("\"p50_ms\": %.3f, \"p99_ms\": %.3f, ", r->p50_ms, r->p99_ms);
+        else printf("\"mb_per_s\": %.2f, ", mbs);
+        printf("\"ok\": %s}", r->ok ? "true" : "false");
+        return;
+    }
+    if (strcmp(r->test, "echo") == 0)
+        printf("%-8s sessions=%-3d msg=%-8zu p50=%.2fms p99=%.2fms %.0f req/s%s\n", r->test, r->sessions,
+               r->bytes, r->p50_ms, r->p99_ms, rps, r->ok ? "" : " FAILED");
+    else
+        printf("%-8s sessions=%-3d bytes=%-10zu %.2f MB/s %.0f req/s%s\n", r->test, r->sessions,
+               r->bytes, mbs, rps, r->ok ? "" : " FAILED");
+}
+
+// === Setup ===
+static int parse_list(const char *s, size_t *out) {
+    int n = 0;
+    while (*s && n < MAX_LIST) {
+        char *end;
+        double v = strtod(s, &end);
+        if (end == s) break;
+        if (*end == 'k' || *end == 'K') { v *= 1024; end++; }
+        else if (*end == 'm' || *end == 'M') { v *= 1048576; end++; }
+        out[n++] = (size_t)v;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+static pid_t spawn(char **argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(1);
+    }
+    return pid;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --sizes LIST          bulk transfer sizes, e.g. 1M,8M (default 1M,8M)\n"
+            "  --sessions LIST       concurrent tunnels per run, e.g. 1,4 (default 1,4)\n"
+            "  --msg-size N          echo message size in bytes (default 64)\n"
+            "  --rounds N            echo round trips per session (default 100)\n"
+            "  --frontend-opt OPT    extra tunnel_frontend_server option (repeatable)\n"
+            "  --backend-opt OPT     extra tunnel_backend_server option (repeatable)\n"
+            "  --json                machine-readable output\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "sizes", required_argument, NULL, 'z' },
+        { "sessions", required_argument, NULL, 'n' },
+        { "msg-size", required_argument, NULL, 'm' },
+        { "rounds", required_argument, NULL, 'r' },
+        { "frontend-opt", required_argument, NULL, 'F' },
+        { "backend-opt", required_argument, NULL, 'B' },
+        { "json", no_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    size_t sizes[MAX_LIST] = { 1 << 20, 8 << 20 }, sessions[MAX_LIST] = { 1, 4 };
+    int n_sizes = 2, n_sessions = 2, rounds = 100;
+    size_t msg_size = 64;
+    bool json = false;
+    char *fe_argv[MAX_ARGS + 4], *be_argv[MAX_ARGS + 4];
+    int fe_argc = 0, be_argc = 0;
+    fe_argv[fe_argc++] = "./tunnel_frontend_server";
+    be_argv[be_argc++] = "./tunnel_backend_server";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'z': n_sizes = parse_list(optarg, sizes); break;
+        case 'n': n_sessions = parse_list(optarg, sessions); break;
+        case 'm': msg_size = strtoull(optarg, NULL, 10); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 'F': if (fe_argc < MAX_ARGS) fe_argv[fe_argc++] = optarg; break;
+        case 'B': if (be_argc < MAX_ARGS) be_argv[be_argc++] = optarg; break;
+        case 'j': json = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (n_sizes == 0 || n_sessions == 0 || rounds <= 0 || msg_size == 0 || msg_size > IO_BUF) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int base = 40000 + (getpid() % 5000) * 4;
+    front_port = base; http_port = base + 1; scgi_port = base + 2; target_port = base + 3;
+    pthread_t tid;
+    pthread_create(&tid, NULL, target_server_thread, (void*)(intptr_t)listen_on(target_port));
+    pthread_detach(tid);
+    pthread_create(&tid, NULL, http_server_thread, (void*)(intptr_t)listen_on(http_port));
+    pthread_detach(tid);
+
+    char scgi_s[16], target_s[16], front_s[16], url[64];
+    snprintf(scgi_s, sizeof(scgi_s), "%d", scgi_port);
+    snprintf(target_s, sizeof(target_s), "%d", target_port);
+    snprintf(front_s, sizeof(front_s), "%d", front_port);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/tunnel", http_port);
+    be_argv[be_argc++] = scgi_s; be_argv[be_argc++] = target_s; be_argv[be_argc] = NULL;
+    fe_argv[fe_argc++] = front_s; fe_argv[fe_argc++] = url; fe_argv[fe_argc] = NULL;
+    pid_t be = spawn(be_argv);
+    pid_t fe = spawn(fe_argv);
+    usleep(500000);     // let both servers start listening
+
+    if (json) printf("{\n  \"results\": [");
+    bool first = true;
+    int failed = 0;
+    for (int s = 0; s < n_sessions; s++) {
+        for (int z = 0; z < n_sizes; z++) {
+            struct result up = run_phase(W_UPLOAD, (int)sessions[s], sizes[z], 0);
+            print_result(&up, json, first); first = false;
+            struct result down = run_phase(W_DOWNLOAD, (int)sessions[s], sizes[z], 0);
+            print_result(&down, json, false);
+            failed += !up.ok + !down.ok;
+        }
+        struct result echo = run_phase(W_ECHO, (int)sessions[s], msg_size, rounds);
+        print_result(&echo, json, false);
+        failed += !echo.ok;
+    }
+
+    // the backend's CPU time and context switches over the whole run, to
+    // compare event engines and options by their overhead
+    kill(fe, SIGTERM); kill(be, SIGTERM);
+    struct rusage ru; memset(&ru, 0, sizeof(ru));
+    waitpid(fe, NULL, 0); wait4(be, NULL, 0, &ru);
+    double user_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    double sys_s = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    unsigned long reqs = __atomic_load_n(&http_requests, __ATOMIC_RELAXED);
+    if (json)
+        printf("\n  ],\n  \"backend\": {\"requests\": %lu, \"user_s\": %.3f, \"sys_s\": %.3f, "
+               "\"vol_ctxsw\": %ld, \"invol_ctxsw\": %ld}\n}\n", reqs, user_s, sys_s, ru.ru_nvcsw, ru.ru_nivcsw);
+    else
+        printf("backend  requests=%lu user=%.2fs sys=%.2fs ctxsw=%ld voluntary, %ld involuntary\n", reqs, user_s,
+               sys_s, ru.ru_nvcsw, ru.ru_nivcsw);
+    return failed ? 1 : 0;
+}
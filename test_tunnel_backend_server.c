@@ -7,14 +7,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
-static int data_conn_fd = -1;
+#define MAX_DATA_CONNS 32
+
+struct data_conn {
+    int fd;
+    unsigned char buf[1024];
+    size_t len;
+    size_t total;           // every byte received, including those past buf
+    unsigned long sum;      // byte sum of everything received
+    volatile int stalled;   // stop reading, as a slow target would
+};
+
+static struct data_conn data_conns[MAX_DATA_CONNS];
+static int data_conn_count = 0;
+static int data_srv_fd = -1;
 static pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
-static unsigned char data_buf[1024];
-static size_t data_len = 0;
 static volatile int done_flag = 0;
 
 static void hexdump(const char *prefix, const unsigned char *buf, size_t len) {
@@ -23,26 +37,12 @@ static void hexdump(const char *prefix, const unsigned char *buf, size_t len) {
     printf("\n");
 }
 
-static void *data_server_thread(void *arg) {
-    int port = *(int *)arg;
-    int srv = socket(AF_INET, SOCK_STREAM, 0);
-    if (srv < 0) { perror("data server socket"); exit(1); }
-    int one = 1; setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    addr.sin_port = htons((uint16_t)port);
-    if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("data server bind"); exit(1); }
-    if (listen(srv, 1) < 0) { perror("data server listen"); exit(1); }
-    printf("[data] listening on 127.0.0.1:%d\n", port);
-    int conn = accept(srv, NULL, NULL);
-    if (conn < 0) { perror("data server accept"); exit(1); }
-    printf("[data] accepted connection\n");
-    data_conn_fd = conn;
+static void *data_conn_thread(void *arg) {
+    struct data_conn *dc = arg;
     while (!done_flag) {
+        if (dc->stalled) { usleep(1000); continue; }
         unsigned char buf[256];
-        ssize_t r = read(conn, buf, sizeof(buf));
+        ssize_t r = read(dc->fd, buf, sizeof(buf));
         if (r < 0) {
             if (errno == EINTR) continue;
             perror("[data] read");
@@ -52,16 +52,48 @@ static void *data_server_thread(void *arg) {
             printf("[data] connection closed\n");
             break;
         }
-        hexdump("[data] received: ", buf, (size_t)r);
+        if (r <= 64) hexdump("[data] received: ", buf, (size_t)r);
         pthread_mutex_lock(&data_mutex);
-        if (data_len + (size_t)r < sizeof(data_buf)) {
-            memcpy(data_buf + data_len, buf, (size_t)r);
-            data_len += (size_t)r;
+        dc->total += (size_t)r;
+        for (ssize_t i = 0; i < r; i++) dc->sum += buf[i];
+        if (dc->len + (size_t)r < sizeof(dc->buf)) {
+            memcpy(dc->buf + dc->len, buf, (size_t)r);
+            dc->len += (size_t)r;
         }
         pthread_mutex_unlock(&data_mutex);
     }
-    close(conn);
-    close(srv);
+    return NULL;
+}
+
+static void *data_server_thread(void *arg) {
+    int port = *(int *)arg;
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv < 0) { perror("data server socket"); exit(1); }
+    int one = 1; setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("data server bind"); exit(1); }
+    if (listen(srv, MAX_DATA_CONNS) < 0) { perror("data server listen"); exit(1); }
+    data_srv_fd = srv;
+    printf("[data] listening on 127.0.0.1:%d\n", port);
+    pthread_t readers[MAX_DATA_CONNS];
+    int n = 0;
+    while (!done_flag && n < MAX_DATA_CONNS) {
+        int conn = accept(srv, NULL, NULL);
+        if (conn < 0) break;
+        printf("[data] accepted connection %d\n", n);
+        pthread_mutex_lock(&data_mutex);
+        data_conns[n].fd = conn;
+        data_conn_count = n + 1;
+        pthread_mutex_unlock(&data_mutex);
+        pthread_create(&readers[n], NULL, data_conn_thread, &data_conns[n]);
+        n++;
+    }
+    for (int i = 0; i < n; i++) pthread_join(readers[i], NULL);
+    for (int i = 0; i < n; i++) close(data_conns[i].fd);
     return NULL;
 }
 
@@ -75,8 +107,7 @@ static int read_full(int fd, unsigned char *buf, size_t n) {
     return 0;
 }
 
-static int send_scgi(int port, const unsigned char *body, size_t body_len,
-                     unsigned char **resp, size_t *resp_len) {
+static int connect_port(int port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) { perror("socket"); return -1; }
     struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
@@ -85,7 +116,20 @@ static int send_scgi(int port, const unsigned char *body, size_t body_len,
     addr.sin_port = htons((uint16_t)port);
     if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("connect"); close(fd); return -1; }
-    char hdr[256];
+    struct timeval tv = { 5, 0 };   // never hang the test on a stuck server
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static char last_resp_hdr[1024];    // headers of the most recent response
+
+// Connect and send one SCGI request; returns the socket to read the reply from.
+// extra: NULL-terminated list of additional SCGI header name/value pairs
+static int open_scgi(int port, const char *const *extra,
+                     const unsigned char *body, size_t body_len) {
+    int fd = connect_port(port);
+    if (fd < 0) return -1;
+    char hdr[512];
     int pos = 0;
     pos += sprintf(hdr + pos, "CONTENT_LENGTH");
     hdr[pos++] = 0;
@@ -95,6 +139,12 @@ static int send_scgi(int port, const unsigned char *body, size_t body_len,
     hdr[pos++] = 0;
     pos += sprintf(hdr + pos, "1");
     hdr[pos++] = 0;
+    for (; extra && extra[0]; extra += 2) {
+        pos += sprintf(hdr + pos, "%s", extra[0]);
+        hdr[pos++] = 0;
+        pos += sprintf(hdr + pos, "%s", extra[1]);
+        hdr[pos++] = 0;
+    }
     int hdr_len = pos;
     char pre[32];
     int pre_len = sprintf(pre, "%d:", hdr_len);
@@ -105,6 +155,11 @@ static int send_scgi(int port, const unsigned char *body, size_t body_len,
     if (body_len > 0 && write(fd, body, body_len) != (ssize_t)body_len) {
         perror("write body"); close(fd); return -1; }
     printf("[client] sent %zu bytes\n", body_len);
+    return fd;
+}
+
+// Read the reply headers into last_resp_hdr.
+static int read_resp_hdr(int fd) {
     char resp_hdr[1024]; size_t h = 0;
     while (h < sizeof(resp_hdr) - 1) {
         ssize_t r = read(fd, resp_hdr + h, 1);
@@ -113,15 +168,36 @@ static int send_scgi(int port, const unsigned char *body, size_t body_len,
         if (h >= 4 && memcmp(resp_hdr + h - 4, "\r\n\r\n", 4) == 0) break;
     }
     resp_hdr[h] = 0;
+    memcpy(last_resp_hdr, resp_hdr, h + 1);
     printf("[client] response headers:\n%s", resp_hdr);
-    const char *cl = strstr(resp_hdr, "Content-Length:");
+    return 0;
+}
+
+// Read one reply off a keep-alive HTTP connection; returns the body length.
+static int read_http_reply(int fd, unsigned char *body, size_t cap) {
+    if (read_resp_hdr(fd) < 0) return -1;
+    const char *cl = strstr(last_resp_hdr, "Content-Length:");
+    if (strncmp(last_resp_hdr, "HTTP/1.1 200 ", 13) != 0 || !cl || strstr(last_resp_hdr, "Connection: close")) return -1;
+    size_t len = (size_t)atoi(cl + strlen("Content-Length:"));
+    if (len > cap || read_full(fd, body, len) < 0) return -1;
+    return (int)len;
+}
+
+static int send_scgi(int port, const char *const *extra,
+                     const unsigned char *body, size_t body_len,
+                     unsigned char **resp, size_t *resp_len) {
+    int fd = open_scgi(port, extra, body, body_len);
+    if (fd < 0) return -1;
+    if (read_resp_hdr(fd) < 0) return -1;
+    const char *cl = strstr(last_resp_hdr, "Content-Length:");
     if (!cl) { fprintf(stderr, "missing Content-Length\n"); close(fd); return -1; }
     int len = atoi(cl + strlen("Content-Length:"));
     *resp_len = (size_t)len;
     *resp = malloc(len);
     if (len > 0) {
         if (read_full(fd, *resp, len) < 0) { perror("read body"); close(fd); return -1; }
-        hexdump("[client] response body: ", *resp, (size_t)len);
+        if (len <= 64) hexdump("[client] response body: ", *resp, (size_t)len);
+        else printf("[client] response body: %d bytes\n", len);
     } else {
         printf("[client] response body empty\n");
     }
@@ -129,6 +205,49 @@ static int send_scgi(int port, const unsigned char *body, size_t body_len,
     return 0;
 }
 
+static double elapsed_since(const struct timespec *t0) {
+    struct timespec t1; clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double)(t1.tv_sec - t0->tv_sec) + (double)(t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void *delayed_reply_thread(void *arg) {
+    struct data_conn *dc = arg;
+    usleep(300000);
+    if (write(dc->fd, "late", 4) != 4) perror("[data] delayed write");
+    return NULL;
+}
+
+#define BULK_LEN 200000
+
+static void fill_pattern(unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) buf[i] = (unsigned char)(i % 251);
+}
+
+static void *bulk_writer_thread(void *arg) {
+    struct data_conn *dc = arg;
+    unsigned char *buf = malloc(BULK_LEN);
+    fill_pattern(buf, BULK_LEN);
+    size_t off = 0;
+    while (off < BULK_LEN) {
+        ssize_t w = write(dc->fd, buf + off, BULK_LEN - off);
+        if (w <= 0) { perror("[data] bulk write"); break; }
+        off += (size_t)w;
+    }
+    free(buf);
+    return NULL;
+}
+
+static const char *const bulk_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "bulk", NULL };
+static const char *const s1_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "s1", NULL };
+static const char *const lp_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "lp", NULL };
+static const char *const lp_wait_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "lp", "HTTP_X_TUNNEL_WAIT", "5000", NULL };
+static const char *const lp_short_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "lp", "HTTP_X_TUNNEL_WAIT", "200", NULL };
+static const char *const up_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "duplex", "HTTP_X_TUNNEL_DIR", "up", NULL };
+static const char *const stream_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "strm", "HTTP_X_TUNNEL_DIR", "stream",
+                                           "HTTP_X_TUNNEL_WAIT", "500", NULL };
+static const char *const down_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "duplex", "HTTP_X_TUNNEL_DIR", "down",
+                                         "HTTP_X_TUNNEL_WAIT", "2000", NULL };
+
 int main() {
     int base = 30000 + (getpid() % 10000);
     int data_port = base;
@@ -140,38 +259,41 @@ int main() {
     }
     pid_t child = fork();
     if (child == 0) {
-        char port1[16], port2[16];
+        char port1[16], port2[16], port3[16];
         sprintf(port1, "%d", scgi_port);
         sprintf(port2, "%d", data_port);
-        execl("./tunnel_backend_server", "./tunnel_backend_server", port1, port2, NULL);
+        sprintf(port3, "%d", base + 3);
+        execl("./tunnel_backend_server", "./tunnel_backend_server", "--metrics", "--queue-max", "262144",
+              "--http", port3, port1, port2, NULL);
         perror("execl");
         _exit(1);
     }
     printf("[main] started tunnel_backend_server pid=%d\n", child);
+    pid_t sharded = -1, pooled = -1, uringed = -1;
     sleep(1); // allow server to start
 
     size_t last = 0;
     unsigned char *resp = NULL; size_t resp_len = 0;
     const unsigned char body1[] = "hello";
-    if (send_scgi(scgi_port, body1, sizeof(body1) - 1, &resp, &resp_len) != 0) goto cleanup;
+    if (send_scgi(scgi_port, NULL, body1, sizeof(body1) - 1, &resp, &resp_len) != 0) goto cleanup;
     free(resp);
     pthread_mutex_lock(&data_mutex);
-    if (data_len - last == sizeof(body1) - 1 &&
-        memcmp(data_buf + last, body1, sizeof(body1) - 1) == 0) {
+    if (data_conns[0].len - last == sizeof(body1) - 1 &&
+        memcmp(data_conns[0].buf + last, body1, sizeof(body1) - 1) == 0) {
         printf("[main] data server received first body correctly\n");
     } else {
         fprintf(stderr, "[main] data server mismatch on first body\n");
     }
-    last = data_len;
+    last = data_conns[0].len;
     pthread_mutex_unlock(&data_mutex);
 
     const unsigned char reply[] = "back";
     printf("[main] data server sending reply bytes\n");
-    write(data_conn_fd, reply, sizeof(reply) - 1);
+    write(data_conns[0].fd, reply, sizeof(reply) - 1);
     usleep(100000);
 
     const unsigned char body2[] = "world";
-    if (send_scgi(scgi_port, body2, sizeof(body2) - 1, &resp, &resp_len) != 0) goto cleanup;
+    if (send_scgi(scgi_port, NULL, body2, sizeof(body2) - 1, &resp, &resp_len) != 0) goto cleanup;
     if (resp_len == sizeof(reply) - 1 &&
         memcmp(resp, reply, sizeof(reply) - 1) == 0) {
         printf("[main] second response matches expected bytes from data server\n");
@@ -179,24 +301,622 @@ int main() {
         fprintf(stderr, "[main] second response mismatch\n");
     }
     free(resp);
+    usleep(100000);
     pthread_mutex_lock(&data_mutex);
-    if (data_len - last == sizeof(body2) - 1 &&
-        memcmp(data_buf + last, body2, sizeof(body2) - 1) == 0) {
+    if (data_conns[0].len - last == sizeof(body2) - 1 &&
+        memcmp(data_conns[0].buf + last, body2, sizeof(body2) - 1) == 0) {
         printf("[main] data server received second body correctly\n");
     } else {
         fprintf(stderr, "[main] data server mismatch on second body\n");
     }
     pthread_mutex_unlock(&data_mutex);
 
+    // A client that stalls mid-request must not hold up anyone else
+    int stalled = connect_port(scgi_port);
+    if (stalled >= 0 && write(stalled, "70:CONTENT", 10) != 10) perror("write stalled");
+
+    // A named session gets its own target connection
+    const unsigned char body3[] = "session";
+    if (send_scgi(scgi_port, s1_hdrs, body3, sizeof(body3) - 1, &resp, &resp_len) != 0) {
+        fprintf(stderr, "[main] request blocked behind stalled client\n");
+        goto cleanup;
+    }
+    printf("[main] request served while another client stalled\n");
+    free(resp);
+    if (stalled >= 0) close(stalled);
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    if (data_conn_count == 2 && data_conns[1].len == sizeof(body3) - 1 &&
+        memcmp(data_conns[1].buf, body3, sizeof(body3) - 1) == 0 &&
+        data_conns[0].len == last + sizeof(body2) - 1) {
+        printf("[main] named session used a separate target connection\n");
+    } else {
+        fprintf(stderr, "[main] named session mismatch\n");
+    }
+    pthread_mutex_unlock(&data_mutex);
+
+    // Closing a named session's target ends the session
+    shutdown(data_conns[1].fd, SHUT_RDWR);
+    usleep(100000);
+    if (send_scgi(scgi_port, s1_hdrs, NULL, 0, &resp, &resp_len) == 0) free(resp);
+    if (send_scgi(scgi_port, s1_hdrs, NULL, 0, &resp, &resp_len) != 0) {
+        printf("[main] closed session rejected\n");
+    } else {
+        fprintf(stderr, "[main] closed session still accepted\n");
+        free(resp);
+    }
+
+    // Long-poll: an empty poll is held until the target has data...
+    const unsigned char body4[] = "poll";
+    if (send_scgi(scgi_port, lp_hdrs, body4, sizeof(body4) - 1, &resp, &resp_len) != 0) goto cleanup;
+    free(resp);
+    usleep(100000);
+    pthread_t late_tid;
+    pthread_create(&late_tid, NULL, delayed_reply_thread, &data_conns[2]);
+    struct timespec t0; clock_gettime(CLOCK_MONOTONIC, &t0);
+    int lp = send_scgi(scgi_port, lp_wait_hdrs, NULL, 0, &resp, &resp_len);
+    double waited = elapsed_since(&t0);
+    pthread_join(late_tid, NULL);
+    if (lp == 0 && resp_len == 4 && memcmp(resp, "late", 4) == 0 &&
+        waited > 0.2 && waited < 2.0 && strstr(last_resp_hdr, "X-Tunnel-Wait: 5000")) {
+        printf("[main] long-poll returned target data as soon as it arrived\n");
+    } else {
+        fprintf(stderr, "[main] long-poll mismatch (%.3fs)\n", waited);
+    }
+    if (lp == 0) free(resp);
+
+    // ...or answered empty once its deadline passes
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    lp = send_scgi(scgi_port, lp_short_hdrs, NULL, 0, &resp, &resp_len);
+    waited = elapsed_since(&t0);
+    if (lp == 0 && resp_len == 0 && waited > 0.15 && waited < 2.0) {
+        printf("[main] long-poll timed out empty\n");
+    } else {
+        fprintf(stderr, "[main] long-poll timeout mismatch (%.3fs)\n", waited);
+    }
+    if (lp == 0) free(resp);
+
+    // Bulk transfers in both directions (spliced when the backend can)
+    unsigned char *bulk = malloc(BULK_LEN), *bulk_in = malloc(BULK_LEN);
+    fill_pattern(bulk, BULK_LEN);
+    unsigned long bulk_sum = 0;
+    for (size_t i = 0; i < BULK_LEN; i++) bulk_sum += bulk[i];
+    if (send_scgi(scgi_port, bulk_hdrs, bulk, BULK_LEN, &resp, &resp_len) == 0) free(resp);
+    usleep(200000);
+    pthread_mutex_lock(&data_mutex);
+    if (data_conn_count == 4 && data_conns[3].total == BULK_LEN && data_conns[3].sum == bulk_sum) {
+        printf("[main] bulk upload arrived intact\n");
+    } else {
+        fprintf(stderr, "[main] bulk upload mismatch\n");
+    }
+    pthread_mutex_unlock(&data_mutex);
+    pthread_t bulk_tid;
+    pthread_create(&bulk_tid, NULL, bulk_writer_thread, &data_conns[3]);
+    size_t got_in = 0;
+    for (int i = 0; i < 200 && got_in < BULK_LEN; i++) {
+        if (send_scgi(scgi_port, bulk_hdrs, NULL, 0, &resp, &resp_len) != 0) break;
+        if (got_in + resp_len <= BULK_LEN) memcpy(bulk_in + got_in, resp, resp_len);
+        got_in += resp_len;
+        free(resp);
+        if (resp_len == 0) usleep(10000);
+    }
+    pthread_join(bulk_tid, NULL);
+    if (got_in == BULK_LEN && memcmp(bulk_in, bulk, BULK_LEN) == 0) {
+        printf("[main] bulk download arrived intact\n");
+    } else {
+        fprintf(stderr, "[main] bulk download mismatch (%zu bytes)\n", got_in);
+    }
+    free(bulk); free(bulk_in);
+
+    // Full duplex: upstream posts leave target data for the downstream poll
+    const unsigned char up1[] = "ping";
+    if (send_scgi(scgi_port, up_hdrs, up1, sizeof(up1) - 1, &resp, &resp_len) == 0) free(resp);
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    int dup_ok = data_conn_count == 5 && data_conns[4].len == sizeof(up1) - 1;
+    pthread_mutex_unlock(&data_mutex);
+    if (dup_ok) write(data_conns[4].fd, "pong", 4);
+    usleep(100000);
+    const unsigned char up2[] = "more";
+    if (send_scgi(scgi_port, up_hdrs, up2, sizeof(up2) - 1, &resp, &resp_len) == 0) {
+        dup_ok = dup_ok && resp_len == 0;
+        free(resp);
+    } else {
+        dup_ok = 0;
+    }
+    if (send_scgi(scgi_port, down_hdrs, NULL, 0, &resp, &resp_len) == 0) {
+        dup_ok = dup_ok && resp_len == 4 && memcmp(resp, "pong", 4) == 0;
+        free(resp);
+    } else {
+        dup_ok = 0;
+    }
+    if (dup_ok) {
+        printf("[main] upstream and downstream requests split cleanly\n");
+    } else {
+        fprintf(stderr, "[main] full-duplex mismatch\n");
+    }
+
+    // Streaming: one open reply carries each target write as it happens
+    const unsigned char sbody[] = "start";
+    int sfd = open_scgi(scgi_port, stream_hdrs, sbody, sizeof(sbody) - 1);
+    int stream_ok = sfd >= 0 && read_resp_hdr(sfd) == 0 && strstr(last_resp_hdr, "X-Tunnel-Stream: 1") &&
+                    !strstr(last_resp_hdr, "Content-Length");
+    unsigned char sbuf[8];
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    stream_ok = stream_ok && data_conn_count == 6;
+    pthread_mutex_unlock(&data_mutex);
+    if (stream_ok && write(data_conns[5].fd, "one", 3) == 3)
+        stream_ok = read_full(sfd, sbuf, 3) == 0 && memcmp(sbuf, "one", 3) == 0;
+    if (stream_ok && write(data_conns[5].fd, "two", 3) == 3)
+        stream_ok = read_full(sfd, sbuf, 3) == 0 && memcmp(sbuf, "two", 3) == 0;
+    if (stream_ok) {
+        printf("[main] stream delivered target writes as they happened\n");
+    } else {
+        fprintf(stderr, "[main] stream mismatch\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (sfd >= 0 && read(sfd, sbuf, sizeof(sbuf)) == 0 && elapsed_since(&t0) < 2.0) {
+        printf("[main] idle stream ended\n");
+    } else {
+        fprintf(stderr, "[main] idle stream still open\n");
+    }
+    if (sfd >= 0) close(sfd);
+
+    // Compression: a deflated body reaches the target inflated, a reply the
+    // client accepts deflated comes back compressed, noise goes back raw
+    static const char *const zup_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "zz", "HTTP_X_TUNNEL_ENCODING", "deflate", NULL };
+    static const char *const zdown_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "zz",
+                                              "HTTP_X_TUNNEL_ACCEPT_ENCODING", "deflate", NULL };
+    unsigned char ztext[8192], zwire[8192 + 64], zback[8192];
+    for (size_t i = 0; i < sizeof(ztext); i++) ztext[i] = (unsigned char)"tunnel data "[i % 12];
+    uLongf zlen = sizeof(zwire);
+    int z_ok = compress(zwire, &zlen, ztext, 900) == Z_OK &&
+               send_scgi(scgi_port, zup_hdrs, zwire, zlen, &resp, &resp_len) == 0;
+    if (z_ok) free(resp);
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    z_ok = z_ok && data_conn_count == 7 && data_conns[6].len == 900 && memcmp(data_conns[6].buf, ztext, 900) == 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (z_ok) {
+        printf("[main] deflated body reached the target inflated\n");
+    } else {
+        fprintf(stderr, "[main] deflated body mismatch\n");
+    }
+    int zd_ok = z_ok && write(data_conns[6].fd, ztext, sizeof(ztext)) == (ssize_t)sizeof(ztext);
+    usleep(100000);
+    if (zd_ok && send_scgi(scgi_port, zdown_hdrs, NULL, 0, &resp, &resp_len) == 0) {
+        uLongf blen = sizeof(zback);
+        zd_ok = strstr(last_resp_hdr, "X-Tunnel-Encoding: deflate") && resp_len < sizeof(ztext) &&
+                uncompress(zback, &blen, resp, resp_len) == Z_OK && blen == sizeof(ztext) &&
+                memcmp(zback, ztext, sizeof(ztext)) == 0;
+        free(resp);
+    } else {
+        zd_ok = 0;
+    }
+    for (size_t i = 0; i < sizeof(ztext); i++) ztext[i] = (unsigned char)(rand() >> 7);
+    zd_ok = zd_ok && write(data_conns[6].fd, ztext, sizeof(ztext)) == (ssize_t)sizeof(ztext);
+    usleep(100000);
+    if (zd_ok && send_scgi(scgi_port, zdown_hdrs, NULL, 0, &resp, &resp_len) == 0) {
+        zd_ok = !strstr(last_resp_hdr, "X-Tunnel-Encoding") && resp_len == sizeof(ztext) &&
+                memcmp(resp, ztext, sizeof(ztext)) == 0;
+        free(resp);
+    } else {
+        zd_ok = 0;
+    }
+    if (zd_ok) {
+        printf("[main] compressible reply deflated, noise sent raw\n");
+    } else {
+        fprintf(stderr, "[main] compressed reply mismatch\n");
+    }
+
+    // A request trickling in (prefix split mid-length, headers, body) is
+    // parsed the same as one that arrives whole
+    static const char frag_hdrs[] = "CONTENT_LENGTH\0" "5\0" "SCGI\0" "1\0" "HTTP_X_TUNNEL_SESSION\0" "frag\0";
+    char frag[256];
+    int fpos = sprintf(frag, "%zu:", sizeof(frag_hdrs) - 1);
+    memcpy(frag + fpos, frag_hdrs, sizeof(frag_hdrs) - 1); fpos += (int)sizeof(frag_hdrs) - 1;
+    memcpy(frag + fpos, ",frag!", 6); fpos += 6;
+    int ffd = connect_port(scgi_port);
+    int cuts[] = { 1, 20, fpos - 3, fpos };
+    int frag_ok = ffd >= 0;
+    for (int i = 0, from = 0; frag_ok && i < 4; from = cuts[i++]) {
+        frag_ok = write(ffd, frag + from, (size_t)(cuts[i] - from)) == cuts[i] - from;
+        usleep(20000);
+    }
+    frag_ok = frag_ok && read_resp_hdr(ffd) == 0 && strstr(last_resp_hdr, "200 OK");
+    if (ffd >= 0) close(ffd);
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    frag_ok = frag_ok && data_conn_count == 8 && data_conns[7].len == 5 && memcmp(data_conns[7].buf, "frag!", 5) == 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (frag_ok) {
+        printf("[main] fragmented request parsed\n");
+    } else {
+        fprintf(stderr, "[main] fragmented request mismatch\n");
+    }
+
+    // Backpressure: with the target not reading, upstream posts are answered
+    // at once until the session's queue is full, then refused with 429; the
+    // accepted bytes all arrive once the target reads again
+    static const char *const bp_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "bp", "HTTP_X_TUNNEL_DIR", "up", NULL };
+    static unsigned char bp_body[15000];
+    memset(bp_body, 'b', sizeof(bp_body));
+    size_t accepted = 0;
+    int bp_ok = send_scgi(scgi_port, bp_hdrs, bp_body, sizeof(bp_body), &resp, &resp_len) == 0, refused = 0;
+    if (bp_ok) { free(resp); accepted += sizeof(bp_body); }
+    usleep(100000);
+    bp_ok = bp_ok && data_conn_count == 9;
+    if (bp_ok) data_conns[8].stalled = 1;
+    for (int i = 0; bp_ok && !refused && i < 4000; i++) {
+        int bfd = open_scgi(scgi_port, bp_hdrs, bp_body, sizeof(bp_body));
+        bp_ok = bfd >= 0 && read_resp_hdr(bfd) == 0;
+        if (!bp_ok) break;
+        close(bfd);
+        if (strstr(last_resp_hdr, "429")) refused = strstr(last_resp_hdr, "X-Tunnel-Queue:") != NULL;
+        else accepted += sizeof(bp_body);
+    }
+    if (bp_ok) data_conns[8].stalled = 0;
+    usleep(500000);
+    pthread_mutex_lock(&data_mutex);
+    bp_ok = bp_ok && refused && data_conns[8].total == accepted;
+    pthread_mutex_unlock(&data_mutex);
+    if (bp_ok) {
+        printf("[main] full write queue answered 429, accepted bytes all delivered\n");
+    } else {
+        fprintf(stderr, "[main] backpressure mismatch (accepted %zu, target got %zu)\n", accepted, data_conns[8].total);
+    }
+
+    // Metrics: counters and histograms in the Prometheus text format
+    static const char *const metrics_hdrs[] = { "PATH_INFO", "/metrics", NULL };
+    if (send_scgi(scgi_port, metrics_hdrs, NULL, 0, &resp, &resp_len) == 0) {
+        char *text = malloc(resp_len + 1);
+        memcpy(text, resp, resp_len); text[resp_len] = 0;
+        if (strstr(last_resp_hdr, "text/plain") && strstr(text, "tunnel_requests_total ") &&
+            strstr(text, "tunnel_bytes_total{dir=\"up\"}") && strstr(text, "tunnel_drain_seconds_count") &&
+            strstr(text, "tunnel_session_requests_total{session=\"duplex\"}")) {
+            printf("[main] metrics endpoint reported counters and histograms\n");
+        } else {
+            fprintf(stderr, "[main] metrics mismatch\n");
+        }
+        free(text); free(resp);
+    } else {
+        fprintf(stderr, "[main] metrics request failed\n");
+    }
+
+    // X-Tunnel-Close frees the session at once; a late request gets 410
+    static const char *const cl_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "cl", NULL };
+    static const char *const cl_close_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "cl", "HTTP_X_TUNNEL_CLOSE", "1", NULL };
+    long cl_sessions[2] = { -1, -1 };
+    int cl_ok = 1;
+    for (int i = 0; i < 2 && cl_ok; i++) {
+        const char *const *hdrs = i == 0 ? cl_hdrs : cl_close_hdrs;
+        cl_ok = send_scgi(scgi_port, hdrs, (const unsigned char *)"cl", 2, &resp, &resp_len) == 0;
+        if (cl_ok) free(resp);
+        cl_ok = cl_ok && send_scgi(scgi_port, metrics_hdrs, NULL, 0, &resp, &resp_len) == 0;
+        if (!cl_ok) break;
+        char *text = malloc(resp_len + 1);
+        memcpy(text, resp, resp_len); text[resp_len] = 0;
+        char *g = strstr(text, "\ntunnel_sessions ");
+        if (g) cl_sessions[i] = strtol(g + strlen("\ntunnel_sessions "), NULL, 10);
+        free(text); free(resp);
+    }
+    cl_ok = cl_ok && cl_sessions[0] > 0 && cl_sessions[1] == cl_sessions[0] - 1;
+    if (cl_ok && send_scgi(scgi_port, cl_hdrs, NULL, 0, &resp, &resp_len) == 0) { free(resp); cl_ok = 0; }
+    cl_ok = cl_ok && strstr(last_resp_hdr, "410") != NULL;
+    if (cl_ok) {
+        printf("[main] closed session freed, late request got 410\n");
+    } else {
+        fprintf(stderr, "[main] session close mismatch\n");
+    }
+
+    // HTTP/1.1 listener: requests share one keep-alive connection, pipelined
+    // or not, and a body sent after 100 Continue keeps the stream in step
+    static const char ka_one[] = "POST / HTTP/1.1\r\nHost: t\r\nX-Tunnel-Session: ka\r\nContent-Length: 3\r\n\r\none";
+    static const char ka_more[] = "POST /t HTTP/1.1\r\nX-Tunnel-Session: ka\r\nContent-Length: 3\r\n\r\ntwo"
+                                  "POST /t HTTP/1.1\r\nx-tunnel-session:ka\r\ncontent-length: 3\r\n\r\nthr";
+    static const char ka_expect[] = "POST / HTTP/1.1\r\nX-Tunnel-Session: ka\r\nExpect: 100-continue\r\nContent-Length: 4\r\n\r\n";
+    unsigned char ka_buf[64];
+    int hfd = connect_port(base + 3);
+    int ka_ok = hfd >= 0 && write(hfd, ka_one, sizeof(ka_one) - 1) == (ssize_t)(sizeof(ka_one) - 1) &&
+                read_http_reply(hfd, ka_buf, sizeof(ka_buf)) == 0;
+    usleep(100000);
+    int ka_conn = data_conn_count - 1;
+    if (ka_ok) ka_ok = write(data_conns[ka_conn].fd, "pong", 4) == 4;
+    usleep(100000);
+    ka_ok = ka_ok && write(hfd, ka_more, sizeof(ka_more) - 1) == (ssize_t)(sizeof(ka_more) - 1) &&
+            read_http_reply(hfd, ka_buf, sizeof(ka_buf)) == 4 && memcmp(ka_buf, "pong", 4) == 0 &&
+            read_http_reply(hfd, ka_buf, sizeof(ka_buf)) == 0;
+    ka_ok = ka_ok && write(hfd, ka_expect, sizeof(ka_expect) - 1) == (ssize_t)(sizeof(ka_expect) - 1) &&
+            read_resp_hdr(hfd) == 0 && strcmp(last_resp_hdr, "HTTP/1.1 100 Continue\r\n\r\n") == 0 &&
+            write(hfd, "four", 4) == 4 && read_http_reply(hfd, ka_buf, sizeof(ka_buf)) == 0;
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    ka_ok = ka_ok && data_conns[ka_conn].len == 13 && memcmp(data_conns[ka_conn].buf, "onetwothrfour", 13) == 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (ka_ok) {
+        printf("[main] HTTP keep-alive connection carried four requests, one after 100 Continue\n");
+    } else {
+        fprintf(stderr, "[main] HTTP keep-alive mismatch\n");
+    }
+    if (hfd >= 0) close(hfd);
+
+    // Replay: a retried post reaches the target once, an unacknowledged reply
+    // is sent again, and an ack past what was sent is refused
+    static const char *const rp0_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "rp", "HTTP_X_TUNNEL_OFFSET", "0", "HTTP_X_TUNNEL_ACK", "0", NULL };
+    static const char *const rp2_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "rp", "HTTP_X_TUNNEL_OFFSET", "2", "HTTP_X_TUNNEL_ACK", "0", NULL };
+    static const char *const rp_ack4_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "rp", "HTTP_X_TUNNEL_ACK", "4", NULL };
+    static const char *const rp_stripe_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "rp", "HTTP_X_TUNNEL_ACK", "0", "HTTP_X_TUNNEL_STRIPE", "1", NULL };
+    static const char *const rp_ack9_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "rp", "HTTP_X_TUNNEL_ACK", "9", NULL };
+    int rp_ok = send_scgi(scgi_port, rp0_hdrs, (const unsigned char *)"abc", 3, &resp, &resp_len) == 0;
+    if (rp_ok) free(resp);
+    usleep(100000);
+    int rp_conn = data_conn_count - 1;
+    rp_ok = rp_ok && send_scgi(scgi_port, rp0_hdrs, (const unsigned char *)"abc", 3, &resp, &resp_len) == 0;
+    if (rp_ok) free(resp);
+    rp_ok = rp_ok && send_scgi(scgi_port, rp2_hdrs, (const unsigned char *)"cdef", 4, &resp, &resp_len) == 0;
+    if (rp_ok) free(resp);
+    rp_ok = rp_ok && write(data_conns[rp_conn].fd, "xyz", 3) == 3;
+    usleep(100000);
+    rp_ok = rp_ok && send_scgi(scgi_port, rp0_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (rp_ok) { rp_ok = resp_len == 3 && memcmp(resp, "xyz", 3) == 0; free(resp); }
+    rp_ok = rp_ok && write(data_conns[rp_conn].fd, "!", 1) == 1;
+    usleep(100000);
+    // that reply was "lost": the same ack gets it again, followed by the new byte
+    rp_ok = rp_ok && send_scgi(scgi_port, rp0_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (rp_ok) {
+        rp_ok = resp_len == 4 && memcmp(resp, "xyz!", 4) == 0 && strstr(last_resp_hdr, "X-Tunnel-Offset: 0");
+        free(resp);
+    }
+    // those bytes sit in the replay pipe; a stripe poll needs them in memory
+    rp_ok = rp_ok && write(data_conns[rp_conn].fd, "?", 1) == 1;
+    usleep(100000);
+    rp_ok = rp_ok && send_scgi(scgi_port, rp_stripe_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (rp_ok) { rp_ok = resp_len == 1 && resp[0] == '?' && strstr(last_resp_hdr, "X-Tunnel-Offset: 4"); free(resp); }
+    rp_ok = rp_ok && send_scgi(scgi_port, rp_ack4_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (rp_ok) { rp_ok = resp_len == 1 && resp[0] == '?' && strstr(last_resp_hdr, "X-Tunnel-Offset: 4"); free(resp); }
+    int rp_fd = rp_ok ? open_scgi(scgi_port, rp_ack9_hdrs, NULL, 0) : -1;
+    if (rp_fd >= 0 && read_resp_hdr(rp_fd) == 0) { rp_ok = strstr(last_resp_hdr, "409 Conflict") != NULL; close(rp_fd); }
+    else rp_ok = 0;     // read_resp_hdr() closed it
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    rp_ok = rp_ok && data_conns[rp_conn].len == 6 && memcmp(data_conns[rp_conn].buf, "abcdef", 6) == 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (rp_ok) {
+        printf("[main] retried posts deduplicated, unacknowledged reply sent again\n");
+    } else {
+        fprintf(stderr, "[main] replay mismatch\n");
+    }
+
+    // Stripes: a post that overtakes the one before it waits for the gap,
+    // and stripe polls split the downstream instead of repeating it
+    static const char *const st0_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "st", "HTTP_X_TUNNEL_DIR", "up", "HTTP_X_TUNNEL_OFFSET", "0", NULL };
+    static const char *const st3_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "st", "HTTP_X_TUNNEL_DIR", "up", "HTTP_X_TUNNEL_OFFSET", "3", NULL };
+    static const char *const st_poll_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "st", "HTTP_X_TUNNEL_ACK", "0", "HTTP_X_TUNNEL_STRIPE", "1", NULL };
+    static const char *const st_ack3_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "st", "HTTP_X_TUNNEL_ACK", "3", NULL };
+    int st_fd = open_scgi(scgi_port, st3_hdrs, (const unsigned char *)"def", 3);
+    usleep(100000);
+    int st_ok = st_fd >= 0 && send_scgi(scgi_port, st0_hdrs, (const unsigned char *)"abc", 3, &resp, &resp_len) == 0;
+    if (st_ok) free(resp);
+    if (st_fd >= 0 && read_resp_hdr(st_fd) == 0) { st_ok = st_ok && strstr(last_resp_hdr, "200 OK") != NULL; close(st_fd); }
+    else st_ok = 0;
+    usleep(100000);
+    int st_conn = data_conn_count - 1;
+    pthread_mutex_lock(&data_mutex);
+    st_ok = st_ok && data_conns[st_conn].len == 6 && memcmp(data_conns[st_conn].buf, "abcdef", 6) == 0;
+    pthread_mutex_unlock(&data_mutex);
+    st_ok = st_ok && write(data_conns[st_conn].fd, "123", 3) == 3;
+    usleep(100000);
+    st_ok = st_ok && send_scgi(scgi_port, st_poll_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (st_ok) { st_ok = resp_len == 3 && memcmp(resp, "123", 3) == 0 && strstr(last_resp_hdr, "X-Tunnel-Offset: 0"); free(resp); }
+    st_ok = st_ok && write(data_conns[st_conn].fd, "45", 2) == 2;
+    usleep(100000);
+    st_ok = st_ok && send_scgi(scgi_port, st_poll_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (st_ok) { st_ok = resp_len == 2 && memcmp(resp, "45", 2) == 0 && strstr(last_resp_hdr, "X-Tunnel-Offset: 3"); free(resp); }
+    // a plain poll still gets everything unacknowledged
+    st_ok = st_ok && send_scgi(scgi_port, st_ack3_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (st_ok) { st_ok = resp_len == 2 && memcmp(resp, "45", 2) == 0 && strstr(last_resp_hdr, "X-Tunnel-Offset: 3"); free(resp); }
+    if (st_ok) {
+        printf("[main] striped posts reassembled in order, stripe polls got fresh bytes\n");
+    } else {
+        fprintf(stderr, "[main] stripe mismatch\n");
+    }
+
+    // Flow control: a reply stops at the poll's window, and every reply
+    // advertises the room left in the session's write queue
+    static const char *const wn4_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "wn", "HTTP_X_TUNNEL_WINDOW", "4", NULL };
+    static const char *const wn0_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "wn", "HTTP_X_TUNNEL_WINDOW", "0", "HTTP_X_TUNNEL_WAIT", "5000", NULL };
+    static const char *const wn_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "wn", NULL };
+    int wn_ok = send_scgi(scgi_port, wn4_hdrs, (const unsigned char *)"hi", 2, &resp, &resp_len) == 0;
+    if (wn_ok) { wn_ok = resp_len == 0 && strstr(last_resp_hdr, "X-Tunnel-Window: 262144"); free(resp); }
+    usleep(100000);
+    int wn_conn = data_conn_count - 1;
+    wn_ok = wn_ok && write(data_conns[wn_conn].fd, "abcdefgh", 8) == 8;
+    usleep(100000);
+    wn_ok = wn_ok && send_scgi(scgi_port, wn4_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (wn_ok) { wn_ok = resp_len == 4 && memcmp(resp, "abcd", 4) == 0 && strstr(last_resp_hdr, "X-Tunnel-More: 1"); free(resp); }
+    struct timespec wn_t0; clock_gettime(CLOCK_MONOTONIC, &wn_t0);
+    wn_ok = wn_ok && send_scgi(scgi_port, wn0_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (wn_ok) { wn_ok = resp_len == 0 && elapsed_since(&wn_t0) < 1.0; free(resp); }
+    wn_ok = wn_ok && send_scgi(scgi_port, wn_hdrs, NULL, 0, &resp, &resp_len) == 0;
+    if (wn_ok) { wn_ok = resp_len == 4 && memcmp(resp, "efgh", 4) == 0; free(resp); }
+    if (wn_ok) {
+        printf("[main] replies kept within the poll's window, queue room advertised\n");
+    } else {
+        fprintf(stderr, "[main] window mismatch\n");
+    }
+
+    // Worker shards: sessions hash to an owning worker whichever one accepts
+    sharded = fork();
+    if (sharded == 0) {
+        char port1[16], port2[16];
+        sprintf(port1, "%d", base + 2);
+        sprintf(port2, "%d", data_port);
+        execl("./tunnel_backend_server", "./tunnel_backend_server", "--metrics", "--workers", "4", port1, port2, NULL);
+        perror("execl");
+        _exit(1);
+    }
+    usleep(300000);
+    int shard_first = data_conn_count, shard_ok = 1;
+    char shard_sid[6][4];
+    for (int round = 0; round < 2 && shard_ok; round++) {
+        for (int i = 0; i < 6; i++) {
+            snprintf(shard_sid[i], sizeof(shard_sid[i]), "w%d", i);
+            const char *const hdrs[] = { "HTTP_X_TUNNEL_SESSION", shard_sid[i], NULL };
+            if (send_scgi(base + 2, hdrs, (const unsigned char *)shard_sid[i], 2, &resp, &resp_len) != 0) { shard_ok = 0; break; }
+            free(resp);
+        }
+    }
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    if (data_conn_count != shard_first + 6) shard_ok = 0;
+    for (int i = shard_first; shard_ok && i < data_conn_count; i++)
+        if (data_conns[i].len != 4 || memcmp(data_conns[i].buf, data_conns[i].buf + 2, 2) != 0) shard_ok = 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (shard_ok && send_scgi(base + 2, metrics_hdrs, NULL, 0, &resp, &resp_len) == 0) {
+        char *text = malloc(resp_len + 1);
+        memcpy(text, resp, resp_len); text[resp_len] = 0;
+        if (!strstr(text, "tunnel_sessions 6\n") || !strstr(text, "tunnel_requests_total 13\n")) shard_ok = 0;
+        free(text); free(resp);
+    }
+    if (shard_ok) {
+        printf("[main] worker shards kept each session on one target connection\n");
+    } else {
+        fprintf(stderr, "[main] worker shard mismatch\n");
+    }
+    kill(sharded, SIGTERM);
+    int shard_status = -1;
+    for (int i = 0; i < 40 && waitpid(sharded, &shard_status, WNOHANG) == 0; i++) usleep(50000);
+    if (WIFEXITED(shard_status) && WEXITSTATUS(shard_status) == 0) {
+        printf("[main] sharded backend shut down cleanly\n");
+        sharded = -1;
+    } else {
+        fprintf(stderr, "[main] sharded backend did not exit on SIGTERM\n");
+    }
+
+    // Target pool: spares are connected up front, a new session takes one
+    pooled = fork();
+    if (pooled == 0) {
+        char port1[16], port2[16];
+        sprintf(port1, "%d", base + 4);
+        sprintf(port2, "%d", data_port);
+        execl("./tunnel_backend_server", "./tunnel_backend_server", "--metrics", "--target-pool", "2", port1, port2, NULL);
+        perror("execl");
+        _exit(1);
+    }
+    int pool_first = data_conn_count;
+    usleep(300000);
+    int pool_ok = data_conn_count == pool_first + 2;
+    static const char *const pl_hdrs[] = { "HTTP_X_TUNNEL_SESSION", "pl", NULL };
+    pool_ok = pool_ok && send_scgi(base + 4, pl_hdrs, (const unsigned char *)"pp", 2, &resp, &resp_len) == 0;
+    if (pool_ok) free(resp);
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    pool_ok = pool_ok && data_conn_count == pool_first + 3 &&
+              data_conns[pool_first].len == 2 && memcmp(data_conns[pool_first].buf, "pp", 2) == 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (pool_ok && send_scgi(base + 4, metrics_hdrs, NULL, 0, &resp, &resp_len) == 0) {
+        char *text = malloc(resp_len + 1);
+        memcpy(text, resp, resp_len); text[resp_len] = 0;
+        if (!strstr(text, "tunnel_target_pool_idle 2\n") || !strstr(text, "tunnel_target_pool_total{result=\"hit\"} 1\n")) pool_ok = 0;
+        free(text); free(resp);
+    }
+    if (pool_ok) {
+        printf("[main] new session took a pre-connected target, pool refilled\n");
+    } else {
+        fprintf(stderr, "[main] target pool mismatch\n");
+    }
+
+    // io_uring engine: same traffic as the shard test, handoffs included
+    uringed = fork();
+    if (uringed == 0) {
+        char port1[16], port2[16];
+        sprintf(port1, "%d", base + 5);
+        sprintf(port2, "%d", data_port);
+        execl("./tunnel_backend_server", "./tunnel_backend_server", "--io-uring", "--workers", "2", port1, port2, NULL);
+        perror("execl");
+        _exit(1);
+    }
+    usleep(300000);
+    int ur_first = data_conn_count, ur_ok = 1;
+    char ur_sid[4][4];
+    for (int i = 0; i < 4 && ur_ok; i++) {
+        snprintf(ur_sid[i], sizeof(ur_sid[i]), "u%d", i);
+        const char *const hdrs[] = { "HTTP_X_TUNNEL_SESSION", ur_sid[i], NULL };
+        if (send_scgi(base + 5, hdrs, (const unsigned char *)ur_sid[i], 2, &resp, &resp_len) != 0) ur_ok = 0;
+        else free(resp);
+    }
+    usleep(100000);
+    pthread_mutex_lock(&data_mutex);
+    if (data_conn_count != ur_first + 4) ur_ok = 0;
+    for (int i = ur_first; ur_ok && i < data_conn_count; i++) {
+        // answer each session with its own id reversed
+        unsigned char rev[2] = { data_conns[i].buf[1], data_conns[i].buf[0] };
+        if (data_conns[i].len != 2 || data_conns[i].buf[0] != 'u' || write(data_conns[i].fd, rev, 2) != 2) ur_ok = 0;
+    }
+    pthread_mutex_unlock(&data_mutex);
+    usleep(100000);
+    for (int i = 0; i < 4 && ur_ok; i++) {
+        const char *const hdrs[] = { "HTTP_X_TUNNEL_SESSION", ur_sid[i], NULL };
+        if (send_scgi(base + 5, hdrs, NULL, 0, &resp, &resp_len) != 0) { ur_ok = 0; break; }
+        ur_ok = resp_len == 2 && resp[0] == ur_sid[i][1] && resp[1] == 'u';
+        free(resp);
+    }
+    // then bulk both ways on one session: bodies and replies of many ring reads
+    struct data_conn *ur_dc = NULL;
+    pthread_mutex_lock(&data_mutex);
+    for (int i = ur_first; i < data_conn_count; i++) if (data_conns[i].buf[1] == '0') ur_dc = &data_conns[i];
+    size_t ur_total = ur_dc ? ur_dc->total : 0;
+    unsigned long ur_sum = ur_dc ? ur_dc->sum : 0;
+    pthread_mutex_unlock(&data_mutex);
+    unsigned char *ur_bulk = malloc(BULK_LEN), *ur_in = malloc(BULK_LEN);
+    fill_pattern(ur_bulk, BULK_LEN);
+    for (size_t i = 0; i < BULK_LEN; i++) ur_sum += ur_bulk[i];
+    const char *const ur_hdrs[] = { "HTTP_X_TUNNEL_SESSION", ur_sid[0], NULL };
+    if (ur_ok && ur_dc && send_scgi(base + 5, ur_hdrs, ur_bulk, BULK_LEN, &resp, &resp_len) == 0) free(resp);
+    else ur_ok = 0;
+    usleep(200000);
+    pthread_mutex_lock(&data_mutex);
+    if (ur_ok && (ur_dc->total != ur_total + BULK_LEN || ur_dc->sum != ur_sum)) ur_ok = 0;
+    pthread_mutex_unlock(&data_mutex);
+    if (ur_ok) {
+        pthread_t ur_tid;
+        pthread_create(&ur_tid, NULL, bulk_writer_thread, ur_dc);
+        size_t ur_got = 0;
+        for (int i = 0; i < 200 && ur_got < BULK_LEN; i++) {
+            if (send_scgi(base + 5, ur_hdrs, NULL, 0, &resp, &resp_len) != 0) break;
+            if (ur_got + resp_len <= BULK_LEN) memcpy(ur_in + ur_got, resp, resp_len);
+            ur_got += resp_len;
+            free(resp);
+        }
+        pthread_join(ur_tid, NULL);
+        ur_ok = ur_got == BULK_LEN && memcmp(ur_in, ur_bulk, BULK_LEN) == 0;
+    }
+    free(ur_bulk); free(ur_in);
+    kill(uringed, SIGTERM);
+    int ur_status = -1;
+    for (int i = 0; i < 40 && waitpid(uringed, &ur_status, WNOHANG) == 0; i++) usleep(50000);
+    if (WIFEXITED(ur_status) && WEXITSTATUS(ur_status) == 0) uringed = -1;
+    else ur_ok = 0;
+    if (ur_ok) {
+        printf("[main] io_uring engine relayed four sessions over two workers and bulk both ways, shut down cleanly\n");
+    } else {
+        fprintf(stderr, "[main] io_uring engine mismatch\n");
+    }
+
 cleanup:
     kill(child, SIGKILL);
     waitpid(child, NULL, 0);
+    if (sharded > 0) { kill(sharded, SIGKILL); waitpid(sharded, NULL, 0); }
+    if (pooled > 0) { kill(pooled, SIGKILL); waitpid(pooled, NULL, 0); }
+    if (uringed > 0) { kill(uringed, SIGKILL); waitpid(uringed, NULL, 0); }
     done_flag = 1;
-    if (data_conn_fd >= 0) {
-        shutdown(data_conn_fd, SHUT_RDWR);
-        close(data_conn_fd);
-    }
+    pthread_mutex_lock(&data_mutex);
+    for (int i = 0; i < data_conn_count; i++) shutdown(data_conns[i].fd, SHUT_RDWR);
+    pthread_mutex_unlock(&data_mutex);
+    if (data_srv_fd >= 0) shutdown(data_srv_fd, SHUT_RDWR);
     pthread_join(tid, NULL);
+    if (data_srv_fd >= 0) close(data_srv_fd);
     printf("[main] test complete\n");
     return 0;
 }
@@ -1,20 +1,51 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
-static unsigned char req1[1024];
-static size_t req1_len = 0;
-static unsigned char req2[1024];
-static size_t req2_len = 0;
+#define MAX_REQS 256
+#define BIG_LEN (4 << 20)   // "big" gets this many pattern bytes back
+#define ZIP_LEN (1 << 20)   // "zip..." gets this much text back, deflated if accepted
+#define STRIPE_LEN (1 << 20)    // uploaded through --stripes
+
+struct http_req {
+    char session[64];
+    unsigned char body[1024];
+    size_t body_len;
+    int close_req;
+    char dir[8];
+    int deflated;           // the body came with X-Tunnel-Encoding: deflate
+    char offset[24];        // X-Tunnel-Offset
+    char window[24];        // X-Tunnel-Window
+};
+
+static struct http_req reqs[MAX_REQS];
+static int req_count = 0;
+static int http_srv_fd = -1;
+static pthread_mutex_t req_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t duplex_cond = PTHREAD_COND_INITIALIZER;
+static char duplex_reply[64];       // answer for the next downstream poll
+static char duplex_session[64];     // ...of this session
+static char more_session[64];       // "more" was answered with X-Tunnel-More for this session
+static char stripe_session[64];     // large posts of this session are striped
+static unsigned char *stripe_data;  // ...and land here by X-Tunnel-Offset
+static size_t stripe_got;
+static int stripe_inflight, stripe_peak;
+static char window_session[64];     // replies to this session advertise a 100-byte window
 
 static int read_full(int fd, unsigned char *buf, size_t n) {
     size_t off = 0;
@@ -26,6 +57,228 @@ static int read_full(int fd, unsigned char *buf, size_t n) {
     return 0;
 }
 
+static void header_value(const char *hdr, const char *name, char *out, size_t n) {
+    out[0] = 0;
+    const char *p = strcasestr(hdr, name);
+    if (!p) return;
+    p += strlen(name);
+    while (*p == ' ') p++;
+    size_t i = 0;
+    while (p[i] && p[i] != '\r' && i + 1 < n) { out[i] = p[i]; i++; }
+    out[i] = 0;
+}
+
+// Scripted stand-in for the backend: "hello" gets "world", the first empty
+// poll after it gets "again", "second" gets "ok2", anything else nothing.
+static const char *choose_response(const struct http_req *r, int *first_poll_done) {
+    if (r->body_len == 5 && memcmp(r->body, "hello", 5) == 0) return "world";
+    if (r->body_len == 6 && memcmp(r->body, "second", 6) == 0) return "ok2";
+    if (r->body_len == 0 && !r->close_req && !*first_poll_done) { *first_poll_done = 1; return "again"; }
+    return "";
+}
+
+static int has_reply(const char *session) {
+    return duplex_reply[0] && strcmp(duplex_session, session) == 0;
+}
+
+// Full duplex: an upstream post is answered empty and its echo handed to
+// the downstream poll, which the stand-in holds for up to two seconds.
+static const char *duplex_response(const struct http_req *r, char *out, size_t n) {
+    out[0] = 0;
+    if (strcmp(r->dir, "up") == 0) {
+        snprintf(duplex_reply, sizeof(duplex_reply), "got %.*s", (int)r->body_len, (const char*)r->body);
+        snprintf(duplex_session, sizeof(duplex_session), "%s", r->session);
+        pthread_cond_broadcast(&duplex_cond);
+    } else {
+        struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 2;
+        while (!has_reply(r->session) && pthread_cond_timedwait(&duplex_cond, &req_mutex, &ts) == 0) {}
+        if (has_reply(r->session)) {
+            snprintf(out, n, "%s", duplex_reply);
+            duplex_reply[0] = 0;
+        }
+    }
+    return out;
+}
+
+// Streaming: the reply stays open and carries a greeting, then the echo of
+// each upstream post, until two seconds pass without one.
+static void stream_response(int conn, const char *session) {
+    static int streams = 0;
+    const char hdr[] = "HTTP/1.1 200 OK\r\nX-Tunnel-Stream: 1\r\nConnection: close\r\n\r\n";
+    if (write(conn, hdr, sizeof(hdr) - 1) != (ssize_t)(sizeof(hdr) - 1)) return;
+    pthread_mutex_lock(&req_mutex);
+    if (streams++ == 0 && write(conn, "hi!", 3) != 3) perror("write stream");
+    for (;;) {
+        struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 2;
+        while (!has_reply(session) && pthread_cond_timedwait(&duplex_cond, &req_mutex, &ts) == 0) {}
+        if (!has_reply(session)) break;
+        size_t n = strlen(duplex_reply);
+        if (write(conn, duplex_reply, n) != (ssize_t)n) break;
+        duplex_reply[0] = 0;
+    }
+    pthread_mutex_unlock(&req_mutex);
+}
+
+static void *http_conn_thread(void *arg) {
+    int conn = (int)(intptr_t)arg;
+    static int first_poll_done = 0;
+    char hdr[1024]; size_t h = 0;
+    while (h < sizeof(hdr) - 1) {
+        ssize_t r = read(conn, hdr + h, 1);
+        if (r <= 0) { close(conn); return NULL; }
+        h += (size_t)r;
+        if (h >= 4 && memcmp(hdr + h - 4, "\r\n\r\n", 4) == 0) break;
+    }
+    hdr[h] = 0;
+    char cl[32];
+    header_value(hdr, "Content-Length:", cl, sizeof(cl));
+    int len = atoi(cl);
+    struct http_req r; memset(&r, 0, sizeof(r));
+    header_value(hdr, "X-Tunnel-Session:", r.session, sizeof(r.session));
+    header_value(hdr, "X-Tunnel-Dir:", r.dir, sizeof(r.dir));
+    header_value(hdr, "X-Tunnel-Offset:", r.offset, sizeof(r.offset));
+    header_value(hdr, "X-Tunnel-Window:", r.window, sizeof(r.window));
+    r.close_req = strcasestr(hdr, "X-Tunnel-Close:") != NULL;
+    r.deflated = strcasestr(hdr, "X-Tunnel-Encoding: deflate") != NULL;
+    int accept_deflate = strcasestr(hdr, "X-Tunnel-Accept-Encoding: deflate") != NULL;
+    if (len > 0 && (size_t)len <= sizeof(r.body)) {
+        if (read_full(conn, r.body, (size_t)len) < 0) { perror("read body"); close(conn); return NULL; }
+        r.body_len = (size_t)len;
+    }
+    if (r.deflated) {
+        unsigned char wire[sizeof(r.body)];
+        uLongf n = sizeof(r.body);
+        memcpy(wire, r.body, r.body_len);
+        if (uncompress(r.body, &n, wire, r.body_len) != Z_OK) n = 0;
+        r.body_len = n;
+    }
+    pthread_mutex_lock(&req_mutex);
+    int striped = strcmp(r.dir, "up") == 0 && len > 0 &&
+                  ((size_t)len > sizeof(r.body) || strcmp(stripe_session, r.session) == 0);
+    if (striped) { snprintf(stripe_session, sizeof(stripe_session), "%s", r.session); stripe_inflight++; }
+    if (stripe_inflight > stripe_peak) stripe_peak = stripe_inflight;
+    pthread_mutex_unlock(&req_mutex);
+    if (striped) {
+        // a bulk upload over a slow link: every post takes 100 ms
+        unsigned char *chunk = malloc((size_t)len);
+        int ok = chunk && read_full(conn, chunk, (size_t)len) == 0;
+        usleep(100000);
+        size_t off = strtoull(r.offset, NULL, 10);
+        pthread_mutex_lock(&req_mutex);
+        if (ok && off + (size_t)len <= STRIPE_LEN) { memcpy(stripe_data + off, chunk, (size_t)len); stripe_got += (size_t)len; }
+        stripe_inflight--;
+        pthread_mutex_unlock(&req_mutex);
+        const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+        if (write(conn, resp, sizeof(resp) - 1) < 0) perror("write stripe");
+        free(chunk);
+        close(conn);
+        return NULL;
+    }
+    if (strcmp(r.dir, "stream") == 0) {
+        pthread_mutex_lock(&req_mutex);
+        if (req_count < MAX_REQS) reqs[req_count++] = r;
+        pthread_mutex_unlock(&req_mutex);
+        stream_response(conn, r.session);
+        close(conn);
+        return NULL;
+    }
+    if (r.body_len == 3 && memcmp(r.body, "big", 3) == 0) {
+        char resp[128];
+        int l = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", BIG_LEN);
+        unsigned char *big = malloc(BIG_LEN);
+        for (size_t i = 0; i < BIG_LEN; i++) big[i] = (unsigned char)(i % 251);
+        if (write(conn, resp, l) != l || write(conn, big, BIG_LEN) != BIG_LEN) perror("write big");
+        free(big);
+        close(conn);
+        return NULL;
+    }
+    if (r.body_len >= 3 && memcmp(r.body, "zip", 3) == 0) {
+        pthread_mutex_lock(&req_mutex);
+        if (req_count < MAX_REQS) reqs[req_count++] = r;
+        pthread_mutex_unlock(&req_mutex);
+        unsigned char *text = malloc(ZIP_LEN), *wire = malloc(ZIP_LEN);
+        for (size_t i = 0; i < ZIP_LEN; i++) text[i] = (unsigned char)"zipped text "[i % 12];
+        uLongf n = ZIP_LEN;
+        int z = accept_deflate && compress(wire, &n, text, ZIP_LEN) == Z_OK;
+        char resp[160];
+        int l = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n%s\r\n",
+                         z ? (unsigned long)n : (unsigned long)ZIP_LEN, z ? "X-Tunnel-Encoding: deflate\r\n" : "");
+        if (write(conn, resp, l) != l || write(conn, z ? wire : text, z ? n : ZIP_LEN) < 0) perror("write zip");
+        free(text); free(wire);
+        close(conn);
+        return NULL;
+    }
+    if (r.body_len == 4 && memcmp(r.body, "busy", 4) == 0) {
+        // a full write queue: refuse the first two tries
+        static int busy_tries = 0;
+        pthread_mutex_lock(&req_mutex);
+        int refuse = busy_tries++ < 2;
+        if (req_count < MAX_REQS) reqs[req_count++] = r;
+        pthread_mutex_unlock(&req_mutex);
+        const char *resp = refuse ? "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nX-Tunnel-Queue: 99\r\n\r\n"
+                                  : "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\ndone";
+        if (write(conn, resp, strlen(resp)) < 0) perror("write busy");
+        close(conn);
+        return NULL;
+    }
+    if ((r.body_len == 4 && memcmp(r.body, "more", 4) == 0) ||
+        (r.body_len == 0 && !r.close_req && more_session[0] && strcmp(more_session, r.session) == 0)) {
+        // a reply cut at the backend's cap: the rest goes to the next poll
+        pthread_mutex_lock(&req_mutex);
+        int first = r.body_len > 0;
+        snprintf(more_session, sizeof(more_session), "%s", first ? r.session : "");
+        if (req_count < MAX_REQS) reqs[req_count++] = r;
+        pthread_mutex_unlock(&req_mutex);
+        const char *resp = first ? "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nX-Tunnel-More: 1\r\n\r\nm1"
+                                 : "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nm2";
+        if (write(conn, resp, strlen(resp)) < 0) perror("write more");
+        close(conn);
+        return NULL;
+    }
+    if (r.body_len == 5 && memcmp(r.body, "flaky", 5) == 0) {
+        // the first try is lost on the way back: the connection just drops
+        static int flaky_tries = 0;
+        pthread_mutex_lock(&req_mutex);
+        int drop = flaky_tries++ == 0;
+        if (req_count < MAX_REQS) reqs[req_count++] = r;
+        pthread_mutex_unlock(&req_mutex);
+        const char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nfine";
+        if (!drop && write(conn, resp, sizeof(resp) - 1) < 0) perror("write flaky");
+        close(conn);
+        return NULL;
+    }
+    if ((r.body_len == 3 && memcmp(r.body, "win", 3) == 0) || (window_session[0] && strcmp(window_session, r.session) == 0)) {
+        // a backend whose write queue has 100 bytes of room
+        pthread_mutex_lock(&req_mutex);
+        int first = !window_session[0];
+        snprintf(window_session, sizeof(window_session), "%s", r.session);
+        if (req_count < MAX_REQS) reqs[req_count++] = r;
+        pthread_mutex_unlock(&req_mutex);
+        const char *resp = first ? "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nX-Tunnel-Window: 100\r\n\r\nok"
+                                 : "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nX-Tunnel-Window: 100\r\n\r\n";
+        if (write(conn, resp, strlen(resp)) < 0) perror("write window");
+        close(conn);
+        return NULL;
+    }
+    if (r.body_len == 4 && memcmp(r.body, "slow", 4) == 0) usleep(200000);   // fakes a long RTT
+    char dbuf[64];
+    pthread_mutex_lock(&req_mutex);
+    const char *body = r.dir[0] ? duplex_response(&r, dbuf, sizeof(dbuf)) : choose_response(&r, &first_poll_done);
+    if (req_count < MAX_REQS) reqs[req_count++] = r;
+    pthread_mutex_unlock(&req_mutex);
+    int blen = strlen(body);
+    char resp[256];
+    int l = snprintf(resp, sizeof(resp),
+                     "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",
+                     blen);
+    if (write(conn, resp, l) != l) perror("write resp hdr");
+    if (blen > 0 && write(conn, body, blen) != blen) perror("write resp body");
+    close(conn);
+    return NULL;
+}
+
 static void *http_server_thread(void *arg) {
     int port = *(int *)arg;
     int srv = socket(AF_INET, SOCK_STREAM, 0);
@@ -36,73 +289,168 @@ static void *http_server_thread(void *arg) {
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     addr.sin_port = htons((uint16_t)port);
     if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("http bind"); exit(1); }
-    if (listen(srv, 1) < 0) { perror("http listen"); exit(1); }
-    for (int i = 0; i < 2; i++) {
+    if (listen(srv, 16) < 0) { perror("http listen"); exit(1); }
+    http_srv_fd = srv;
+    for (;;) {
         int conn = accept(srv, NULL, NULL);
-        if (conn < 0) { perror("http accept"); exit(1); }
-        char hdr[1024]; size_t h = 0;
-        while (h < sizeof(hdr) - 1) {
-            ssize_t r = read(conn, hdr + h, 1);
-            if (r <= 0) { perror("read hdr"); exit(1); }
-            h += (size_t)r;
-            if (h >= 4 && memcmp(hdr + h - 4, "\r\n\r\n", 4) == 0) break;
-        }
-        hdr[h] = 0;
-        const char *cl = strstr(hdr, "Content-Length:");
-        int len = cl ? atoi(cl + strlen("Content-Length:")) : 0;
-        unsigned char buf[1024];
-        if (len > 0) {
-            if (read_full(conn, buf, (size_t)len) < 0) { perror("read body"); exit(1); }
-        }
-        if (i == 0) { memcpy(req1, buf, (size_t)len); req1_len = (size_t)len; }
-        else { memcpy(req2, buf, (size_t)len); req2_len = (size_t)len; }
-        const char *body = (i == 0) ? "world" : "again";
-        int blen = strlen(body);
-        char resp[256];
-        int l = snprintf(resp, sizeof(resp),
-                         "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n",
-                         blen);
-        if (write(conn, resp, l) != l) { perror("write resp hdr"); exit(1); }
-        if (blen > 0 && write(conn, body, blen) != blen) { perror("write resp body"); exit(1); }
-        close(conn);
+        if (conn < 0) break;    // listener shut down: test is over
+        pthread_t ct;
+        if (pthread_create(&ct, NULL, http_conn_thread, (void*)(intptr_t)conn) != 0) { close(conn); continue; }
+        pthread_detach(ct);
     }
-    close(srv);
     return NULL;
 }
 
-int main() {
-    int base = 30000 + (getpid() % 10000);
-    int front_port = base;
-    int http_port = base + 1;
+// Minimal h2c stand-in for --h2c: request headers are not decoded, every
+// stream is answered from its body by choose_response() (polls get nothing),
+// and connections and streams are counted.
+#define H2_MAX_STREAMS 64
+static int h2_srv_fd = -1;
+static int h2_conns, h2_streams;
 
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, http_server_thread, &http_port) != 0) {
-        perror("pthread_create");
-        return 1;
+static int h2_frame(int conn, uint8_t type, uint8_t flags, uint32_t stream, const void *payload, size_t len) {
+    unsigned char hdr[9] = { (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len, type, flags,
+                             (unsigned char)(stream >> 24), (unsigned char)(stream >> 16), (unsigned char)(stream >> 8),
+                             (unsigned char)stream };
+    if (write(conn, hdr, 9) != 9) return -1;
+    return len == 0 || write(conn, payload, len) == (ssize_t)len ? 0 : -1;
+}
+
+static void h2_reply(int conn, uint32_t stream, const struct http_req *r) {
+    int polls_done = 1;
+    const char *resp = choose_response(r, &polls_done);
+    size_t n = strlen(resp);
+    // :status 200 from the static table, content-length as a plain literal
+    unsigned char block[40]; size_t b = 0;
+    char len_s[16]; int vl = snprintf(len_s, sizeof(len_s), "%zu", n);
+    block[b++] = 0x88; block[b++] = 0x00; block[b++] = 14;
+    memcpy(block + b, "content-length", 14); b += 14;
+    block[b++] = (unsigned char)vl; memcpy(block + b, len_s, (size_t)vl); b += (size_t)vl;
+    h2_frame(conn, 1, n ? 0x4 : 0x5, stream, block, b);     // END_HEADERS, END_STREAM when empty
+    if (n) h2_frame(conn, 0, 0x1, stream, resp, n);
+}
+
+static void *h2_conn_thread(void *arg) {
+    int conn = (int)(intptr_t)arg;
+    static const unsigned char window_inc[4] = { 0, 1, 0, 0 };
+    unsigned char preface[24], hdr[9], payload[16384 + 256];
+    struct { uint32_t id; struct http_req r; } st[H2_MAX_STREAMS];
+    int nst = 0;
+    if (read_full(conn, preface, 24) < 0 || memcmp(preface, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) != 0 ||
+        h2_frame(conn, 4, 0, 0, NULL, 0) < 0) { close(conn); return NULL; }
+    pthread_mutex_lock(&req_mutex); h2_conns++; pthread_mutex_unlock(&req_mutex);
+    while (read_full(conn, hdr, 9) == 0) {
+        size_t len = (size_t)hdr[0] << 16 | (size_t)hdr[1] << 8 | hdr[2];
+        uint8_t type = hdr[3], flags = hdr[4];
+        uint32_t id = ((uint32_t)hdr[5] << 24 | (uint32_t)hdr[6] << 16 | (uint32_t)hdr[7] << 8 | hdr[8]) & 0x7fffffff;
+        if (len > sizeof(payload) || read_full(conn, payload, len) < 0) break;
+        if (type == 4 && !(flags & 1)) h2_frame(conn, 4, 1, 0, NULL, 0);            // SETTINGS: ack
+        else if (type == 6 && !(flags & 1)) h2_frame(conn, 6, 1, 0, payload, len);  // PING: pong
+        else if (type == 7) break;                                                  // GOAWAY
+        else if ((type == 0 || type == 1) && id) {                                  // DATA, HEADERS
+            int i = 0;
+            while (i < nst && st[i].id != id) i++;
+            if (i == nst) {
+                if (nst == H2_MAX_STREAMS) break;
+                st[nst].id = id; memset(&st[nst].r, 0, sizeof(st[nst].r)); nst++;
+            }
+            if (type == 0 && len > 0) {
+                struct http_req *r = &st[i].r;
+                size_t take = len < sizeof(r->body) - r->body_len ? len : sizeof(r->body) - r->body_len;
+                memcpy(r->body + r->body_len, payload, take); r->body_len += take;
+                h2_frame(conn, 8, 0, 0, window_inc, 4);     // keep the connection window open
+            }
+            if (flags & 1) {                                // END_STREAM: the request is complete
+                h2_reply(conn, id, &st[i].r);
+                pthread_mutex_lock(&req_mutex); h2_streams++; pthread_mutex_unlock(&req_mutex);
+                st[i] = st[--nst];
+            }
+        }
     }
+    close(conn);
+    return NULL;
+}
 
+static void *h2_server_thread(void *arg) {
+    int port = *(int *)arg;
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv < 0) { perror("h2 server socket"); exit(1); }
+    int one = 1; setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("h2 bind"); exit(1); }
+    if (listen(srv, 16) < 0) { perror("h2 listen"); exit(1); }
+    h2_srv_fd = srv;
+    for (;;) {
+        int conn = accept(srv, NULL, NULL);
+        if (conn < 0) break;
+        pthread_t ct;
+        if (pthread_create(&ct, NULL, h2_conn_thread, (void*)(intptr_t)conn) != 0) { close(conn); continue; }
+        pthread_detach(ct);
+    }
+    return NULL;
+}
+
+static const char *frontend_log = NULL;   // when set, the next frontend's stderr goes here
+
+static pid_t start_frontend(int port, int http_port, const char *extra1, const char *extra2) {
     pid_t child = fork();
     if (child == 0) {
-        char port_s[16]; sprintf(port_s, "%d", front_port);
+        if (frontend_log) {
+            int lf = open(frontend_log, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (lf >= 0) { dup2(lf, 2); close(lf); }
+        }
+        char port_s[16]; sprintf(port_s, "%d", port);
         char url[64]; sprintf(url, "http://127.0.0.1:%d", http_port);
-        execl("./tunnel_frontend_server", "./tunnel_frontend_server", port_s, url, NULL);
-        perror("execl");
+        const char *argv[6]; int n = 0;
+        argv[n++] = "./tunnel_frontend_server";
+        if (extra1) argv[n++] = extra1;
+        if (extra2) argv[n++] = extra2;
+        argv[n++] = port_s; argv[n++] = url; argv[n] = NULL;
+        execv(argv[0], (char *const *)argv);
+        perror("execv");
         _exit(1);
     }
+    return child;
+}
 
-    sleep(1); // allow frontend to start
-
+static int connect_frontend(int port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) { perror("client socket"); return 1; }
+    if (fd < 0) { perror("client socket"); return -1; }
     struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    addr.sin_port = htons((uint16_t)front_port);
+    addr.sin_port = htons((uint16_t)port);
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("connect frontend");
+        close(fd);
+        return -1;
+    }
+    struct timeval tv = { 5, 0 };   // never hang the test on a stuck frontend
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+int main() {
+    int base = 30000 + (getpid() % 10000);
+    int front_port = base;
+    int http_port = base + 1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, http_server_thread, &http_port) != 0) {
+        perror("pthread_create");
         return 1;
     }
 
+    pid_t child = start_frontend(front_port, http_port, NULL, NULL);
+
+    sleep(1); // allow frontend to start
+
+    int fd = connect_frontend(front_port);
+    if (fd < 0) return 1;
+
     const unsigned char msg[] = "hello";
     if (write(fd, msg, sizeof(msg) - 1) != (ssize_t)(sizeof(msg) - 1)) {
         perror("write msg");
@@ -124,20 +472,371 @@ int main() {
         fprintf(stderr, "[test] poll response mismatch\n");
     }
 
-    if (req1_len == sizeof(msg) - 1 && memcmp(req1, msg, sizeof(msg) - 1) == 0) {
+    // A second local connection is served while the first is still open
+    int fd2 = connect_frontend(front_port);
+    const unsigned char msg2[] = "second";
+    if (fd2 >= 0 && write(fd2, msg2, sizeof(msg2) - 1) == (ssize_t)(sizeof(msg2) - 1) &&
+        read_full(fd2, buf, 3) == 0 && memcmp(buf, "ok2", 3) == 0) {
+        printf("[test] concurrent connection served\n");
+    } else {
+        fprintf(stderr, "[test] concurrent connection mismatch\n");
+    }
+    if (fd2 >= 0) close(fd2);
+    usleep(300000);     // let the frontend report the closed connection
+
+    pthread_mutex_lock(&req_mutex);
+    if (req_count >= 2 && reqs[0].body_len == sizeof(msg) - 1 &&
+        memcmp(reqs[0].body, msg, sizeof(msg) - 1) == 0) {
         printf("[test] server received first body\n");
     } else {
         fprintf(stderr, "[test] server body mismatch on first\n");
     }
-    if (req2_len == 0) {
+    if (req_count >= 2 && reqs[1].body_len == 0) {
         printf("[test] second request had empty body\n");
     } else {
         fprintf(stderr, "[test] second request body not empty\n");
     }
+    const struct http_req *r2 = NULL;
+    int closed2 = 0;
+    for (int i = 0; i < req_count; i++) {
+        if (reqs[i].body_len == sizeof(msg2) - 1 && memcmp(reqs[i].body, msg2, sizeof(msg2) - 1) == 0) r2 = &reqs[i];
+        if (r2 && reqs[i].close_req && strcmp(reqs[i].session, r2->session) == 0) closed2 = 1;
+    }
+    if (reqs[0].session[0] && r2 && strcmp(reqs[0].session, reqs[1].session) == 0 &&
+        strcmp(reqs[0].session, r2->session) != 0) {
+        printf("[test] each connection has its own session\n");
+    } else {
+        fprintf(stderr, "[test] session id mismatch\n");
+    }
+    if (closed2) {
+        printf("[test] closed connection ended its session\n");
+    } else {
+        fprintf(stderr, "[test] no close request for ended connection\n");
+    }
+    pthread_mutex_unlock(&req_mutex);
+
+    // A 429 keeps the bytes in the frontend, which offers them again
+    int fd8 = connect_frontend(front_port);
+    int busy_ok = fd8 >= 0 && write(fd8, "busy", 4) == 4 && read_full(fd8, buf, 4) == 0 && memcmp(buf, "done", 4) == 0;
+    int busy_posts = 0;
+    pthread_mutex_lock(&req_mutex);
+    for (int i = 0; i < req_count; i++)
+        if (reqs[i].body_len == 4 && memcmp(reqs[i].body, "busy", 4) == 0) busy_posts++;
+    pthread_mutex_unlock(&req_mutex);
+    if (busy_ok && busy_posts == 3) {
+        printf("[test] refused post retried until accepted\n");
+    } else {
+        fprintf(stderr, "[test] 429 retry mismatch (%d posts)\n", busy_posts);
+    }
+    if (fd8 >= 0) close(fd8);
+
+    // A large reply to a slow reader is paused, not buffered whole
+    int fd5 = connect_frontend(front_port);
+    int big_ok = fd5 >= 0 && write(fd5, "big", 3) == 3;
+    usleep(500000);     // let the frontend hit backpressure first
+    unsigned char *big = malloc(BIG_LEN);
+    if (big_ok && read_full(fd5, big, BIG_LEN) == 0) {
+        for (size_t i = 0; i < BIG_LEN && big_ok; i++) big_ok = big[i] == (unsigned char)(i % 251);
+    } else {
+        big_ok = 0;
+    }
+    free(big);
+    if (big_ok) {
+        printf("[test] large reply reached a slow reader intact\n");
+    } else {
+        fprintf(stderr, "[test] large reply mismatch\n");
+    }
+    if (fd5 >= 0) close(fd5);
+
+    // Small writes in quick succession share one post once the RTT is known
+    int co_port = base + 4;
+    pid_t co_child = start_frontend(co_port, http_port, "--coalesce", "50");
+    usleep(500000);
+    int fd6 = connect_frontend(co_port);
+    if (fd6 >= 0 && write(fd6, "slow", 4) == 4) {
+        usleep(400000);     // the slow exchange sets the smoothed RTT
+        for (const char *p = "abc"; *p; p++) {
+            if (write(fd6, p, 1) != 1) perror("write coalesce");
+            usleep(1000);
+        }
+        usleep(300000);
+    }
+    int coalesced = 0, split = 0;
+    pthread_mutex_lock(&req_mutex);
+    for (int i = 0; i < req_count; i++) {
+        if (reqs[i].body_len == 3 && memcmp(reqs[i].body, "abc", 3) == 0) coalesced = 1;
+        if (reqs[i].body_len == 1 && reqs[i].body[0] == 'a') split = 1;
+    }
+    pthread_mutex_unlock(&req_mutex);
+    if (coalesced && !split) {
+        printf("[test] small writes coalesced into one post\n");
+    } else {
+        fprintf(stderr, "[test] coalescing mismatch\n");
+    }
+    if (fd6 >= 0) close(fd6);
+    kill(co_child, SIGKILL);
+    waitpid(co_child, NULL, 0);
+
+    // Compression: text goes up deflated, noise goes up raw, and a deflated
+    // reply far larger than the output ring reaches a slow reader intact
+    int z_port = base + 5;
+    pid_t z_child = start_frontend(z_port, http_port, "--compress", NULL);
+    usleep(500000);
+    int fd7 = connect_frontend(z_port);
+    unsigned char zmsg[900];
+    memset(zmsg, 'z', sizeof(zmsg));
+    memcpy(zmsg, "zip", 3);
+    int zip_ok = fd7 >= 0 && write(fd7, zmsg, sizeof(zmsg)) == (ssize_t)sizeof(zmsg);
+    usleep(300000);     // the deflated reply backs up in the frontend
+    unsigned char *ztext = malloc(ZIP_LEN);
+    if (zip_ok && read_full(fd7, ztext, ZIP_LEN) == 0) {
+        for (size_t i = 0; i < ZIP_LEN && zip_ok; i++) zip_ok = ztext[i] == (unsigned char)"zipped text "[i % 12];
+    } else {
+        zip_ok = 0;
+    }
+    free(ztext);
+    for (size_t i = 0; i < sizeof(zmsg); i++) zmsg[i] = (unsigned char)(rand() >> 7);
+    zmsg[0] = 'n';
+    if (fd7 >= 0 && write(fd7, zmsg, sizeof(zmsg)) != (ssize_t)sizeof(zmsg)) perror("write noise");
+    usleep(300000);
+    int up_deflated = 0, noise_raw = 0;
+    pthread_mutex_lock(&req_mutex);
+    for (int i = 0; i < req_count; i++) {
+        if (reqs[i].deflated && reqs[i].body_len == sizeof(zmsg) && memcmp(reqs[i].body, "zipzzz", 6) == 0)
+            up_deflated = 1;
+        if (!reqs[i].deflated && reqs[i].body_len == sizeof(zmsg) && memcmp(reqs[i].body, zmsg, sizeof(zmsg)) == 0)
+            noise_raw = 1;
+    }
+    pthread_mutex_unlock(&req_mutex);
+    if (zip_ok && up_deflated && noise_raw) {
+        printf("[test] compression negotiated both ways, noise sent raw\n");
+    } else {
+        fprintf(stderr, "[test] compression mismatch\n");
+    }
+    if (fd7 >= 0) close(fd7);
+    kill(z_child, SIGKILL);
+    waitpid(z_child, NULL, 0);
+
+    // Full duplex: data goes up while the downstream poll is still held
+    int dup_port = base + 2;
+    pid_t dup_child = start_frontend(dup_port, http_port, "--full-duplex", "--long-poll=2000");
+    usleep(500000);
+    int fd3 = connect_frontend(dup_port);
+    usleep(200000);     // the downstream poll is now parked at the stand-in
+    const unsigned char msg3[] = "abc";
+    if (fd3 >= 0 && write(fd3, msg3, sizeof(msg3) - 1) == (ssize_t)(sizeof(msg3) - 1) &&
+        read_full(fd3, buf, 7) == 0 && memcmp(buf, "got abc", 7) == 0) {
+        printf("[test] full-duplex reply arrived on the downstream poll\n");
+    } else {
+        fprintf(stderr, "[test] full-duplex mismatch\n");
+    }
+    if (fd3 >= 0) close(fd3);
+    kill(dup_child, SIGKILL);
+    waitpid(dup_child, NULL, 0);
+
+    // Stream mode: bytes arrive locally while the reply is still open
+    int stream_port = base + 3;
+    pid_t stream_child = start_frontend(stream_port, http_port, "--stream", "--long-poll=2000");
+    usleep(500000);
+    int fd4 = connect_frontend(stream_port);
+    const unsigned char msg4[] = "xyz";
+    if (fd4 >= 0 && read_full(fd4, buf, 3) == 0 && memcmp(buf, "hi!", 3) == 0 &&
+        write(fd4, msg4, sizeof(msg4) - 1) == (ssize_t)(sizeof(msg4) - 1) &&
+        read_full(fd4, buf, 7) == 0 && memcmp(buf, "got xyz", 7) == 0) {
+        printf("[test] streamed reply delivered before the response ended\n");
+    } else {
+        fprintf(stderr, "[test] stream mismatch\n");
+    }
+    if (fd4 >= 0) close(fd4);
+    kill(stream_child, SIGKILL);
+    waitpid(stream_child, NULL, 0);
+
+    // --http2 asks for HTTP/2 through TLS ALPN; a plain-text URL stays on HTTP/1.1
+    int h2_port = base + 6;
+    pid_t h2_child = start_frontend(h2_port, http_port, "--http2", NULL);
+    usleep(500000);
+    int fd9 = connect_frontend(h2_port);
+    if (fd9 >= 0 && write(fd9, "hello", 5) == 5 && read_full(fd9, buf, 5) == 0 && memcmp(buf, "world", 5) == 0) {
+        printf("[test] --http2 fell back to HTTP/1.1 on a plain-text URL\n");
+    } else {
+        fprintf(stderr, "[test] http2 fallback mismatch\n");
+    }
+    if (fd9 >= 0) close(fd9);
+    kill(h2_child, SIGKILL);
+    waitpid(h2_child, NULL, 0);
+
+    // --h2c: exchanges share one prior-knowledge HTTP/2 connection, or the
+    // frontend refuses to start on a libcurl that cannot reuse one
+    int h2c_port = base + 13, h2c_srv_port = base + 14;
+    pthread_t h2_tid;
+    int h2_started = pthread_create(&h2_tid, NULL, h2_server_thread, &h2c_srv_port) == 0;
+    int h2c_ok = h2_started;
+    usleep(100000);
+    pid_t h2c_child = start_frontend(h2c_port, h2c_srv_port, "--h2c", NULL);
+    usleep(500000);
+    int h2c_status = 0;
+    if (waitpid(h2c_child, &h2c_status, WNOHANG) == h2c_child) {
+        if (h2c_ok && WIFEXITED(h2c_status) && WEXITSTATUS(h2c_status) == 1) {
+            printf("[test] --h2c refused on a libcurl that cannot reuse a prior-knowledge connection\n");
+        } else {
+            fprintf(stderr, "[test] h2c exit mismatch\n");
+        }
+    } else {
+        int fd13 = connect_frontend(h2c_port);
+        h2c_ok = h2c_ok && fd13 >= 0 && write(fd13, "hello", 5) == 5 && read_full(fd13, buf, 5) == 0 &&
+                 memcmp(buf, "world", 5) == 0 && write(fd13, "second", 6) == 6 && read_full(fd13, buf, 3) == 0 &&
+                 memcmp(buf, "ok2", 3) == 0;
+        pthread_mutex_lock(&req_mutex);
+        h2c_ok = h2c_ok && h2_conns == 1 && h2_streams >= 2;
+        pthread_mutex_unlock(&req_mutex);
+        if (h2c_ok) {
+            printf("[test] --h2c carried two exchanges and the polls on one HTTP/2 connection\n");
+        } else {
+            fprintf(stderr, "[test] h2c mismatch\n");
+        }
+        if (fd13 >= 0) close(fd13);
+        kill(h2c_child, SIGKILL);
+        waitpid(h2c_child, NULL, 0);
+    }
+    if (h2_srv_fd >= 0) shutdown(h2_srv_fd, SHUT_RDWR);
+    if (h2_started) pthread_join(h2_tid, NULL);
+    if (h2_srv_fd >= 0) close(h2_srv_fd);
+
+    // a reply marked X-Tunnel-More is followed by a poll at once, not after --poll-min
+    int more_port = base + 8;
+    pid_t more_child = start_frontend(more_port, http_port, "--poll-min=2000", NULL);
+    usleep(500000);
+    int fd11 = connect_frontend(more_port);
+    struct timespec m0, m1; clock_gettime(CLOCK_MONOTONIC, &m0);
+    if (fd11 >= 0 && write(fd11, "more", 4) == 4 && read_full(fd11, buf, 4) == 0 && memcmp(buf, "m1m2", 4) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &m1);
+        long ms = (m1.tv_sec - m0.tv_sec) * 1000 + (m1.tv_nsec - m0.tv_nsec) / 1000000;
+        if (ms < 1000) printf("[test] capped reply re-polled at once (%ld ms)\n", ms);
+        else fprintf(stderr, "[test] capped reply waited %ld ms for the next poll\n", ms);
+    } else {
+        fprintf(stderr, "[test] capped reply mismatch\n");
+    }
+    if (fd11 >= 0) close(fd11);
+    kill(more_child, SIGKILL);
+    waitpid(more_child, NULL, 0);
+
+    // a failed exchange is retried with the same offset instead of ending the tunnel
+    int fl_port = base + 9;
+    pid_t fl_child = start_frontend(fl_port, http_port, NULL, NULL);
+    usleep(500000);
+    int fd12 = connect_frontend(fl_port);
+    if (fd12 >= 0 && write(fd12, "flaky", 5) == 5 && read_full(fd12, buf, 4) == 0 && memcmp(buf, "fine", 4) == 0) {
+        int tries = 0, same = 1;
+        pthread_mutex_lock(&req_mutex);
+        for (int i = 0; i < req_count; i++) {
+            if (reqs[i].body_len != 5 || memcmp(reqs[i].body, "flaky", 5) != 0) continue;
+            tries++;
+            if (strcmp(reqs[i].offset, "0") != 0) same = 0;
+        }
+        pthread_mutex_unlock(&req_mutex);
+        if (tries == 2 && same) printf("[test] lost reply retried with the same offset\n");
+        else fprintf(stderr, "[test] retry mismatch (%d tries)\n", tries);
+    } else {
+        fprintf(stderr, "[test] retried exchange mismatch\n");
+    }
+    if (fd12 >= 0) close(fd12);
+    kill(fl_child, SIGKILL);
+    waitpid(fl_child, NULL, 0);
+
+    // --stripes: a bulk upload over slow posts spreads over several at once
+    // and every byte lands at its offset
+    int sp_port = base + 11;
+    stripe_data = calloc(1, STRIPE_LEN);
+    pid_t sp_child = start_frontend(sp_port, http_port, "--stripes", "4");
+    usleep(500000);
+    int fd13 = connect_frontend(sp_port);
+    unsigned char *sp_buf = malloc(STRIPE_LEN);
+    for (size_t i = 0; i < STRIPE_LEN; i++) sp_buf[i] = (unsigned char)(i % 253);
+    int sp_ok = fd13 >= 0;
+    for (size_t off = 0; sp_ok && off < STRIPE_LEN; off += 8192)
+        sp_ok = write(fd13, sp_buf + off, 8192) == 8192;
+    for (int i = 0; sp_ok && i < 100; i++) {
+        pthread_mutex_lock(&req_mutex);
+        int done = stripe_got >= STRIPE_LEN;
+        pthread_mutex_unlock(&req_mutex);
+        if (done) break;
+        usleep(100000);
+    }
+    pthread_mutex_lock(&req_mutex);
+    sp_ok = sp_ok && stripe_got == STRIPE_LEN && memcmp(stripe_data, sp_buf, STRIPE_LEN) == 0;
+    int sp_peak = stripe_peak;
+    pthread_mutex_unlock(&req_mutex);
+    if (sp_ok && sp_peak >= 2) printf("[test] striped upload arrived intact over %d posts at once\n", sp_peak);
+    else fprintf(stderr, "[test] striped upload mismatch (%zu bytes, peak %d)\n", stripe_got, sp_peak);
+    if (fd13 >= 0) close(fd13);
+    kill(sp_child, SIGKILL);
+    waitpid(sp_child, NULL, 0);
+    free(sp_buf);
+
+    // --window is offered on every poll, and posts stay within the window
+    // the backend advertised
+    int wn_port = base + 12;
+    pid_t wn_child = start_frontend(wn_port, http_port, "--window", "8192");
+    usleep(500000);
+    int fd14 = connect_frontend(wn_port);
+    unsigned char wn_buf[1000];
+    memset(wn_buf, 'w', sizeof(wn_buf));
+    int wn_ok = fd14 >= 0 && write(fd14, "win", 3) == 3 && read_full(fd14, buf, 2) == 0 && memcmp(buf, "ok", 2) == 0 &&
+                write(fd14, wn_buf, sizeof(wn_buf)) == (ssize_t)sizeof(wn_buf);
+    size_t wn_total = 0, wn_largest = 0;
+    for (int i = 0; wn_ok && i < 50 && wn_total < sizeof(wn_buf); i++) {
+        usleep(100000);
+        wn_total = wn_largest = 0;
+        pthread_mutex_lock(&req_mutex);
+        for (int j = 0; j < req_count; j++) {
+            if (strcmp(reqs[j].session, window_session) != 0) continue;
+            if (reqs[j].body_len == 3 && memcmp(reqs[j].body, "win", 3) == 0) {
+                if (strcmp(reqs[j].window, "8192") != 0) wn_ok = 0;
+                continue;
+            }
+            wn_total += reqs[j].body_len;
+            if (reqs[j].body_len > wn_largest) wn_largest = reqs[j].body_len;
+        }
+        pthread_mutex_unlock(&req_mutex);
+    }
+    if (wn_ok && wn_total == sizeof(wn_buf) && wn_largest <= 100) {
+        printf("[test] posts kept within the backend's 100-byte window\n");
+    } else {
+        fprintf(stderr, "[test] window mismatch (%zu bytes, largest post %zu)\n", wn_total, wn_largest);
+    }
+    if (fd14 >= 0) close(fd14);
+    kill(wn_child, SIGKILL);
+    waitpid(wn_child, NULL, 0);
+
+    // SIGUSR1 makes the frontend log its counters and per-phase timing histograms
+    int st_port = base + 7;
+    char st_log[64]; snprintf(st_log, sizeof(st_log), "/tmp/tunnel_frontend_stats.%d", (int)getpid());
+    frontend_log = st_log;
+    pid_t st_child = start_frontend(st_port, http_port, NULL, NULL);
+    frontend_log = NULL;
+    usleep(500000);
+    int fd10 = connect_frontend(st_port);
+    if (fd10 >= 0 && write(fd10, "hello", 5) == 5) read_full(fd10, buf, 5);
+    kill(st_child, SIGUSR1);
+    usleep(300000);
+    char stats[4096] = {0};
+    FILE *sf = fopen(st_log, "r");
+    if (sf) { fread(stats, 1, sizeof(stats) - 1, sf); fclose(sf); }
+    if (strstr(stats, "exchanges=") && strstr(stats, "timing total")) {
+        printf("[test] SIGUSR1 dumped exchange stats and timing histograms\n");
+    } else {
+        fprintf(stderr, "[test] SIGUSR1 stats dump missing\n");
+    }
+    if (fd10 >= 0) close(fd10);
+    kill(st_child, SIGKILL);
+    waitpid(st_child, NULL, 0);
+    unlink(st_log);
 
     kill(child, SIGKILL);
     waitpid(child, NULL, 0);
     close(fd);
+    if (http_srv_fd >= 0) shutdown(http_srv_fd, SHUT_RDWR);
     pthread_join(tid, NULL);
+    if (http_srv_fd >= 0) close(http_srv_fd);
     return 0;
 }
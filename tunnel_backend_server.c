@@ -2,270 +2,3032 @@
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #define MAX_HDRS 65536          // max bytes for SCGI headers netstring
 #define MAX_BODY 10485760       // 10 MiB cap for request body (safety)
 #define MAX_RESP 10485760       // 10 MiB cap for per-request readback
 
-static volatile sig_atomic_t keep_running = 1;
+// atomic: set by the main thread's handlers, read by every worker
+static atomic_int keep_running = 1;
 static void on_sigint(int sig){ (void)sig; keep_running = 0; }
+static atomic_int dump_gen = 0;                 // bumped by each SIGUSR1
+static void on_sigusr1(int sig){ (void)sig; dump_gen++; }
 
-static int set_nonblock(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags < 0) return -1;
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+static uint64_t now_us(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Counters and gauges that /metrics reads from other workers are _Atomic.
+// Only the owning worker writes them, so a relaxed load and store does
+// (no locked add on the hot path); readers use relaxed loads.
+typedef _Atomic unsigned long long counter_t;
+#define RELAXED_GET(x) atomic_load_explicit(&(x), memory_order_relaxed)
+#define RELAXED_SET(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+#define RELAXED_ADD(x, n) RELAXED_SET(x, RELAXED_GET(x) + (n))
+#define RELAXED_SUB(x, n) RELAXED_SET(x, RELAXED_GET(x) - (n))
+
+// === Event loop plumbing ===
+// Every fd registered with epoll is described by a struct watch embedded as
+// the first member of its owner, so the loop can tell listeners, client
+// connections and target sockets apart from epoll_data.ptr alone.
+#define MAX_EVENTS 256
+
+enum watch_kind { W_LISTENER, W_HTTP_LISTENER, W_CLIENT, W_TARGET, W_HANDOFF };
+
+struct watch {
+    enum watch_kind kind;
+    int fd;
+    uint32_t events;                // currently registered epoll mask
+    uint32_t slot;                  // io_uring engine: index in its slot table, 0 if none
+};
+
+static __thread int epfd = -1;
+static __thread int ring_fd = -1;   // >= 0 when this worker runs the io_uring engine
+static int uring_watch(struct watch *w, uint32_t events);
+static void uring_close(struct watch *w);
+
+// Register interest in events (0 removes the fd from epoll).
+static int watch_set(struct watch *w, uint32_t events) {
+    if (w->fd < 0 || events == w->events) return 0;
+    if (ring_fd >= 0) return uring_watch(w, events);
+    struct epoll_event ev; memset(&ev, 0, sizeof(ev));
+    ev.events = events; ev.data.ptr = w;
+    int op = !w->events ? EPOLL_CTL_ADD : (events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    if (epoll_ctl(epfd, op, w->fd, &ev) < 0) return -1;
+    w->events = events;
     return 0;
 }
 
-static ssize_t read_n(int fd, void *buf, size_t n) {
-    size_t off = 0; char *p = (char*)buf;
-    while (off < n) {
-        ssize_t r = read(fd, p + off, n - off);
-        if (r == 0) return off; // EOF
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) { usleep(1000); continue; }
-            return -1;
+static void watch_close(struct watch *w) {
+    if (w->fd < 0) return;
+    watch_set(w, 0);
+    if (ring_fd >= 0) uring_close(w);
+    else close(w->fd);
+    w->fd = -1;
+}
+
+// === io_uring engine ===
+// With --io-uring a worker runs on an io_uring instead of epoll, and the
+// ring moves the data too, not just the readiness. A client waiting for its
+// request has a READ posted straight into the conn's buffer; a reply goes
+// out as a SEND of the headers linked to a write of the body; bodies are
+// written to the target and replies drained from it (non-blocking, one
+// drain per session at a time) as ring requests too. Pool buffers are
+// registered with the ring when taken, so those reads and writes are
+// READ_FIXED / WRITE_FIXED. Every other watch becomes a one-shot POLL_ADD,
+// re-armed for as long as it is wanted (epoll's level-triggered behaviour),
+// and listeners get a multishot ACCEPT. Whatever the handlers queue
+// reaches the kernel in the io_uring_enter() that also waits for the next
+// completions. splice() is off: IORING_OP_SPLICE always runs on an io-wq
+// thread. Requests are tagged with a slot index and kind, polls with a
+// generation as well, so a poll completing after its watch changed is
+// dropped. A watch keeps its slot, and its owner is not freed, while reads
+// or writes it started are in flight.
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024             // registered buffer table size
+
+enum { URING_POLL, URING_READ, URING_SEND, URING_TARGET, URING_KINDS };
+
+struct uring_slot {
+    struct watch *w;                // NULL while the slot is free
+    uint32_t gen;
+    uint32_t armed;                 // mask of the poll in flight, 0 if none
+    uint16_t ops[URING_KINDS];      // reads and writes in flight, by kind
+    uint32_t next_free;
+    bool dirty;
+};
+
+struct uring_buf { uintptr_t base; size_t cap; uint32_t idx; };
+
+static __thread struct {
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_map, *sqe_map;
+    size_t ring_len, sqe_len;
+    unsigned tail;                  // SQEs written so far; published on enter
+    struct uring_slot *slots;       // slot 0 is never used
+    uint32_t nslots, free_slot;
+    uint32_t *dirty;
+    uint32_t ndirty;
+    unsigned inflight;              // reads and writes not completed yet
+    struct uring_buf *bufs;         // registered buffers, by address
+    uint32_t nbufs;
+    uint32_t *buf_free;             // unused entries of the kernel's table
+    uint32_t nbuf_free;
+    bool bufs_full;                 // the kernel refused one (RLIMIT_MEMLOCK)
+} ring;
+static bool use_uring = false;
+
+// A poll carries its slot's generation. Reads and writes hold their slot
+// until they complete, so slot and kind name them.
+static uint64_t uring_tag(uint32_t idx, unsigned kind) {
+    if (kind == URING_POLL) return (uint64_t)ring.slots[idx].gen << 32 | idx;
+    return (uint64_t)kind << 24 | idx;
+}
+
+// Hands the kernel everything queued so far and, with wait set, blocks until
+// a completion arrives or timeout_ms (-1: no limit) passes.
+static int uring_enter(bool wait, int timeout_ms) {
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+    unsigned pending = ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec ts = { timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000 };
+    struct io_uring_getevents_arg arg; memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) arg.ts = (uint64_t)(uintptr_t)&ts;
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    long r = syscall(__NR_io_uring_enter, ring_fd, pending, wait ? 1 : 0, flags,
+                     &arg, sizeof(arg));
+    if (r < 0 && errno == ETIME) return 0;
+    return r < 0 ? -1 : 0;
+}
+
+// The submission queue only fills up when a batch queues more than
+// URING_ENTRIES requests; then part of it goes in early.
+static struct io_uring_sqe *uring_sqe(void) {
+    while (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > *ring.sq_mask)
+        if (uring_enter(false, 0) < 0 && errno != EINTR) { perror("io_uring_enter"); keep_running = 0; return NULL; }
+    struct io_uring_sqe *sqe = &ring.sqes[ring.tail++ & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_cancel(uint64_t tag) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;   // both halves of a reply
+}
+
+static void uring_mark(uint32_t idx) {
+    if (ring.slots[idx].dirty) return;
+    ring.slots[idx].dirty = true;
+    ring.dirty[ring.ndirty++] = idx;
+}
+
+static int uring_slot_get(struct watch *w) {
+    if (!ring.free_slot) {
+        uint32_t n = ring.nslots ? ring.nslots * 2 : 64;
+        struct uring_slot *slots = (struct uring_slot*)realloc(ring.slots, n * sizeof(*slots));
+        if (!slots) return -1;
+        ring.slots = slots;
+        uint32_t *dirty = (uint32_t*)realloc(ring.dirty, n * sizeof(*dirty));
+        if (!dirty) return -1;
+        ring.dirty = dirty;
+        memset(slots + ring.nslots, 0, (n - ring.nslots) * sizeof(*slots));
+        for (uint32_t i = n - 1; i >= (ring.nslots ? ring.nslots : 1); i--) {
+            slots[i].next_free = ring.free_slot;
+            ring.free_slot = i;
         }
-        off += (size_t)r;
+        ring.nslots = n;
     }
-    return (ssize_t)off;
+    w->slot = ring.free_slot;
+    ring.free_slot = ring.slots[w->slot].next_free;
+    ring.slots[w->slot].w = w;
+    return 0;
 }
 
-static ssize_t write_all(int fd, const void *buf, size_t n) {
-    size_t off = 0; const char *p = (const char*)buf;
-    while (off < n) {
-        ssize_t w = write(fd, p + off, n - off);
-        if (w < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN || errno == EWOULDBLOCK) { usleep(1000); continue; }
-            return -1;
+// The slot goes back once its watch wants nothing and nothing is in flight.
+static void uring_slot_put(struct watch *w) {
+    struct uring_slot *sl = &ring.slots[w->slot];
+    if (w->events) return;
+    for (int k = 0; k < URING_KINDS; k++) if (sl->ops[k]) return;
+    sl->gen++;
+    sl->armed = 0;
+    sl->w = NULL;
+    sl->next_free = ring.free_slot;
+    ring.free_slot = w->slot;
+    w->slot = 0;
+}
+
+static bool uring_busy(const struct watch *w, unsigned kind) {
+    return w->slot && ring.slots[w->slot].ops[kind] > 0;
+}
+
+// Cancel w's reads or writes of one kind; their completions still come.
+static void uring_stop(struct watch *w, unsigned kind) {
+    if (uring_busy(w, kind)) uring_cancel(uring_tag(w->slot, kind));
+}
+
+static int uring_watch(struct watch *w, uint32_t events) {
+    if (!w->slot) {
+        if (!events) { w->events = 0; return 0; }
+        if (uring_slot_get(w) < 0) return -1;
+    }
+    struct uring_slot *sl = &ring.slots[w->slot];
+    w->events = events;
+    if (events) { uring_mark(w->slot); return 0; }
+    // a dirty slot stays on the dirty list; the flush skips it while free
+    if (sl->armed) { uring_cancel(uring_tag(w->slot, URING_POLL)); sl->gen++; sl->armed = 0; }
+    uring_stop(w, URING_READ);
+    uring_slot_put(w);
+    return 0;
+}
+
+// Sockets close with the next submission, after whatever was queued for
+// them; a reply still going out is cancelled.
+static void uring_close(struct watch *w) {
+    uring_stop(w, URING_SEND);
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) { close(w->fd); return; }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = w->fd;
+}
+
+// Pool buffers are registered when taken, into a sparse table set up with
+// the ring. bufs is sorted by address, so a read or write anywhere inside
+// one finds its index. A buffer handed to another worker is forgotten here
+// and registered again by that worker; the kernel's entry is overwritten
+// when its index is reused.
+static uint32_t uring_buf_upper(uintptr_t a) {
+    uint32_t lo = 0, hi = ring.nbufs;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (ring.bufs[mid].base <= a) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static void uring_buf_add(void *p, size_t cap) {
+    if (ring_fd < 0 || ring.bufs_full || !ring.nbuf_free) return;
+    uintptr_t base = (uintptr_t)p;
+    uint32_t i = uring_buf_upper(base);
+    if (i > 0 && ring.bufs[i - 1].base == base) return;
+    uint32_t idx = ring.buf_free[ring.nbuf_free - 1];
+    struct iovec iov = { p, cap };
+    struct io_uring_rsrc_update2 up; memset(&up, 0, sizeof(up));
+    up.offset = idx;
+    up.data = (uint64_t)(uintptr_t)&iov;
+    up.nr = 1;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) < 0) {
+        ring.bufs_full = true;
+        return;
+    }
+    ring.nbuf_free--;
+    memmove(&ring.bufs[i + 1], &ring.bufs[i], (ring.nbufs - i) * sizeof(*ring.bufs));
+    ring.bufs[i] = (struct uring_buf){ base, cap, idx };
+    ring.nbufs++;
+}
+
+static void uring_buf_forget(void *p) {
+    if (!p || !ring.nbufs) return;
+    uint32_t i = uring_buf_upper((uintptr_t)p);
+    if (i == 0 || ring.bufs[i - 1].base != (uintptr_t)p) return;
+    ring.buf_free[ring.nbuf_free++] = ring.bufs[i - 1].idx;
+    memmove(&ring.bufs[i - 1], &ring.bufs[i], (ring.nbufs - i) * sizeof(*ring.bufs));
+    ring.nbufs--;
+    ring.bufs_full = false;
+}
+
+static int uring_buf_find(const char *p, size_t len) {
+    uint32_t i = uring_buf_upper((uintptr_t)p);
+    if (i == 0) return -1;
+    const struct uring_buf *b = &ring.bufs[i - 1];
+    return (uintptr_t)p + len <= b->base + b->cap ? (int)b->idx : -1;
+}
+
+// An SQE for a read or write on w's behalf, counted until it completes.
+static struct io_uring_sqe *uring_op(struct watch *w, unsigned kind) {
+    if (!w->slot && uring_slot_get(w) < 0) return NULL;
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe) return NULL;
+    sqe->user_data = uring_tag(w->slot, kind);
+    ring.slots[w->slot].ops[kind]++;
+    ring.inflight++;
+    return sqe;
+}
+
+// Read into dst; with nowait, fail with -EAGAIN instead of waiting for data.
+static bool uring_read(struct watch *w, unsigned kind, int fd, char *dst, size_t len, bool nowait) {
+    struct io_uring_sqe *sqe = uring_op(w, kind);
+    if (!sqe) return false;
+    int idx = uring_buf_find(dst, len);
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)dst;
+    sqe->len = (uint32_t)len;
+    if (idx >= 0) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)idx;
+        if (nowait) sqe->rw_flags = RWF_NOWAIT;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        if (nowait) sqe->msg_flags = MSG_DONTWAIT;
+    }
+    return true;
+}
+
+// Write src; with more, the next request continues it and starts only once
+// this one wrote everything. A fixed write may complete short.
+static bool uring_write(struct watch *w, unsigned kind, int fd, const char *src, size_t len, bool more) {
+    struct io_uring_sqe *sqe = uring_op(w, kind);
+    if (!sqe) return false;
+    int idx = more ? -1 : uring_buf_find(src, len);
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)src;
+    sqe->len = (uint32_t)len;
+    if (idx >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)idx;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (more ? MSG_MORE : 0);
+        if (more) sqe->flags = IOSQE_IO_LINK;
+    }
+    return true;
+}
+
+// Where a client conn waiting for its request reads next; false for any
+// other watch.
+static bool conn_read_buf(struct watch *w, char **dst, size_t *room);
+
+// Turns every watch changed since the last wait into requests.
+static void uring_flush(void) {
+    for (uint32_t i = 0; i < ring.ndirty; i++) {
+        uint32_t idx = ring.dirty[i];
+        struct uring_slot *sl = &ring.slots[idx];
+        sl->dirty = false;
+        struct watch *w = sl->w;
+        if (!w) continue;
+        char *dst; size_t room;
+        if ((w->events & EPOLLIN) && conn_read_buf(w, &dst, &room)) {
+            // the READ does the waiting
+            if (sl->armed) { uring_cancel(uring_tag(idx, URING_POLL)); sl->gen++; sl->armed = 0; }
+            if (!sl->ops[URING_READ]) uring_read(w, URING_READ, w->fd, dst, room, false);
+            continue;
+        }
+        uring_stop(w, URING_READ);
+        if (sl->armed == w->events) continue;
+        if (sl->armed) { uring_cancel(uring_tag(idx, URING_POLL)); sl->gen++; }
+        sl->armed = 0;
+        if (!w->events) continue;
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (!sqe) continue;
+        sqe->fd = w->fd;
+        if (w->kind == W_LISTENER || w->kind == W_HTTP_LISTENER) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        } else {
+            // epoll and poll bits agree
+            sqe->opcode = IORING_OP_POLL_ADD;
+            uint32_t ev = w->events;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            ev = ev << 16 | ev >> 16;
+#endif
+            sqe->poll32_events = ev;
         }
-        off += (size_t)w;
+        sqe->user_data = uring_tag(idx, URING_POLL);
+        sl->armed = w->events;
     }
-    return (ssize_t)off;
+    ring.ndirty = 0;
 }
 
-// === SCGI parsing ===
-static int read_netstring(int fd, char **out, size_t *outlen) {
-    char lenbuf[32]; size_t l = 0;
-    while (l < sizeof(lenbuf)-1) {
-        char c; ssize_t r = read(fd, &c, 1);
-        if (r <= 0) return -1;
-        if (c == ':') break;
-        if (c < '0' || c > '9') return -1;
-        lenbuf[l++] = c;
+static void uring_release(void) {
+    if (ring_fd >= 0 && ring.sqes) uring_enter(false, 0);     // the last closes
+    if (ring_fd >= 0) close(ring_fd);
+    ring_fd = -1;
+    if (ring.sqe_map) munmap(ring.sqe_map, ring.sqe_len);
+    if (ring.ring_map) munmap(ring.ring_map, ring.ring_len);
+    free(ring.slots);
+    free(ring.dirty);
+    free(ring.bufs);
+    free(ring.buf_free);
+    memset(&ring, 0, sizeof(ring));
+}
+
+// Needs Linux 5.19 (sparse buffer registration, multishot accept).
+static int uring_setup(void) {
+    static const unsigned tries[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,  // 6.1
+        IORING_SETUP_COOP_TASKRUN,                                 // 5.19
+        0
+    };
+    struct io_uring_params p;
+    int fd = -1;
+    for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]) && fd < 0; i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = tries[i];
+        fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+        if (fd < 0 && errno != EINVAL) return -1;
     }
-    if (l == 0 || l >= sizeof(lenbuf)-1) return -1;
-    lenbuf[l] = 0;
-    long n = strtol(lenbuf, NULL, 10);
-    if (n < 0 || n > (long)MAX_HDRS) return -1;
-    char *payload = (char*)malloc((size_t)n + 1);
-    if (!payload) return -1;
-    if (read_n(fd, payload, (size_t)n) != n) { free(payload); return -1; }
-    payload[n] = 0;
-    char comma;
-    if (read_n(fd, &comma, 1) != 1 || comma != ',') { free(payload); return -1; }
-    *out = payload; *outlen = (size_t)n;
+    if (fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd); errno = ENOSYS; return -1;
+    }
+    ring_fd = fd;
+    struct io_uring_rsrc_register reg; memset(&reg, 0, sizeof(reg));
+    reg.nr = URING_BUFS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) < 0) { uring_release(); return -1; }
+    ring.bufs = (struct uring_buf*)malloc(URING_BUFS * sizeof(*ring.bufs));
+    ring.buf_free = (uint32_t*)malloc(URING_BUFS * sizeof(*ring.buf_free));
+    if (!ring.bufs || !ring.buf_free) { uring_release(); errno = ENOMEM; return -1; }
+    for (uint32_t i = 0; i < URING_BUFS; i++) ring.buf_free[i] = URING_BUFS - 1 - i;
+    ring.nbuf_free = URING_BUFS;
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring.sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    char *m = (char*)mmap(NULL, ring.ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m == MAP_FAILED) { ring.ring_map = NULL; uring_release(); return -1; }
+    ring.ring_map = m;
+    void *sqes = mmap(NULL, ring.sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) { uring_release(); return -1; }
+    ring.sqe_map = sqes;
+    ring.sqes = (struct io_uring_sqe*)sqes;
+    ring.sq_head = (unsigned*)(m + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(m + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(m + p.sq_off.ring_mask);
+    ring.cq_head = (unsigned*)(m + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(m + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(m + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(m + p.cq_off.cqes);
+    unsigned *array = (unsigned*)(m + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;   // SQE i sits in slot i
+    ring.tail = *ring.sq_tail;
     return 0;
 }
 
-static const char* kv_get(const char *hdrs, size_t len, const char *key) {
-    size_t klen = strlen(key);
+// === Buffer pool ===
+// Header, body and response buffers come from power-of-four size classes
+// (4 KiB .. 16 MiB) and go back on a per-class free list when the request
+// is done, so steady-state traffic does no heap allocation. Each class keeps
+// at most POOL_KEEP_BYTES of idle buffers. On an io_uring worker a buffer is
+// registered with the ring as it is taken (see uring_buf_add()).
+#define POOL_MIN_SHIFT 12           // smallest class: 4 KiB
+#define POOL_CLASSES 7              // largest class: 16 MiB (>= MAX_BODY, MAX_RESP)
+#define POOL_KEEP_BYTES (16u << 20) // idle memory retained per class
+
+struct pool_class {
+    void *free_list;                // next pointer stored in the buffer itself
+    _Atomic size_t idle;
+};
+
+static __thread struct pool_class pool[POOL_CLASSES];
+static __thread counter_t pool_hits = 0, pool_misses = 0;
+
+static size_t pool_class_size(int cls) { return (size_t)1 << (POOL_MIN_SHIFT + 2 * cls); }
+
+static int pool_class_for(size_t n) {
+    for (int cls = 0; cls < POOL_CLASSES; cls++)
+        if (n <= pool_class_size(cls)) return cls;
+    return -1;
+}
+
+// Returns a buffer of at least n bytes; *cap receives its real size.
+static void *pool_get(size_t n, size_t *cap) {
+    int cls = pool_class_for(n);
+    if (cls < 0) return NULL;
+    struct pool_class *pc = &pool[cls];
+    void *p = pc->free_list;
+    if (p) {
+        pc->free_list = *(void**)p;
+        RELAXED_SUB(pc->idle, 1);
+        RELAXED_ADD(pool_hits, 1);
+    } else {
+        p = malloc(pool_class_size(cls));
+        if (!p) return NULL;
+        RELAXED_ADD(pool_misses, 1);
+    }
+    uring_buf_add(p, pool_class_size(cls));
+    if (cap) *cap = pool_class_size(cls);
+    return p;
+}
+
+// n is the size originally asked for (or the cap pool_get reported).
+static void pool_put(void *p, size_t n) {
+    if (!p) return;
+    int cls = pool_class_for(n);
+    struct pool_class *pc = &pool[cls];
+    if ((pc->idle + 1) * pool_class_size(cls) > POOL_KEEP_BYTES && pc->idle > 0) { uring_buf_forget(p); free(p); return; }
+    *(void**)p = pc->free_list;
+    pc->free_list = p;
+    RELAXED_ADD(pc->idle, 1);
+}
+
+static void pool_log_stats(const char *label) {
+    size_t idle_bytes = 0;
+    for (int cls = 0; cls < POOL_CLASSES; cls++) idle_bytes += pool[cls].idle * pool_class_size(cls);
+    fprintf(stderr, "%s: hits=%llu misses=%llu idle_bytes=%zu\n", label, pool_hits, pool_misses, idle_bytes);
+}
+
+static void pool_release(void) {
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        while (pool[cls].free_list) {
+            void *p = pool[cls].free_list;
+            pool[cls].free_list = *(void**)p;
+            uring_buf_forget(p);
+            free(p);
+        }
+        RELAXED_SET(pool[cls].idle, 0);
+    }
+}
+
+// === Metrics ===
+// Plain counters bumped inline plus log-linear latency histograms (two
+// buckets per power of two, 1 us .. 33 s), rendered in the Prometheus text
+// format by the /metrics endpoint.
+#define HIST_BUCKETS 50
+
+struct histogram {
+    counter_t count, sum_us;
+    counter_t buckets[HIST_BUCKETS + 1];    // last one is +Inf
+};
+
+struct metrics {         // only counter_t: metrics_add() relies on it
+    counter_t requests, replies_2xx, replies_4xx, replies_5xx;
+    counter_t bytes_up, bytes_down, empty_polls;
+    counter_t target_connects, reconnects;
+    counter_t deflate_raw, deflate_wire, deflate_bypassed, throttled;
+    counter_t replayed_bytes, duplicate_bytes, held_bodies;
+    counter_t target_pool_hits, target_pool_misses, target_pool_dropped;
+    struct histogram parse, write, drain;
+};
+static __thread struct metrics metrics;
+_Static_assert(sizeof(struct metrics) % sizeof(unsigned long long) == 0, "struct metrics must hold only counters");
+static uint64_t hist_bounds[HIST_BUCKETS];      // upper bounds in us: 1, 2, 3, 4, 6, 8, 12, ...
+static bool metrics_enabled = false;
+
+static void hist_init(void) {
+    hist_bounds[0] = 1;
+    for (int i = 1; i < HIST_BUCKETS; i++)
+        hist_bounds[i] = (i & 1) ? (uint64_t)2 << (i / 2) : (uint64_t)3 << (i / 2 - 1);
+}
+
+static void hist_observe(struct histogram *h, uint64_t us) {
+    int lo = 0, hi = HIST_BUCKETS;      // first bound >= us, or HIST_BUCKETS
+    while (lo < hi) { int mid = (lo + hi) / 2; if (hist_bounds[mid] < us) lo = mid + 1; else hi = mid; }
+    RELAXED_ADD(h->buckets[lo], 1);
+    RELAXED_ADD(h->count, 1);
+    RELAXED_ADD(h->sum_us, us);
+}
+
+static void metrics_add(struct metrics *sum, const struct metrics *m) {
+    counter_t *d = (counter_t*)sum;
+    counter_t *v = (counter_t*)m;
+    for (size_t i = 0; i < sizeof(*m) / sizeof(*v); i++) RELAXED_ADD(d[i], RELAXED_GET(v[i]));
+}
+
+static void count_reply(const char *status) {
+    if (status[0] == '2') RELAXED_ADD(metrics.replies_2xx, 1);
+    else if (status[0] == '4') RELAXED_ADD(metrics.replies_4xx, 1);
+    else if (status[0] == '5') RELAXED_ADD(metrics.replies_5xx, 1);
+}
+
+// === SCGI parsing ===
+// The headers a request can use. scgi_index() fills them in one pass over
+// the NUL-separated block, http_index() from an HTTP head; absent ones stay
+// NULL.
+struct scgi_req {
+    const char *scgi, *content_length, *path_info, *protocol;
+    const char *session, *close, *wait, *dir, *encoding, *accept_encoding, *offset, *ack, *stripe, *window;
+    const char *connection, *expect, *transfer_encoding;
+};
+
+static const struct { const char *name; size_t len, off; } scgi_keys[] = {
+#define SCGI_KEY(name, field) { name, sizeof(name) - 1, offsetof(struct scgi_req, field) }
+    SCGI_KEY("SCGI", scgi),
+    SCGI_KEY("CONTENT_LENGTH", content_length),
+    SCGI_KEY("PATH_INFO", path_info),
+    SCGI_KEY("SERVER_PROTOCOL", protocol),
+    SCGI_KEY("HTTP_X_TUNNEL_SESSION", session),
+    SCGI_KEY("HTTP_X_TUNNEL_CLOSE", close),
+    SCGI_KEY("HTTP_X_TUNNEL_WAIT", wait),
+    SCGI_KEY("HTTP_X_TUNNEL_DIR", dir),
+    SCGI_KEY("HTTP_X_TUNNEL_ENCODING", encoding),
+    SCGI_KEY("HTTP_X_TUNNEL_ACCEPT_ENCODING", accept_encoding),
+    SCGI_KEY("HTTP_X_TUNNEL_OFFSET", offset),
+    SCGI_KEY("HTTP_X_TUNNEL_ACK", ack),
+    SCGI_KEY("HTTP_X_TUNNEL_STRIPE", stripe),
+    SCGI_KEY("HTTP_X_TUNNEL_WINDOW", window),
+    SCGI_KEY("HTTP_CONNECTION", connection),
+    SCGI_KEY("HTTP_EXPECT", expect),
+    SCGI_KEY("HTTP_TRANSFER_ENCODING", transfer_encoding),
+#undef SCGI_KEY
+};
+
+static void req_set(struct scgi_req *r, const char *k, size_t ks, const char *v) {
+    for (size_t j = 0; j < sizeof(scgi_keys) / sizeof(scgi_keys[0]); j++) {
+        if (ks != scgi_keys[j].len || memcmp(k, scgi_keys[j].name, ks) != 0) continue;
+        const char **slot = (const char**)((char*)r + scgi_keys[j].off);
+        if (!*slot) *slot = v;      // the first occurrence wins
+        return;
+    }
+}
+
+static void scgi_index(const char *hdrs, size_t len, struct scgi_req *r) {
+    memset(r, 0, sizeof(*r));
     size_t i = 0;
     while (i < len) {
         const char *k = hdrs + i; size_t ks = strnlen(k, len - i); i += ks + 1;
         if (i >= len) break;
-        const char *v = hdrs + i; size_t vs = strnlen(v, len - i); i += vs + 1;
-        if (ks == klen && memcmp(k, key, klen) == 0) return v;
+        const char *v = hdrs + i; i += strnlen(v, len - i) + 1;
+        req_set(r, k, ks, v);
     }
-    return NULL;
 }
 
-// === Persistent target connection ===
-static int target_fd = -1;          // persistent across requests
+// Index an HTTP/1.x head (request line up to the blank line) into the same
+// fields, naming header fields the CGI way: X-Tunnel-Wait is
+// HTTP_X_TUNNEL_WAIT. Values are NUL-terminated in place, and a second pass
+// over the same bytes (after a hand-off) gives the same result. Returns -1
+// on a malformed request line.
+static int http_index(char *head, size_t len, struct scgi_req *r) {
+    memset(r, 0, sizeof(*r));
+    char *end = head + len, *eol = memchr(head, '\n', len);
+    char *path = eol ? memchr(head, ' ', (size_t)(eol - head)) : NULL;
+    if (!path) return -1;
+    char *q = ++path;
+    while (q < eol && *q != ' ' && *q != '?' && *q) q++;
+    char *proto = memmem(q, (size_t)(eol - q), "HTTP/1.", 7);
+    if (q == path || !proto) return -1;
+    *q = 0;                     // the query string is not used
+    if (eol[-1] == '\r') eol[-1] = 0;
+    r->path_info = path; r->protocol = proto;
+    for (char *line = eol + 1; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol) break;
+        char *colon = memchr(line, ':', (size_t)(eol - line));
+        if (!colon) continue;
+        char *v = colon + 1, *ve = eol;
+        while (v < eol && (*v == ' ' || *v == '\t')) v++;
+        while (ve > v && (ve[-1] == '\r' || ve[-1] == 0 || ve[-1] == ' ' || ve[-1] == '\t')) ve--;
+        if (ve == eol) continue;    // bare LF after an empty value: nowhere to put the NUL
+        *ve = 0;
+        char key[64]; size_t ks = (size_t)(colon - line);
+        if (ks == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            req_set(r, "CONTENT_LENGTH", 14, v);
+            continue;
+        }
+        if (ks + 5 > sizeof(key)) continue;
+        memcpy(key, "HTTP_", 5);
+        for (size_t i = 0; i < ks; i++) key[5 + i] = line[i] == '-' ? '_' : (char)toupper((unsigned char)line[i]);
+        req_set(r, key, ks + 5, v);
+    }
+    return 0;
+}
+
+// Parse the "<len>:<payload>," netstring prefix in buf. Returns 1 with the
+// payload position once its length is known, 0 if more bytes are needed and
+// -1 on malformed input.
+static int parse_netstring_len(const char *buf, size_t len, size_t *payload_off, size_t *payload_len) {
+    size_t l = 0;
+    while (l < len && l < 31) {
+        char c = buf[l];
+        if (c == ':') break;
+        if (c < '0' || c > '9') return -1;
+        l++;
+    }
+    if (l == len) return 0;
+    if (l == 0 || l >= 31) return -1;
+    long n = strtol(buf, NULL, 10);
+    if (n < 0 || n > (long)MAX_HDRS) return -1;
+    *payload_off = l + 1;
+    *payload_len = (size_t)n;
+    return 1;
+}
+
+// === Compression ===
+// Bodies may travel deflated (zlib format): X-Tunnel-Encoding: deflate marks
+// a compressed request body, and X-Tunnel-Accept-Encoding: deflate lets the
+// reply be compressed too. A reply that deflate cannot shrink by an eighth
+// (ciphertext, media) goes out raw, and the session skips the attempt for
+// its next few replies, twice as many each time it fails again.
+#define ZMIN 512                    // smaller bodies are not worth compressing
+#define ZLEVEL Z_BEST_SPEED
+#define ZSKIP_MAX 64                // longest run of replies sent raw untried
+
+struct zadapt { unsigned skip, backoff; };
+
+static void zadapt_result(struct zadapt *z, bool won) {
+    if (won) { z->backoff = 0; return; }
+    z->backoff = !z->backoff ? 1 : z->backoff * 2 < ZSKIP_MAX ? z->backoff * 2 : ZSKIP_MAX;
+    z->skip = z->backoff;
+}
+
+// Deflate src into dst (len bytes of room) when that saves at least an
+// eighth. Returns the compressed length, or 0 to send src as it is.
+static size_t deflate_if_smaller(const char *src, size_t len, char *dst) {
+    uLongf out = len - len / 8;
+    if (compress2((Bytef*)dst, &out, (const Bytef*)src, len, ZLEVEL) != Z_OK) return 0;
+    return out;
+}
+
+// Inflate a request body into a fresh pool buffer. Returns 0 on success,
+// -1 for corrupt data and -2 when it would inflate beyond MAX_BODY.
+static int inflate_body(const char *src, size_t len, char **out, size_t *out_len, size_t *out_cap) {
+    z_stream zs; memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return -1;
+    size_t cap;
+    char *buf = (char*)pool_get(len < MAX_BODY / 4 ? len * 4 : MAX_BODY, &cap);
+    int ret = buf ? Z_OK : Z_MEM_ERROR;
+    bool too_big = false;
+    zs.next_in = (Bytef*)src; zs.avail_in = (uInt)len;
+    while (ret == Z_OK) {
+        if (zs.total_out == cap) {
+            if (cap >= MAX_BODY) { too_big = true; break; }
+            size_t ncap;
+            char *nbuf = (char*)pool_get(cap < MAX_BODY / 4 ? cap * 4 : MAX_BODY, &ncap);
+            if (!nbuf) { ret = Z_MEM_ERROR; break; }
+            memcpy(nbuf, buf, cap);
+            pool_put(buf, cap);
+            buf = nbuf; cap = ncap;
+        }
+        zs.next_out = (Bytef*)buf + zs.total_out;
+        zs.avail_out = (uInt)(cap - zs.total_out);
+        ret = inflate(&zs, Z_FINISH);
+        if (ret == Z_BUF_ERROR && zs.avail_out == 0) ret = Z_OK;    // just out of room
+    }
+    size_t got = zs.total_out;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || got > MAX_BODY) {
+        pool_put(buf, cap);
+        return too_big || got > MAX_BODY ? -2 : -1;
+    }
+    *out = buf; *out_len = got; *out_cap = cap;
+    return 0;
+}
+
+// === Workers ===
+// With --workers N the backend runs N event loops, one per thread, each with
+// its own SO_REUSEPORT listener and its own thread-local copy of the state
+// below, so the hot path takes no locks. A session belongs to the worker its
+// id hashes to; a request accepted by another worker is handed, connection
+// and all, to the owner through its pipe as soon as the headers name the
+// session. table_lock only keeps /metrics on other threads off the session
+// table while a session is added or removed.
+#define MAX_WORKERS 64
+
+struct session;
+
+struct worker {
+    int id;
+    pthread_t thread;
+    int listen_fd, http_fd;         // http_fd < 0 without --http
+    struct watch handoff;           // read end of the hand-off pipe
+    int handoff_wr;
+    pthread_mutex_t table_lock;
+    // the worker's thread-local state, for readers on other threads
+    struct metrics *metrics;
+    struct session **sessions;
+    _Atomic size_t *session_count, *conn_count, *target_pool_len;
+    struct pool_class *pool;
+    counter_t *pool_hits, *pool_misses;
+};
+
+static struct worker workers[MAX_WORKERS];
+static int worker_count = 1;
+static __thread struct worker *self;
+
+// === Zero-copy transfers ===
+// Large request bodies and all drained responses can move between sockets
+// through a pipe with splice(), never touching user space. Pipes are
+// recycled through a small pool once they are empty.
+#define SPLICE_MIN_BODY 16384       // smaller bodies are cheaper to copy
+#define PIPE_SIZE 1048576           // requested pipe capacity (caps one spliced reply)
+#define PIPE_POOL_MAX 64
+
+struct pipe_pair { int rd, wr; size_t cap; };
+
+static bool use_splice = true;
+static int devnull_fd = -1;         // sink for acknowledged spliced replay bytes
+static __thread struct pipe_pair pipe_pool[PIPE_POOL_MAX];
+static __thread size_t pipe_pool_len = 0;
+
+static int pipe_get(struct pipe_pair *p) {
+    if (pipe_pool_len > 0) { *p = pipe_pool[--pipe_pool_len]; return 0; }
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+    int cap = fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+    if (cap < 0) cap = fcntl(fds[1], F_GETPIPE_SZ);
+    p->rd = fds[0]; p->wr = fds[1];
+    p->cap = cap > 0 ? (size_t)cap : 65536;
+    return 0;
+}
+
+// Return a pipe to the pool; one that still holds bytes is closed instead.
+static void pipe_put(struct pipe_pair *p, size_t pending) {
+    if (p->rd < 0) return;
+    if (pending == 0 && pipe_pool_len < PIPE_POOL_MAX) pipe_pool[pipe_pool_len++] = *p;
+    else { close(p->rd); close(p->wr); }
+    p->rd = p->wr = -1;
+}
+
+static void free_pipe_pool(void) {
+    while (pipe_pool_len > 0) { pipe_pool_len--; close(pipe_pool[pipe_pool_len].rd); close(pipe_pool[pipe_pool_len].wr); }
+}
+
+// === Sessions: one persistent target connection per tunnel ===
+// Requests carry an X-Tunnel-Session header (HTTP_X_TUNNEL_SESSION in SCGI)
+// naming the tunnel they belong to. Requests without it share the legacy
+// anonymous session, which silently reconnects when the target closes.
+// A named session is finished once its target hangs up: the response that
+// observes the close carries X-Tunnel-Closed, later requests get 410.
+// Once that last reply (or a 410, or the reply to X-Tunnel-Close) has gone
+// out, the session is freed; its id is remembered for a while so a late
+// request gets 410 instead of a fresh target connection.
+#define SESSION_BUCKETS 1024        // hash table size (power of two)
+#define MAX_SESSIONS 4096           // refuse new sessions beyond this
+#define MAX_SESSION_ID 64           // max length of a session identifier
+#define SESSION_IDLE_SECS 600       // drop sessions unused for this long
+#define SESSION_SWEEP_SECS 60       // how often to look for idle sessions
+#define FINISHED_KEEP 256           // ids of freed sessions remembered per worker
+
+struct conn;
+
+struct session {
+    struct watch target;            // persistent target socket; must be first
+    char id[MAX_SESSION_ID + 1];    // "" for the legacy anonymous session
+    bool closed;                    // target hung up (named sessions only)
+    time_t last_used;
+    counter_t requests, bytes_up, bytes_down;   // read by /metrics on other workers
+    unsigned long long connects;
+    struct conn *wq_head, *wq_tail; // requests waiting to write, in arrival order
+    _Atomic size_t queued;          // body bytes in the write queue
+    struct conn *waiters;           // long-polls parked until the target has data
+    struct conn *stream;            // open streaming reply, if any
+    struct zadapt zdown;            // reply compression backoff
+    uint64_t up_seq;                // upstream bytes taken for the target so far
+    char *replay; size_t replay_len, replay_cap;    // downstream bytes not acknowledged yet
+    size_t replay_sent;             // ...of which this many went out at least once
+    uint64_t replay_base;           // downstream offset of replay[0]
+    struct pipe_pair rpipe;         // ...or those bytes, spliced, while replay_piped
+    bool replay_piped;
+    struct conn *held;              // bodies that arrived ahead of a gap, by offset
+    size_t held_bytes;
+    bool want_out;                  // queue head is blocked on target writability
+    struct conn *tx, *rx;           // io_uring: conn whose target write / drain is in flight
+    int tx_err;                     // ...errno that write failed with, for session_pump()
+    struct conn *rxq;               // ...and the ones waiting to drain after it, oldest first
+    uint64_t rx_start;              // when the drain in flight was queued (us)
+    bool finished;                  // nothing left to hand out: free once no request holds it
+    bool dying;                     // on dead_sessions
+    unsigned conns;                 // requests attached to the session
+    struct session *next;           // hash chain
+    struct session *next_dead;
+};
+
+static __thread struct session *sessions[SESSION_BUCKETS];
+static __thread _Atomic size_t session_count = 0;
+static __thread time_t last_sweep = 0;
+static __thread struct session *dead_sessions = NULL;   // finished during this batch, freed after it
+static __thread char finished_ids[FINISHED_KEEP][MAX_SESSION_ID + 1];
+static __thread size_t finished_next = 0;
 static uint16_t target_port_g = 0;
+static unsigned long long_poll_max_ms = 30000;   // cap on X-Tunnel-Wait; 0 disables
+static size_t queue_max = 4u << 20;             // per-session write queue bound, in bytes; the window we advertise
+static size_t replay_max = 1u << 20;            // per-session unacknowledged downstream bytes
+
+static uint32_t session_hash(const char *id) {
+    uint32_t h = 2166136261u;       // FNV-1a
+    for (; *id; id++) { h ^= (unsigned char)*id; h *= 16777619u; }
+    return h;
+}
+
+static bool session_id_valid(const char *id) {
+    size_t n = strlen(id);
+    if (n == 0 || n > MAX_SESSION_ID) return false;
+    for (size_t i = 0; i < n; i++) {
+        char c = id[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+              (c >= 'A' && c <= 'Z') || c == '-' || c == '_')) return false;
+    }
+    return true;
+}
+
+// The ring keeps the socket open under a write or drain in flight, so those
+// are cancelled.
+static void close_target(struct session *s){
+    if (s->tx) uring_stop((struct watch*)s->tx, URING_TARGET);
+    if (s->rx) uring_stop((struct watch*)s->rx, URING_TARGET);
+    s->tx_err = 0;
+    watch_close(&s->target);
+}
+
+static void free_session(struct session *s) {
+    close_target(s);
+    pool_put(s->replay, s->replay_cap);
+    pipe_put(&s->rpipe, s->replay_piped ? s->replay_len : 0);
+    free(s);
+    RELAXED_SUB(session_count, 1);
+}
+
+static bool session_busy(const struct session *s) {
+    return s->wq_head != NULL || s->waiters != NULL || s->stream != NULL || s->held != NULL ||
+           s->tx != NULL || s->rx != NULL || s->rxq != NULL;
+}
+
+static bool stream_wants_data(const struct conn *c);
+
+// Watch the target for writability while bodies are queued and for
+// readability while long-polls are parked or a stream has room.
+static void session_update_watch(struct session *s) {
+    bool want_in = s->waiters || (s->stream && stream_wants_data(s->stream));
+    watch_set(&s->target, (s->want_out ? EPOLLOUT : 0) | (want_in ? EPOLLIN : 0));
+}
+
+// Called from the event loop between batches so no pending event can
+// refer to a freed session.
+static void expire_sessions(time_t now) {
+    if (now - last_sweep < SESSION_SWEEP_SECS) return;
+    last_sweep = now;
+    for (size_t b = 0; b < SESSION_BUCKETS; b++) {
+        struct session **pp = &sessions[b];
+        while (*pp) {
+            struct session *s = *pp;
+            if (now - s->last_used > SESSION_IDLE_SECS && !session_busy(s) && s->conns == 0) {
+                pthread_mutex_lock(&self->table_lock);
+                *pp = s->next;
+                pthread_mutex_unlock(&self->table_lock);
+                free_session(s);
+            }
+            else pp = &s->next;
+        }
+    }
+}
+
+static bool finished_recently(const char *id) {
+    for (size_t i = 0; i < FINISHED_KEEP; i++)
+        if (strcmp(finished_ids[i], id) == 0) return true;
+    return false;
+}
+
+// Find the session for id, creating it if needed. Returns NULL when the
+// session table is full.
+static struct session *get_session(const char *id) {
+    time_t now = time(NULL);
+    struct session **head = &sessions[session_hash(id) & (SESSION_BUCKETS - 1)];
+    for (struct session *s = *head; s; s = s->next) {
+        if (strcmp(s->id, id) == 0) { s->last_used = now; return s; }
+    }
+    if (session_count >= MAX_SESSIONS) return NULL;
+    struct session *s = (struct session*)calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    s->target.kind = W_TARGET;
+    s->target.fd = -1;
+    s->rpipe.rd = s->rpipe.wr = -1;
+    s->last_used = now;
+    if (id[0] && finished_recently(id)) s->closed = true;   // comes back only to say 410
+    pthread_mutex_lock(&self->table_lock);
+    s->next = *head;
+    *head = s;
+    RELAXED_ADD(session_count, 1);
+    pthread_mutex_unlock(&self->table_lock);
+    return s;
+}
 
-static void close_target(void){ if (target_fd >= 0) { close(target_fd); target_fd = -1; } }
+static void free_all_sessions(void) {
+    dead_sessions = NULL;
+    for (size_t b = 0; b < SESSION_BUCKETS; b++) {
+        while (sessions[b]) {
+            struct session *s = sessions[b];
+            pthread_mutex_lock(&self->table_lock);
+            sessions[b] = s->next;
+            pthread_mutex_unlock(&self->table_lock);
+            free_session(s);
+        }
+    }
+}
+
+// A finished session that nothing holds any more is queued to be freed
+// after the batch, when no pending event can refer to it any more.
+static void session_settle(struct session *s) {
+    if (s->conns > 0 || !s->finished || s->dying || session_busy(s)) return;
+    s->dying = true;
+    s->next_dead = dead_sessions;
+    dead_sessions = s;
+}
+
+// A request is done with its session.
+static void session_release(struct session *s) {
+    s->conns--;
+    session_settle(s);
+}
+
+static void free_dead_sessions(void) {
+    while (dead_sessions) {
+        struct session *s = dead_sessions;
+        dead_sessions = s->next_dead;
+        s->dying = false;
+        if (s->conns > 0 || session_busy(s)) continue;  // a new request came in meanwhile
+        struct session **pp = &sessions[session_hash(s->id) & (SESSION_BUCKETS - 1)];
+        while (*pp != s) pp = &(*pp)->next;
+        pthread_mutex_lock(&self->table_lock);
+        *pp = s->next;
+        pthread_mutex_unlock(&self->table_lock);
+        if (!finished_recently(s->id)) {
+            memcpy(finished_ids[finished_next], s->id, sizeof(s->id));
+            finished_next = (finished_next + 1) % FINISHED_KEEP;
+        }
+        free_session(s);
+    }
+}
+
+static void stream_kick(struct session *s);
+static void session_drop_held(struct session *s);
 
+// Mark a session whose target went away. Named sessions end here; the
+// anonymous one reconnects on its next request.
+static void target_gone(struct session *s) {
+    close_target(s);
+    if (s->id[0]) s->closed = true;
+    stream_kick(s);
+    session_drop_held(s);
+}
+
+// Non-blocking, so a slow or backlogged target never stalls the event
+// loop: the first send() or recv() sees EAGAIN until the handshake is done
+// and the usual EPOLLOUT/EPOLLIN paths take it from there.
 static int connect_local(uint16_t port) {
-    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (s < 0) return -1;
     struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     addr.sin_port = htons(port);
-    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(s); return -1; }
-    set_nonblock(s);
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) { close(s); return -1; }
     return s;
 }
 
-static int ensure_target(void){
-    if (target_fd >= 0) return 0;
-    target_fd = connect_local(target_port_g);
-    return (target_fd >= 0) ? 0 : -1;
+// === Target pool ===
+// With --target-pool N each worker keeps up to N spare target connections
+// opened ahead of time, so a new session (or the anonymous one reconnecting)
+// takes one instead of connecting on the request path. Spares are handed out
+// oldest first and refilled at the top of the event loop. Only a spare whose
+// connect has finished is handed out; one still connecting stays in the pool,
+// and one the target has closed or refused is dropped when taken or at the
+// next sweep.
+#define TARGET_POOL_MAX 64
+#define TARGET_POOL_RETRY_MS 1000   // back-off after the target refused a spare
+#define TARGET_POOL_SWEEP_SECS 5
+
+static size_t target_pool_size = 0;
+static __thread int target_pool[TARGET_POOL_MAX];
+static __thread _Atomic size_t target_pool_len = 0;    // cold path: plain atomic ops
+static __thread uint64_t target_pool_retry_at = 0;
+static __thread time_t target_pool_swept = 0;
+
+enum { SPARE_DEAD, SPARE_CONNECTING, SPARE_READY };
+
+// A spare is ready once its connect has succeeded, and dead when it failed
+// or the target hung up on it; data the target sent first (a banner, say)
+// stays queued for the session.
+static int target_spare_state(int fd) {
+    struct pollfd p = { fd, POLLOUT | POLLRDHUP, 0 };
+    if (poll(&p, 1, 0) < 0 || (p.revents & (POLLRDHUP | POLLHUP | POLLERR))) return SPARE_DEAD;
+    if (!(p.revents & POLLOUT)) return SPARE_CONNECTING;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) return SPARE_DEAD;
+    return SPARE_READY;
+}
+
+static void target_spare_drop(int fd) {
+    close(fd);
+    RELAXED_ADD(metrics.target_pool_dropped, 1);
+    target_pool_retry_at = now_ms() + TARGET_POOL_RETRY_MS;
+}
+
+static void target_pool_refill(void) {
+    if (target_pool_len >= target_pool_size || now_ms() < target_pool_retry_at) return;
+    while (target_pool_len < target_pool_size) {
+        int fd = connect_local(target_port_g);
+        if (fd < 0) { target_pool_retry_at = now_ms() + TARGET_POOL_RETRY_MS; return; }
+        target_pool[target_pool_len++] = fd;
+    }
+}
+
+// Take the oldest ready spare, skipping the ones still connecting.
+static int target_pool_take(void) {
+    int fd = -1;
+    size_t kept = 0;
+    for (size_t i = 0; i < target_pool_len; i++) {
+        int spare = target_pool[i];
+        int state = fd >= 0 ? SPARE_CONNECTING : target_spare_state(spare);    // past the one taken: keep
+        if (state == SPARE_READY) fd = spare;
+        else if (state == SPARE_CONNECTING) target_pool[kept++] = spare;
+        else target_spare_drop(spare);
+    }
+    target_pool_len = kept;
+    return fd;
+}
+
+static void target_pool_sweep(time_t now) {
+    if (target_pool_len == 0 || now - target_pool_swept < TARGET_POOL_SWEEP_SECS) return;
+    target_pool_swept = now;
+    size_t kept = 0;
+    for (size_t i = 0; i < target_pool_len; i++) {
+        if (target_spare_state(target_pool[i]) != SPARE_DEAD) target_pool[kept++] = target_pool[i];
+        else target_spare_drop(target_pool[i]);
+    }
+    target_pool_len = kept;
 }
 
-static int forward_body_to_target(const char *body, size_t body_len){
-    if (ensure_target() < 0) return -1;
-    ssize_t w = write_all(target_fd, body, body_len);
-    if (w < 0) {
-        // Try one reconnect (simple robustness)
-        close_target();
-        if (ensure_target() < 0) return -1;
-        w = write_all(target_fd, body, body_len);
-        if (w < 0) { close_target(); return -1; }
+static void target_pool_release(void) {
+    while (target_pool_len > 0) close(target_pool[--target_pool_len]);
+}
+
+static int ensure_target(struct session *s){
+    if (s->closed) return -1;
+    if (s->target.fd >= 0) return 0;
+    s->target.fd = target_pool_take();
+    if (s->target.fd >= 0) RELAXED_ADD(metrics.target_pool_hits, 1);
+    else {
+        if (target_pool_size) RELAXED_ADD(metrics.target_pool_misses, 1);
+        s->target.fd = connect_local(target_port_g);
     }
+    if (s->target.fd < 0) return -1;
+    RELAXED_ADD(metrics.target_connects, 1);
+    if (s->connects++ > 0) RELAXED_ADD(metrics.reconnects, 1);
     return 0;
 }
 
-static ssize_t drain_target(char *dst, size_t cap){
-    if (ensure_target() < 0) return -1;
+static void conn_io_session(struct conn *c, struct session *s);
+
+// Write as much of body as the target accepts right now. Returns 1 when all
+// of it is written, 0 when the target would block and -1 on error. On an
+// io_uring worker the rest of body goes out as one ring write for c, and 0
+// means a write is in flight; target_done() pumps the session again.
+static int forward_body_to_target(struct session *s, struct conn *c, const char *body, size_t body_len,
+                                  size_t *sent){
+    if (ring_fd >= 0) {
+        if (s->tx) return 0;
+        if (s->tx_err) { errno = s->tx_err; s->tx_err = 0; return -1; }
+    }
+    if (ensure_target(s) < 0) return -1;
+    if (ring_fd >= 0 && *sent < body_len) {
+        if (!uring_write((struct watch*)c, URING_TARGET, s->target.fd, body + *sent, body_len - *sent, false)) return -1;
+        s->tx = c;
+        conn_io_session(c, s);
+        return 0;
+    }
+    while (*sent < body_len) {
+        ssize_t w = send(s->target.fd, body + *sent, body_len - *sent, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        *sent += (size_t)w;
+        RELAXED_ADD(s->bytes_up, (size_t)w); RELAXED_ADD(metrics.bytes_up, (size_t)w);
+    }
+    return 1;
+}
+
+// Read what the target has right now, up to cap bytes, for c. On an
+// io_uring worker that is one non-blocking ring read, and DRAIN_QUEUED says
+// target_done() carries on; a session drains for one conn at a time.
+#define DRAIN_QUEUED (-2)
+
+static ssize_t drain_target(struct session *s, struct conn *c, char *dst, size_t cap){
+    if (ensure_target(s) < 0) return -1;
+    if (ring_fd >= 0 && cap > 0) {
+        if (!uring_read((struct watch*)c, URING_TARGET, s->target.fd, dst, cap, true)) return -1;
+        s->rx = c;
+        s->rx_start = now_us();
+        conn_io_session(c, s);
+        return DRAIN_QUEUED;
+    }
     size_t off = 0;
     for (;;) {
         if (off == cap) break;
-        ssize_t r = recv(target_fd, dst + off, cap - off, MSG_DONTWAIT);
+        ssize_t r = recv(s->target.fd, dst + off, cap - off, MSG_DONTWAIT);
         if (r > 0) { off += (size_t)r; continue; }
         if (r == 0) { // target closed
-            close_target();
+            target_gone(s);
             break;
         }
         if (errno == EAGAIN || errno == EWOULDBLOCK) break; // no more right now
         if (errno == EINTR) continue;
         // other error: treat as closed for simplicity
-        close_target();
+        target_gone(s);
         break;
     }
+    RELAXED_ADD(s->bytes_down, off); RELAXED_ADD(metrics.bytes_down, off);
     return (ssize_t)off; // may be 0
 }
 
-// === Handle a single SCGI request over client_fd ===
-static int handle_scgi_request(int client_fd) {
-    // 1) Read netstring headers
-    char *hdrs = NULL; size_t hdrs_len = 0;
-    if (read_netstring(client_fd, &hdrs, &hdrs_len) < 0) {
-        const char *msg = "Status: 400 Bad Request\r\nContent-Type: text/plain\r\n\r\ninvalid SCGI netstring\n";
-        write_all(client_fd, msg, strlen(msg));
-        return -1;
-    }
-    // 2) Validate
-    const char *scgi = kv_get(hdrs, hdrs_len, "SCGI");
-    const char *clen = kv_get(hdrs, hdrs_len, "CONTENT_LENGTH");
-    if (!scgi || strcmp(scgi, "1") != 0 || !clen) {
-        const char *msg = "Status: 400 Bad Request\r\nContent-Type: text/plain\r\n\r\nmissing SCGI or CONTENT_LENGTH\n";
-        write_all(client_fd, msg, strlen(msg));
-        free(hdrs);
-        return -1;
-    }
-    long body_len = strtol(clen, NULL, 10);
-    if (body_len < 0 || body_len > (long)MAX_BODY) {
-        const char *msg = "Status: 413 Payload Too Large\r\nContent-Type: text/plain\r\n\r\nbody too large\n";
-        write_all(client_fd, msg, strlen(msg));
-        free(hdrs);
-        return -1;
-    }
-
-    // 3) Read request body
-    char *body = NULL;
-    if (body_len > 0) {
-        body = (char*)malloc((size_t)body_len);
-        if (!body) { free(hdrs); return -1; }
-        if (read_n(client_fd, body, (size_t)body_len) != body_len) {
-            const char *msg = "Status: 400 Bad Request\r\nContent-Type: text/plain\r\n\r\nshort body\n";
-            write_all(client_fd, msg, strlen(msg));
-            free(hdrs); free(body);
-            return -1;
-        }
+// drain_target() into a pipe: moves whatever the target has right now, up
+// to the pipe's capacity.
+static ssize_t drain_target_to_pipe(struct session *s, struct pipe_pair *p, size_t cap){
+    if (ensure_target(s) < 0) return -1;
+    size_t off = 0;
+    if (cap > p->cap) cap = p->cap;
+    while (off < cap) {
+        ssize_t r = splice(s->target.fd, NULL, p->wr, NULL, cap - off, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r > 0) { off += (size_t)r; continue; }
+        if (r == 0) { target_gone(s); break; }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break; // target empty or pipe full
+        if (errno == EINTR) continue;
+        target_gone(s);
+        break;
     }
+    RELAXED_ADD(s->bytes_down, off); RELAXED_ADD(metrics.bytes_down, off);
+    return (ssize_t)off;
+}
 
-    // 4) Forward body to persistent target
-    if (body_len > 0) {
-        if (forward_body_to_target(body, (size_t)body_len) < 0) {
-            const char *msg = "Status: 502 Bad Gateway\r\nContent-Type: text/plain\r\n\r\nwrite to target failed\n";
-            write_all(client_fd, msg, strlen(msg));
-            free(hdrs); if (body) free(body);
-            return -1;
-        }
-    } else {
-        // Even with zero-length body, we still drain target below.
-    }
-
-    // 5) Non-blocking drain of any bytes currently available from target
-    char *resp = (char*)malloc(MAX_RESP);
-    if (!resp) { free(hdrs); if (body) free(body); return -1; }
-    ssize_t got = drain_target(resp, MAX_RESP);
-    if (got < 0) {
-        const char *msg = "Status: 502 Bad Gateway\r\nContent-Type: text/plain\r\n\r\nread from target failed\r";
-        write_all(client_fd, msg, strlen(msg));
-        free(hdrs); if (body) free(body); free(resp);
-        return -1;
-    }
-
-    // 6) Reply to lighttpd
-    char header[256];
-    int hlen = snprintf(header, sizeof(header),
-                        "Status: 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n",
-                        (size_t)got);
-    if (hlen < 0 || hlen >= (int)sizeof(header))
-        hlen = (int)strlen("Status: 200 OK\r\n\r\n");
-    write_all(client_fd, header, (size_t)hlen);
-    if (got > 0) write_all(client_fd, resp, (size_t)got);
-
-    free(hdrs); if (body) free(body); free(resp);
-    return 0;
+// === Replay ===
+// A frontend that sends X-Tunnel-Ack (how many downstream bytes of the
+// session it has received) gets its replies out of a per-session replay
+// buffer. Bytes stay there until a later request acknowledges them, so a
+// reply lost on the way is sent again, ahead of newer target data, to the
+// next poll. X-Tunnel-Offset on the reply says where its body starts.
+// Upstream, X-Tunnel-Offset says where a body starts in the session's byte
+// stream; whatever the session already took is dropped, so a post retried
+// after a lost reply reaches the target once.
+// Striped transfers run several of these at once. A body that starts past
+// the end of the stream is held until the posts before it fill the gap, and
+// a poll with X-Tunnel-Stripe gets only bytes no reply has carried yet, so
+// concurrent polls split the stream instead of repeating it.
+// A poll that takes everything unacknowledged, while none of it is held in
+// memory, keeps the splice path: target data goes onto a per-session replay
+// pipe and tee() puts a copy of the reply's share into the reply's pipe.
+// Stripes and compressed replies need the bytes in memory; they read the
+// pipe out into the buffer first.
+
+static void replay_release(struct session *s) {
+    if (s->rx) return;      // a ring drain is filling the buffer
+    pool_put(s->replay, s->replay_cap); s->replay = NULL; s->replay_cap = 0;
+    pipe_put(&s->rpipe, 0); s->replay_piped = false;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <scgi_listen_port> <target_local_port>\n", argv[0]);
-        return 1;
-    }
-    int scgi_port = atoi(argv[1]);
-    int target_port = atoi(argv[2]);
-    if (scgi_port <= 0 || scgi_port > 65535 || target_port <= 0 || target_port > 65535) {
-        fprintf(stderr, "invalid port\n");
-        return 1;
+// Drop n bytes off the front of the replay pipe.
+static void replay_pipe_skip(struct session *s, size_t n) {
+    char tmp[4096];
+    while (n > 0) {
+        ssize_t r = splice(s->rpipe.rd, NULL, devnull_fd, NULL, n, SPLICE_F_NONBLOCK);
+        if (r < 0 && errno != EINTR) r = read(s->rpipe.rd, tmp, n < sizeof(tmp) ? n : sizeof(tmp));
+        if (r > 0) n -= (size_t)r;
+        else if (r == 0 || errno != EINTR) break;
     }
-    target_port_g = (uint16_t)target_port;
+}
 
-    signal(SIGINT, on_sigint);
-    signal(SIGTERM, on_sigint);
+// Move the piped replay bytes into the buffer.
+static int replay_unpipe(struct session *s) {
+    if (!s->replay_piped) return 0;
+    if (!(s->replay = (char*)pool_get(replay_max, &s->replay_cap))) return -1;
+    for (size_t off = 0; off < s->replay_len; ) {
+        ssize_t r = read(s->rpipe.rd, s->replay + off, s->replay_len - off);
+        if (r > 0) off += (size_t)r;
+        else if (r == 0 || errno != EINTR) return -1;
+    }
+    pipe_put(&s->rpipe, 0); s->replay_piped = false;
+    return 0;
+}
 
-    int srv = socket(AF_INET, SOCK_STREAM, 0);
-    if (srv < 0) { perror("socket"); return 1; }
-    int one = 1; setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+// Forget the bytes up to ack. An ack below the buffer is a stale one from a
+// request that overlapped a newer one. Returns -1 when ack is past the end.
+static int replay_ack(struct session *s, uint64_t ack) {
+    if (ack < s->replay_base) return 0;
+    if (ack - s->replay_base > s->replay_len) return -1;
+    size_t drop = (size_t)(ack - s->replay_base);
+    if (drop > 0) {
+        s->replay_len -= drop;
+        if (s->replay_piped) replay_pipe_skip(s, drop);
+        else memmove(s->replay, s->replay + drop, s->replay_len);
+        s->replay_sent = s->replay_sent > drop ? s->replay_sent - drop : 0;
+        s->replay_base = ack;
+    }
+    if (s->replay_len == 0) replay_release(s);
+    return 0;
+}
 
-    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET; addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    addr.sin_port = htons((uint16_t)scgi_port);
+// Where a reply of at most cap bytes ends in the buffer; *from receives
+// where it starts.
+static size_t replay_end(const struct session *s, bool fresh, size_t cap, size_t *from) {
+    *from = fresh ? s->replay_sent : 0;
+    return replay_max - *from > cap ? *from + cap : replay_max;
+}
 
-    if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(srv); return 1; }
-    if (listen(srv, 64) < 0) { perror("listen"); close(srv); return 1; }
-    fprintf(stderr, "SCGI tunnel listening on 127.0.0.1:%d → localhost:%d (persistent target)\n", scgi_port, target_port);
+// Hand out the buffered bytes up to end as a reply starting at from, and
+// return its length.
+static ssize_t replay_take(struct session *s, bool fresh, size_t from, size_t end) {
+    if (end > s->replay_len) end = s->replay_len;
+    if (!fresh) RELAXED_ADD(metrics.replayed_bytes, s->replay_sent < end ? s->replay_sent : end);
+    if (s->replay_sent < end) s->replay_sent = end;
+    if (s->replay_len == 0) replay_release(s);
+    return (ssize_t)(end - from);
+}
 
-    while (keep_running) {
-        struct sockaddr_in cli; socklen_t cl = sizeof(cli);
-        int fd = accept(srv, (struct sockaddr*)&cli, &cl);
-        if (fd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept"); break;
-        }
-        handle_scgi_request(fd);
-        close(fd);
+// Top up the buffer from the target, only as far as the reply of at most
+// cap bytes reaches, and return its length; *from receives where it starts.
+// DRAIN_QUEUED: a ring read for c is topping it up (see target_done()).
+static ssize_t replay_fill(struct session *s, struct conn *c, bool fresh, size_t cap, size_t *from) {
+    size_t end = replay_end(s, fresh, cap, from);
+    if (!s->closed && s->replay_len < end) {
+        if (!s->replay && !(s->replay = (char*)pool_get(replay_max, &s->replay_cap))) return -1;
+        ssize_t got = drain_target(s, c, s->replay + s->replay_len, end - s->replay_len);
+        if (got < 0) return got == DRAIN_QUEUED ? DRAIN_QUEUED : -1;
+        s->replay_len += (size_t)got;
     }
+    return replay_take(s, fresh, *from, end);
+}
+
+// replay_fill() without the copies, for a poll that takes everything
+// unacknowledged: tops up the replay pipe and tees up to cap bytes of it
+// into out. Returns the reply's length, -1 on error.
+static ssize_t replay_fill_pipe(struct session *s, struct pipe_pair *out, size_t cap) {
+    if (!s->replay_piped) {
+        if (pipe_get(&s->rpipe) < 0) return -1;
+        s->replay_piped = true;
+    }
+    size_t end = cap < replay_max ? cap : replay_max;
+    if (!s->closed && s->replay_len < end) {
+        ssize_t got = drain_target_to_pipe(s, &s->rpipe, end - s->replay_len);
+        if (got < 0) return -1;
+        s->replay_len += (size_t)got;
+    }
+    if (end > s->replay_len) end = s->replay_len;
+    ssize_t n = 0;
+    while (end > 0 && (n = tee(s->rpipe.rd, out->wr, end, SPLICE_F_NONBLOCK)) < 0 && errno == EINTR) {}
+    if (n < 0) { if (errno != EAGAIN) return -1; n = 0; }
+    RELAXED_ADD(metrics.replayed_bytes, s->replay_sent < (size_t)n ? s->replay_sent : (size_t)n);
+    if (s->replay_sent < (size_t)n) s->replay_sent = (size_t)n;
+    if (s->replay_len == 0) replay_release(s);
+    return n;
+}
+
+// Drop the part of a body the session already took. Returns -1 when the
+// body starts past the end of the session's upstream stream.
+static int upstream_dedup(struct session *s, char *body, size_t *len, uint64_t offset) {
+    if (offset > s->up_seq) return -1;
+    size_t dup = s->up_seq - offset < *len ? (size_t)(s->up_seq - offset) : *len;
+    if (dup > 0) {
+        memmove(body, body + dup, *len - dup);
+        *len -= dup;
+        RELAXED_ADD(metrics.duplicate_bytes, dup);
+    }
+    return 0;
+}
+
+// === Client connections: one SCGI request each ===
+// A connection walks through these states; any of them may stop on EAGAIN
+// and resume when epoll reports the relevant fd ready again.
+#define IN_BUF_INIT 16384           // first read: headers plus a small body; grows to fit the netstring
+#define CONN_IDLE_MS 60000          // drop connections that make no progress
+#define STREAM_CHUNK 65536          // largest single read forwarded on a stream
+
+enum conn_state {
+    CS_NETSTRING,   // reading the "<len>:" prefix
+    CS_HEADERS,     // reading the header block and trailing comma
+    CS_BODY,        // reading CONTENT_LENGTH bytes of body
+    CS_TARGET,      // queued behind the session's earlier writes / writing
+    CS_DRAIN,       // collecting whatever the target has for us
+    CS_WAIT,        // long-poll parked until target data or its deadline
+    CS_HELD,        // body starts past the upstream stream: waiting for the gap
+    CS_REPLY,       // sending status, headers and body
+    CS_STREAM,      // open-ended reply fed from the target as data appears
+    CS_HANDOFF,     // headers parsed; the session lives on worker handoff_to
+};
+
+struct conn {
+    struct watch w;                 // client socket; must be first
+    enum conn_state state;
+    char *in; size_t in_len, in_cap;    // netstring plus any body bytes read with it
+    size_t ns_off, ns_len;          // netstring payload position in `in`
+    size_t body_off, req_end;       // where the body starts in `in`, and where this request ends
+    bool http;                      // came in on the --http listener
+    bool keep_alive;                // HTTP: read the next request once this one is answered
+    bool body_done;                 // every body byte has been read from the client
+    char *body; size_t body_len, body_cap, body_got, body_sent;
+    bool body_deflated;             // X-Tunnel-Encoding: deflate, inflated before it is queued
+    bool accept_deflate;            // X-Tunnel-Accept-Encoding: the reply may be compressed
+    bool splice_body;               // stream the body client -> pipe -> target
+    struct pipe_pair pipe;          // rd < 0 when the request has none
+    size_t pipe_len;                // bytes sitting in the pipe
+    bool retried;                   // anonymous session already reconnected once
+    struct session *sess;
+    struct conn *wnext;             // session write queue / waiter list link
+    unsigned long wait_ms;          // long-poll time granted to this request
+    bool close_req;                 // X-Tunnel-Close: the frontend is done with the session
+    bool upload_only;               // X-Tunnel-Dir: up: target data is left for down polls
+    bool stream;                    // X-Tunnel-Dir: stream: keep the reply open
+    bool detached;                  // replied already; only the queued body is left
+    bool has_offset, has_ack;       // X-Tunnel-Offset / X-Tunnel-Ack were sent
+    bool fresh;                     // X-Tunnel-Stripe: skip bytes other replies carried
+    uint64_t offset, ack;           // where the body starts upstream; downstream bytes received
+    size_t window;                  // X-Tunnel-Window: most reply bytes the frontend takes (MAX_RESP if unsent)
+    bool handed_off;                // came from another worker, headers already counted
+    int handoff_to;
+    char hdr[384]; size_t hdr_len;  // reply status line and headers
+    char *resp; size_t resp_len, resp_cap;  // reply body
+    size_t sent;                    // reply bytes written so far
+    uint64_t deadline; size_t timer_idx;
+    uint64_t t_start;               // accept time, then time the body was queued (us)
+    struct session *io_sess;        // io_uring: session of the target write or drain in flight
+    int send_err;                   // io_uring: errno of a failed reply write
+    bool rx_queued, rx_may_wait;    // on the session's drain queue, with finish_request()'s may_wait
+    struct conn *next_dead;
+};
+
+static __thread struct conn *dead_conns = NULL;  // closed during this batch, freed after it
+
+// c outlives a session_unqueue() while its target op is in flight.
+static void conn_io_session(struct conn *c, struct session *s) { c->io_sess = s; }
+
+// Connection structs are recycled like buffers
+#define CONN_POOL_MAX 1024
+static __thread struct conn *conn_pool[CONN_POOL_MAX];
+static __thread size_t conn_pool_len = 0;
+
+static struct conn *conn_new(void) {
+    struct conn *c;
+    if (conn_pool_len > 0) { c = conn_pool[--conn_pool_len]; RELAXED_ADD(pool_hits, 1); }
+    else if ((c = (struct conn*)malloc(sizeof(*c))) != NULL) RELAXED_ADD(pool_misses, 1);
+    else return NULL;
+    memset(c, 0, sizeof(*c));
+    return c;
+}
+
+// --- deadline heap ---
+static __thread struct conn **timers = NULL;
+static __thread size_t timer_count = 0, timer_cap = 0;
+static __thread _Atomic size_t conns_open = 0;  // timer_count, for /metrics
+
+static void timer_swap(size_t a, size_t b) {
+    struct conn *t = timers[a]; timers[a] = timers[b]; timers[b] = t;
+    timers[a]->timer_idx = a; timers[b]->timer_idx = b;
+}
+
+static void timer_sift(size_t i) {
+    while (i > 0 && timers[(i - 1) / 2]->deadline > timers[i]->deadline) {
+        timer_swap(i, (i - 1) / 2); i = (i - 1) / 2;
+    }
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < timer_count && timers[l]->deadline < timers[m]->deadline) m = l;
+        if (r < timer_count && timers[r]->deadline < timers[m]->deadline) m = r;
+        if (m == i) break;
+        timer_swap(i, m); i = m;
+    }
+}
+
+static void timer_del(struct conn *c) {
+    if (c->timer_idx == SIZE_MAX) return;
+    size_t i = c->timer_idx;
+    timer_swap(i, --timer_count);
+    RELAXED_SET(conns_open, timer_count);
+    c->timer_idx = SIZE_MAX;
+    if (i < timer_count) timer_sift(i);
+}
+
+static int timer_set(struct conn *c, uint64_t deadline) {
+    c->deadline = deadline;
+    if (c->timer_idx == SIZE_MAX) {
+        if (timer_count == timer_cap) {
+            size_t ncap = timer_cap ? timer_cap * 2 : 64;
+            struct conn **nt = (struct conn**)realloc(timers, ncap * sizeof(*nt));
+            if (!nt) return -1;
+            timers = nt; timer_cap = ncap;
+        }
+        c->timer_idx = timer_count;
+        timers[timer_count++] = c;
+        RELAXED_SET(conns_open, timer_count);
+    }
+    timer_sift(c->timer_idx);
+    return 0;
+}
+
+static void session_pump(struct session *s);
+
+// Take the head off the session's write queue.
+static void wq_pop(struct session *s) {
+    struct conn *c = s->wq_head;
+    s->wq_head = c->wnext;
+    if (!s->wq_head) s->wq_tail = NULL;
+    RELAXED_SUB(s->queued, c->body_len);
+    c->wnext = NULL;
+    c->state = CS_DRAIN;
+}
+
+static void session_unqueue(struct conn *c) {
+    struct session *s = c->sess;
+    if (!s) return;
+    if (c->rx_queued) {
+        struct conn **pp = &s->rxq;
+        while (*pp != c) pp = &(*pp)->wnext;
+        *pp = c->wnext;
+        c->wnext = NULL;
+        c->rx_queued = false;
+    }
+    if (c->state == CS_STREAM) {
+        if (s->stream == c) s->stream = NULL;
+        c->state = CS_DRAIN;
+        session_update_watch(s);
+        return;
+    }
+    if (c->state == CS_WAIT || c->state == CS_HELD) {
+        struct conn **pp = c->state == CS_WAIT ? &s->waiters : &s->held;
+        while (*pp && *pp != c) pp = &(*pp)->wnext;
+        if (*pp) *pp = c->wnext;
+        if (c->state == CS_HELD) s->held_bytes -= c->body_len;
+        c->wnext = NULL;
+        c->state = CS_DRAIN;
+        session_update_watch(s);
+        return;
+    }
+    if (c->state != CS_TARGET) return;
+    struct conn **pp = &s->wq_head, *prev = NULL;
+    while (*pp && *pp != c) { prev = *pp; pp = &(*pp)->wnext; }
+    if (!*pp) return;
+    bool was_head = (s->wq_head == c);
+    *pp = c->wnext;
+    if (s->wq_tail == c) s->wq_tail = prev;
+    RELAXED_SUB(s->queued, c->body_len);
+    c->wnext = NULL;
+    if (was_head) session_pump(s);
+}
+
+// Also drops a detached request whose body is still queued.
+static void conn_close(struct conn *c) {
+    if (c->w.fd < 0 && !c->detached) return;
+    c->detached = false;
+    timer_del(c);
+    session_unqueue(c);
+    if (c->sess) { session_release(c->sess); c->sess = NULL; }
+    watch_close(&c->w);
+    uring_stop(&c->w, URING_TARGET);
+    c->next_dead = dead_conns;
+    dead_conns = c;
+}
+
+// A conn with ring reads or writes still in flight waits for a later batch.
+static void free_dead_conns(void) {
+    struct conn *busy = NULL;
+    while (dead_conns) {
+        struct conn *c = dead_conns; dead_conns = c->next_dead;
+        if (c->w.slot) { c->next_dead = busy; busy = c; continue; }
+        pipe_put(&c->pipe, c->pipe_len);
+        pool_put(c->in, c->in_cap);
+        pool_put(c->body, c->body_cap);
+        pool_put(c->resp, c->resp_cap);
+        if (conn_pool_len < CONN_POOL_MAX) { conn_pool[conn_pool_len++] = c; continue; }
+        free(c);
+    }
+    dead_conns = busy;
+}
+
+static void conn_write(struct conn *c);
+static void stream_start(struct conn *c);
+
+// Send what is left of the reply headers and body with one sendmsg().
+static ssize_t send_reply(struct conn *c, int flags) {
+    struct iovec iov[2]; size_t n = 0;
+    if (c->sent < c->hdr_len) { iov[n].iov_base = c->hdr + c->sent; iov[n++].iov_len = c->hdr_len - c->sent; }
+    size_t body_off = c->sent > c->hdr_len ? c->sent - c->hdr_len : 0;
+    if (body_off < c->resp_len) { iov[n].iov_base = c->resp + body_off; iov[n++].iov_len = c->resp_len - body_off; }
+    struct msghdr mh; memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov; mh.msg_iovlen = n;
+    return sendmsg(c->w.fd, &mh, MSG_NOSIGNAL | flags);
+}
+
+// Start the reply headers in c->hdr: a CGI Status line for SCGI, the status
+// line for HTTP. An HTTP connection takes another request only if this
+// one's body was read in full.
+static int reply_status(struct conn *c, const char *status) {
+    if (!c->http) return snprintf(c->hdr, sizeof(c->hdr), "Status: %s\r\n", status);
+    if (!c->body_done) c->keep_alive = false;
+    return snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 %s\r\n%s", status, c->keep_alive ? "" : "Connection: close\r\n");
+}
+
+// Replace whatever the connection was doing with a short plain-text error.
+// hdrs holds extra header lines, each ending in CRLF.
+static void reply_error_hdrs(struct conn *c, const char *status, const char *hdrs, const char *text) {
+    // nobody left to tell, or a reply already going out on the ring
+    if (c->detached || uring_busy(&c->w, URING_SEND)) { conn_close(c); return; }
+    session_unqueue(c);
+    pipe_put(&c->pipe, c->pipe_len);   // never send leftover body bytes back
+    c->pipe_len = 0;
+    count_reply(status);
+    int n = reply_status(c, status);
+    if (c->http) n += snprintf(c->hdr + n, sizeof(c->hdr) - (size_t)n, "Content-Length: %zu\r\n", strlen(text) + 1);
+    n += snprintf(c->hdr + n, sizeof(c->hdr) - (size_t)n, "Content-Type: text/plain\r\n%s\r\n%s\n", hdrs, text);
+    c->hdr_len = (n < 0 || n >= (int)sizeof(c->hdr)) ? sizeof(c->hdr) - 1 : (size_t)n;
+    c->resp_len = 0;
+    c->sent = 0;
+    c->state = CS_REPLY;
+    conn_write(c);
+}
+
+static void reply_error(struct conn *c, const char *status, const char *text) {
+    reply_error_hdrs(c, status, "", text);
+}
+
+// An upstream-only body is queued behind slower writes: answer it now so
+// the frontend can send more, with the queue depth as a hint. The conn
+// stays on as the queue entry once the reply is out.
+static void reply_queued(struct conn *c) {
+    RELAXED_ADD(metrics.replies_2xx, 1);
+    c->keep_alive = false;              // the conn is spoken for until its body is written
+    int hlen = reply_status(c, "200 OK");
+    hlen += snprintf(c->hdr + hlen, sizeof(c->hdr) - (size_t)hlen,
+                     "Content-Type: application/octet-stream\r\nContent-Length: 0\r\nX-Tunnel-Queue: %zu\r\n\r\n",
+                     c->sess->queued);
+    c->hdr_len = (size_t)hlen;
+    c->sent = 0;
+    conn_write(c);
+}
+
+// Make c->resp hold at least n bytes; a smaller one left by an earlier reply
+// on a keep-alive connection goes back to the pool.
+static bool resp_reserve(struct conn *c, size_t n) {
+    if (c->resp && c->resp_cap >= n) return true;
+    pool_put(c->resp, c->resp_cap);
+    c->resp = (char*)pool_get(n, &c->resp_cap);
+    return c->resp != NULL;
+}
+
+// Compress a drained reply in c->resp when that pays. Returns true with
+// *got set to the compressed length.
+static bool deflate_reply(struct conn *c, ssize_t *got) {
+    struct zadapt *z = &c->sess->zdown;
+    size_t zcap;
+    char *zbuf = (char*)pool_get((size_t)*got, &zcap);
+    size_t zlen = zbuf ? deflate_if_smaller(c->resp, (size_t)*got, zbuf) : 0;
+    zadapt_result(z, zlen > 0);
+    if (zlen == 0) { pool_put(zbuf, zcap); RELAXED_ADD(metrics.deflate_bypassed, 1); return false; }
+    RELAXED_ADD(metrics.deflate_raw, (size_t)*got); RELAXED_ADD(metrics.deflate_wire, zlen);
+    pool_put(c->resp, c->resp_cap);
+    c->resp = zbuf; c->resp_cap = zcap; c->resp_len = zlen;
+    *got = (ssize_t)zlen;
+    return true;
+}
+
+static bool conn_replays(const struct conn *c) {
+    return c->has_ack && !c->close_req && !c->upload_only && !c->stream;
+}
+
+static void reply_drained(struct conn *c, ssize_t got, size_t from, bool more, bool may_wait);
+static void reply_replay(struct conn *c, ssize_t got, size_t from, bool piped);
+
+// io_uring: the session drains for another conn; c goes next, in order.
+static void drain_later(struct session *s, struct conn *c, bool may_wait) {
+    if (c->rx_queued) return;
+    struct conn **pp = &s->rxq;
+    while (*pp) pp = &(*pp)->wnext;
+    *pp = c;
+    c->wnext = NULL;
+    c->rx_queued = true;
+    c->rx_may_wait = may_wait;
+}
+
+// Drain the target and send the 200 reply. With may_wait, a request that
+// asked for a long-poll and finds nothing is parked instead.
+static void finish_request(struct conn *c, bool may_wait) {
+    struct session *s = c->sess;
+    c->state = CS_DRAIN;
+    if (s->rx) { drain_later(s, c, may_wait); return; }
+    bool replay = conn_replays(c);
+    if (replay && replay_ack(s, c->ack) < 0) { reply_error(c, "409 Conflict", "ack outside the replay window"); return; }
+    // a closed session still hands out the bytes it had not seen acknowledged
+    if (s->closed && !(replay && s->replay_len > 0)) {
+        s->finished = true;
+        reply_error(c, "410 Gone", "session closed");
+        return;
+    }
+    // a compressible reply needs the bytes in memory, so it skips splice()
+    bool try_deflate = c->accept_deflate && s->zdown.skip == 0;
+    ssize_t got = 0;
+    bool more = false;      // the reply filled its buffer: the target likely has more
+    c->rx_may_wait = may_wait;
+    if (c->close_req) {
+        // the frontend's local connection is gone: end the session now
+        target_gone(s);
+    } else if (c->stream) {
+        stream_start(c);
+        return;
+    } else if (c->upload_only) {
+        // full-duplex upstream post: a concurrent down poll carries the replies
+    } else if (replay) {
+        uint64_t t0 = now_us();
+        size_t from = 0;    // where the reply starts in the buffer
+        bool piped = use_splice && !try_deflate && !c->fresh && (s->replay_piped || s->replay_len == 0) &&
+                     (c->pipe.rd >= 0 || pipe_get(&c->pipe) == 0);
+        if (piped) got = replay_fill_pipe(s, &c->pipe, c->window);
+        else got = replay_unpipe(s) < 0 ? -1 : replay_fill(s, c, c->fresh, c->window, &from);
+        if (got == DRAIN_QUEUED) return;
+        hist_observe(&metrics.drain, now_us() - t0);
+        reply_replay(c, got, from, piped);
+        return;
+    } else if (c->window == 0) {
+        // the frontend has no room: the reply only carries our window
+    } else if (use_splice && !try_deflate && (c->pipe.rd >= 0 || pipe_get(&c->pipe) == 0)) {
+        uint64_t t0 = now_us();
+        got = drain_target_to_pipe(s, &c->pipe, c->window);
+        hist_observe(&metrics.drain, now_us() - t0);
+        if (got > 0) c->pipe_len = (size_t)got;
+        more = (size_t)got == c->pipe.cap || (size_t)got == c->window;
+    } else {
+        if (!resp_reserve(c, c->window)) { conn_close(c); return; }
+        uint64_t t0 = now_us();
+        got = drain_target(s, c, c->resp, c->window);
+        if (got == DRAIN_QUEUED) return;
+        hist_observe(&metrics.drain, now_us() - t0);
+        if (got > 0) c->resp_len = (size_t)got;
+        more = (size_t)got == c->window;
+    }
+    reply_drained(c, got, 0, more, may_wait);
+}
+
+// A replay reply of got bytes, from `from` in the buffer or already teed
+// into c->pipe.
+static void reply_replay(struct conn *c, ssize_t got, size_t from, bool piped) {
+    struct session *s = c->sess;
+    if (got > 0 && piped) c->pipe_len = (size_t)got;
+    else if (got > 0) {
+        if (!resp_reserve(c, (size_t)got)) { conn_close(c); return; }
+        memcpy(c->resp, s->replay + from, (size_t)got);
+        c->resp_len = (size_t)got;
+    }
+    bool more = got > 0 && ((size_t)got == c->window || s->replay_len == replay_max ||
+                            (piped && s->replay_len >= s->rpipe.cap));
+    reply_drained(c, got, from, more, c->rx_may_wait);
+}
+
+// The second half of finish_request(), once the target is drained: got
+// bytes (-1 on error), `from` where a replay reply starts in the buffer.
+static void reply_drained(struct conn *c, ssize_t got, size_t from, bool more, bool may_wait) {
+    struct session *s = c->sess;
+    bool replay = conn_replays(c);
+    bool try_deflate = c->accept_deflate && s->zdown.skip == 0;
+    if (got < 0) { reply_error(c, "502 Bad Gateway", "read from target failed"); return; }
+    if (got == 0 && may_wait && c->wait_ms > 0 && c->window > 0 && !s->closed) {
+        c->state = CS_WAIT;
+        c->wnext = s->waiters;
+        s->waiters = c;
+        session_update_watch(s);
+        watch_set(&c->w, EPOLLRDHUP);       // notice the client giving up
+        timer_set(c, now_ms() + c->wait_ms);
+        return;
+    }
+    if (got == 0 && !c->close_req && !c->upload_only) RELAXED_ADD(metrics.empty_polls, 1);
+    // the frontend is done with the session, or this reply hands out its last bytes
+    if (s->id[0] && (c->close_req || (s->closed && s->replay_sent >= s->replay_len))) s->finished = true;
+    bool deflated = false;
+    if (c->accept_deflate && got >= ZMIN) {
+        if (try_deflate) deflated = deflate_reply(c, &got);
+        else { s->zdown.skip--; RELAXED_ADD(metrics.deflate_bypassed, 1); }
+    }
+    RELAXED_ADD(metrics.replies_2xx, 1);
+    char wait_hdr[48] = "";
+    if (c->wait_ms > 0) snprintf(wait_hdr, sizeof(wait_hdr), "X-Tunnel-Wait: %lu\r\n", c->wait_ms);
+    char queue_hdr[48] = "";
+    if (s->queued > 0) snprintf(queue_hdr, sizeof(queue_hdr), "X-Tunnel-Queue: %zu\r\n", s->queued);
+    // our receive window: what the write queue still takes before a 429
+    size_t pending = s->queued + s->held_bytes;
+    char window_hdr[48];
+    snprintf(window_hdr, sizeof(window_hdr), "X-Tunnel-Window: %zu\r\n", queue_max > pending ? queue_max - pending : 0);
+    char offset_hdr[48] = "";
+    if (replay) snprintf(offset_hdr, sizeof(offset_hdr), "X-Tunnel-Offset: %llu\r\n", (unsigned long long)(s->replay_base + from));
+    int hlen = reply_status(c, "200 OK");
+    hlen += snprintf(c->hdr + hlen, sizeof(c->hdr) - (size_t)hlen,
+                     "Content-Type: application/octet-stream\r\nContent-Length: %zu\r\n%s%s%s%s%s%s%s\r\n",
+                     (size_t)got, s->closed ? "X-Tunnel-Closed: 1\r\n" : "", wait_hdr,
+                     deflated ? "X-Tunnel-Encoding: deflate\r\n" : "", queue_hdr,
+                     more && !s->closed ? "X-Tunnel-More: 1\r\n" : "", offset_hdr, window_hdr);
+    c->hdr_len = (size_t)hlen;
+    c->sent = 0;
+    c->state = CS_REPLY;
+    conn_write(c);
+}
+
+// Fail every request still waiting to write to this session's target.
+static void session_fail_queue(struct session *s) {
+    while (s->wq_head) {
+        struct conn *c = s->wq_head;
+        wq_pop(s);
+        reply_error(c, "502 Bad Gateway", "write to target failed");
+    }
+}
+
+// Stream a spliced body: first the bytes that arrived with the headers,
+// then client -> pipe -> target. Returns 1 when done, 0 when the client or
+// the target would block (and arranges to be woken), -1 on a target error
+// and -2 when the client went away mid-body.
+static int splice_body_to_target(struct session *s, struct conn *c) {
+    if (ensure_target(s) < 0) return -1;
+    size_t pre_off = c->body_off;
+    size_t pre = c->in_len - pre_off;
+    if (pre > c->body_len) pre = c->body_len;
+    if (c->body_sent < pre) {
+        int r = forward_body_to_target(s, c, c->in + pre_off, pre, &c->body_sent);
+        if (r <= 0) { s->want_out = (r == 0); return r; }
+    }
+    while (c->body_sent < c->body_len) {
+        if (c->pipe_len > 0) {
+            ssize_t n = splice(c->pipe.rd, NULL, s->target.fd, NULL, c->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { s->want_out = true; return 0; }
+                return -1;
+            }
+            c->pipe_len -= (size_t)n; c->body_sent += (size_t)n;
+            RELAXED_ADD(s->bytes_up, (size_t)n); RELAXED_ADD(metrics.bytes_up, (size_t)n);
+            continue;
+        }
+        size_t want = c->body_len - c->body_got;
+        if (want > c->pipe.cap) want = c->pipe.cap;
+        ssize_t n = splice(c->w.fd, NULL, c->pipe.wr, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) return -2;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                s->want_out = false;
+                watch_set(&c->w, EPOLLIN);
+                return 0;
+            }
+            return -2;
+        }
+        c->body_got += (size_t)n; c->pipe_len += (size_t)n;
+        timer_set(c, now_ms() + CONN_IDLE_MS);
+    }
+    watch_set(&c->w, 0);
+    c->body_done = true;
+    return 1;
+}
+
+// Write queued request bodies to the target in arrival order, then let each
+// request drain and reply. Stops when the target would block.
+static void session_pump(struct session *s) {
+    while (s->wq_head) {
+        struct conn *c = s->wq_head;
+        int r;
+        if (c->splice_body) {
+            r = splice_body_to_target(s, c);
+        } else {
+            r = forward_body_to_target(s, c, c->body, c->body_len, &c->body_sent);
+            s->want_out = r == 0 && ring_fd < 0;    // a ring write waits by itself
+        }
+        if (r == 0) { session_update_watch(s); return; }
+        if (r == -2) {
+            wq_pop(s);
+            reply_error(c, "400 Bad Request", "short body");
+            continue;
+        }
+        s->want_out = false;
+        if (r < 0 && c->splice_body && c->body_got > c->in_len - c->body_off) {
+            // spliced bytes are gone; there is nothing left to retry with
+            if (s->id[0]) { target_gone(s); session_fail_queue(s); return; }
+            close_target(s);
+            wq_pop(s);
+            reply_error(c, "502 Bad Gateway", "write to target failed");
+            continue;
+        }
+        if (r < 0) {
+            if (s->id[0]) { target_gone(s); session_fail_queue(s); return; }
+            // Try one reconnect (simple robustness)
+            close_target(s);
+            if (!c->retried) { c->retried = true; c->body_sent = 0; continue; }
+            wq_pop(s);
+            reply_error(c, "502 Bad Gateway", "write to target failed");
+            continue;
+        }
+        wq_pop(s);
+        hist_observe(&metrics.write, now_us() - c->t_start);
+        if (c->detached) conn_close(c);
+        else if (c->hdr_len > 0) c->state = CS_REPLY;   // early reply still going out
+        else finish_request(c, true);
+    }
+    s->want_out = false;
+    session_update_watch(s);
+}
+
+// The target became readable (or failed): hand its data to the oldest
+// parked long-poll. The rest stay parked for the next readable event,
+// unless the target is gone and they all need an answer.
+static void session_wake_waiters(struct session *s) {
+    while (s->waiters) {
+        struct conn *c = s->waiters, **pp = &s->waiters;
+        while (c->wnext) { pp = &c->wnext; c = c->wnext; }
+        *pp = NULL;
+        c->state = CS_DRAIN;
+        finish_request(c, false);
+        if (s->target.fd >= 0) break;
+    }
+    session_update_watch(s);
+}
+
+// === Streaming replies ===
+// A request with X-Tunnel-Dir: stream gets a reply without Content-Length
+// that stays open: every read from the target is written to the client as
+// soon as it arrives, so downstream bytes stop paying one request each.
+// One stream per session; a newer one replaces it. The stream ends when the
+// target goes away or after X-Tunnel-Wait (else CONN_IDLE_MS) without data,
+// and the frontend simply opens the next one.
+
+static __thread bool stream_draining = false;    // stream_pump() is reading the target
+
+// Nothing left to send, nor a ring drain pending: the stream may take more
+// target data.
+static bool stream_wants_data(const struct conn *c) {
+    return c->sent == c->hdr_len + c->resp_len && c->sess->rx != c && !c->rx_queued;
+}
+
+// The target had nothing (got 0) or failed: end the stream if the target is
+// gone, else wait for it.
+static void stream_idle(struct conn *c, ssize_t got) {
+    struct session *s = c->sess;
+    if (got < 0 || s->target.fd < 0) { conn_close(c); return; }
+    watch_set(&c->w, EPOLLRDHUP);       // notice the client giving up
+    timer_set(c, now_ms() + (c->wait_ms ? c->wait_ms : CONN_IDLE_MS));
+    session_update_watch(s);
+}
+
+static int reply_send(struct conn *c);
+
+static void stream_pump(struct conn *c) {
+    struct session *s = c->sess;
+    for (;;) {
+        int r = ring_fd >= 0 ? reply_send(c) : 1;
+        if (r < 0) { conn_close(c); return; }
+        if (r == 0) {
+            // stream_pump() runs again once the ring has written it
+            watch_set(&c->w, EPOLLRDHUP);
+            session_update_watch(s);
+            return;
+        }
+        while (c->sent < c->hdr_len + c->resp_len) {
+            ssize_t w = send_reply(c, 0);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // client is slow: stop reading the target until it catches up
+                    watch_set(&c->w, EPOLLOUT | EPOLLRDHUP);
+                    timer_set(c, now_ms() + CONN_IDLE_MS);
+                    session_update_watch(s);
+                    return;
+                }
+                conn_close(c);
+                return;
+            }
+            c->sent += (size_t)w;
+        }
+        c->sent = c->hdr_len = c->resp_len = 0;
+        if (s->closed) { conn_close(c); return; }
+        if (s->rx) { drain_later(s, c, false); return; }
+        stream_draining = true;
+        ssize_t got = drain_target(s, c, c->resp, c->resp_cap < STREAM_CHUNK ? c->resp_cap : STREAM_CHUNK);
+        stream_draining = false;
+        if (got == DRAIN_QUEUED) return;
+        if (got > 0) { c->resp_len = (size_t)got; continue; }
+        stream_idle(c, got);
+        return;
+    }
+}
+
+static void stream_start(struct conn *c) {
+    struct session *s = c->sess;
+    if (!c->resp) c->resp = (char*)pool_get(STREAM_CHUNK, &c->resp_cap);
+    if (!c->resp) { conn_close(c); return; }
+    if (s->stream) conn_close(s->stream);
+    char wait_hdr[48] = "";
+    if (c->wait_ms > 0) snprintf(wait_hdr, sizeof(wait_hdr), "X-Tunnel-Wait: %lu\r\n", c->wait_ms);
+    c->keep_alive = false;              // no length: the reply ends when the connection does
+    int hlen = reply_status(c, "200 OK");
+    hlen += snprintf(c->hdr + hlen, sizeof(c->hdr) - (size_t)hlen,
+                     "Content-Type: application/octet-stream\r\n"
+                     "Cache-Control: no-cache\r\nX-Accel-Buffering: no\r\nX-Tunnel-Stream: 1\r\n%s\r\n",
+                     wait_hdr);
+    c->hdr_len = (size_t)hlen;
+    c->sent = 0;
+    c->state = CS_STREAM;
+    s->stream = c;
+    RELAXED_ADD(metrics.replies_2xx, 1);
+    stream_pump(c);
+}
+
+// The target went away under an open stream: flush it and let it end.
+static void stream_kick(struct session *s) {
+    if (s->stream && !stream_draining && stream_wants_data(s->stream)) stream_pump(s->stream);
+}
+
+// === Metrics endpoint ===
+// With --metrics, a request whose PATH_INFO is /metrics gets the counters in
+// the Prometheus text format instead of touching a session. Session ids are
+// credentials, so per-session series are labelled with an 8-character prefix.
+#define METRICS_BUF_INIT 65536     // first buffer for a scrape; grown on demand
+
+// A pool buffer that moves up a size class when the text outgrows it.
+// Past MAX_RESP the text is cut off.
+struct text_buf { char *p; size_t len, cap; };
+
+static void tb_printf(struct text_buf *tb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void tb_printf(struct text_buf *tb, const char *fmt, ...) {
+    for (;;) {
+        if (tb->len + 1 >= tb->cap) return;
+        va_list ap; va_start(ap, fmt);
+        int n = vsnprintf(tb->p + tb->len, tb->cap - tb->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (tb->len + (size_t)n < tb->cap) { tb->len += (size_t)n; return; }
+        size_t ncap = 0;
+        char *np = tb->cap < MAX_RESP ? (char*)pool_get(tb->cap + 1, &ncap) : NULL;
+        if (!np) { tb->len = tb->cap - 1; return; }
+        memcpy(np, tb->p, tb->len);
+        pool_put(tb->p, tb->cap);
+        tb->p = np; tb->cap = ncap;
+    }
+}
+
+static void tb_metric(struct text_buf *tb, const char *name, const char *type, const char *help) {
+    tb_printf(tb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void tb_histogram(struct text_buf *tb, const char *name, const char *help, const struct histogram *h) {
+    tb_metric(tb, name, "histogram", help);
+    unsigned long long cum = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        cum += h->buckets[i];
+        tb_printf(tb, "%s_bucket{le=\"%g\"} %llu\n", name, (double)hist_bounds[i] / 1e6, cum);
+    }
+    tb_printf(tb, "%s_bucket{le=\"+Inf\"} %llu\n", name, h->count);
+    tb_printf(tb, "%s_sum %g\n%s_count %llu\n", name, (double)h->sum_us / 1e6, name, h->count);
+}
+
+static void reply_metrics(struct conn *c) {
+    if (!resp_reserve(c, METRICS_BUF_INIT)) { conn_close(c); return; }
+    struct text_buf tb = { c->resp, 0, c->resp_cap };
+    // counters are summed over all workers with relaxed loads: each value
+    // is whole, though the owners may be a request further along
+    struct metrics m; memset(&m, 0, sizeof(m));
+    unsigned long long hits = 0, misses = 0;
+    size_t queued = 0, nsessions = 0, nconns = 0, idle_bytes = 0, spares = 0;
+    for (int i = 0; i < worker_count; i++) {
+        struct worker *wk = &workers[i];
+        metrics_add(&m, wk->metrics);
+        hits += RELAXED_GET(*wk->pool_hits); misses += RELAXED_GET(*wk->pool_misses);
+        nconns += RELAXED_GET(*wk->conn_count);
+        spares += RELAXED_GET(*wk->target_pool_len);
+        for (int cls = 0; cls < POOL_CLASSES; cls++) idle_bytes += RELAXED_GET(wk->pool[cls].idle) * pool_class_size(cls);
+        pthread_mutex_lock(&wk->table_lock);
+        nsessions += RELAXED_GET(*wk->session_count);
+        for (size_t b = 0; b < SESSION_BUCKETS; b++)
+            for (struct session *s = wk->sessions[b]; s; s = s->next) queued += RELAXED_GET(s->queued);
+        pthread_mutex_unlock(&wk->table_lock);
+    }
+    tb_metric(&tb, "tunnel_requests_total", "counter", "SCGI requests received.");
+    tb_printf(&tb, "tunnel_requests_total %llu\n", m.requests);
+    tb_metric(&tb, "tunnel_replies_total", "counter", "Replies sent, by status class.");
+    tb_printf(&tb, "tunnel_replies_total{code=\"2xx\"} %llu\ntunnel_replies_total{code=\"4xx\"} %llu\n"
+              "tunnel_replies_total{code=\"5xx\"} %llu\n",
+              m.replies_2xx, m.replies_4xx, m.replies_5xx);
+    tb_metric(&tb, "tunnel_bytes_total", "counter", "Bytes forwarded to (up) and from (down) targets.");
+    tb_printf(&tb, "tunnel_bytes_total{dir=\"up\"} %llu\ntunnel_bytes_total{dir=\"down\"} %llu\n",
+              m.bytes_up, m.bytes_down);
+    tb_metric(&tb, "tunnel_empty_polls_total", "counter", "Drain requests answered with no data.");
+    tb_printf(&tb, "tunnel_empty_polls_total %llu\n", m.empty_polls);
+    tb_metric(&tb, "tunnel_target_connects_total", "counter", "Target connections opened.");
+    tb_printf(&tb, "tunnel_target_connects_total %llu\n", m.target_connects);
+    tb_metric(&tb, "tunnel_target_reconnects_total", "counter", "Target connections reopened for an existing session.");
+    tb_printf(&tb, "tunnel_target_reconnects_total %llu\n", m.reconnects);
+    tb_metric(&tb, "tunnel_target_pool_idle", "gauge", "Spare target connections waiting in the --target-pool.");
+    tb_printf(&tb, "tunnel_target_pool_idle %zu\n", spares);
+    tb_metric(&tb, "tunnel_target_pool_total", "counter", "Target connections wanted with --target-pool on, by whether a spare was ready.");
+    tb_printf(&tb, "tunnel_target_pool_total{result=\"hit\"} %llu\ntunnel_target_pool_total{result=\"miss\"} %llu\n",
+              m.target_pool_hits, m.target_pool_misses);
+    tb_metric(&tb, "tunnel_target_pool_dropped_total", "counter", "Spare target connections discarded because the target closed or refused them.");
+    tb_printf(&tb, "tunnel_target_pool_dropped_total %llu\n", m.target_pool_dropped);
+    tb_metric(&tb, "tunnel_deflate_bytes_total", "counter", "Compressed bodies in both directions, before (raw) and after (wire) deflate.");
+    tb_printf(&tb, "tunnel_deflate_bytes_total{stage=\"raw\"} %llu\ntunnel_deflate_bytes_total{stage=\"wire\"} %llu\n",
+              m.deflate_raw, m.deflate_wire);
+    tb_metric(&tb, "tunnel_deflate_bypassed_total", "counter", "Replies sent raw because deflate did not pay or was backed off.");
+    tb_printf(&tb, "tunnel_deflate_bypassed_total %llu\n", m.deflate_bypassed);
+    tb_metric(&tb, "tunnel_throttled_total", "counter", "Bodies refused with 429 because the session's write queue was full.");
+    tb_printf(&tb, "tunnel_throttled_total %llu\n", m.throttled);
+    tb_metric(&tb, "tunnel_replayed_bytes_total", "counter", "Reply bytes sent again because the frontend had not acknowledged them.");
+    tb_printf(&tb, "tunnel_replayed_bytes_total %llu\n", m.replayed_bytes);
+    tb_metric(&tb, "tunnel_duplicate_bytes_total", "counter", "Retried body bytes dropped because the session already had them.");
+    tb_printf(&tb, "tunnel_duplicate_bytes_total %llu\n", m.duplicate_bytes);
+    tb_metric(&tb, "tunnel_held_bodies_total", "counter", "Striped bodies held until the posts before them arrived.");
+    tb_printf(&tb, "tunnel_held_bodies_total %llu\n", m.held_bodies);
+    tb_metric(&tb, "tunnel_queued_bytes", "gauge", "Body bytes waiting for their target, all sessions.");
+    tb_printf(&tb, "tunnel_queued_bytes %zu\n", queued);
+    tb_metric(&tb, "tunnel_sessions", "gauge", "Sessions in the table.");
+    tb_printf(&tb, "tunnel_sessions %zu\n", nsessions);
+    tb_metric(&tb, "tunnel_connections", "gauge", "Open SCGI connections, including parked long-polls.");
+    tb_printf(&tb, "tunnel_connections %zu\n", nconns);
+    tb_metric(&tb, "tunnel_pool_hits_total", "counter", "Buffer and connection pool hits.");
+    tb_printf(&tb, "tunnel_pool_hits_total %llu\n", hits);
+    tb_metric(&tb, "tunnel_pool_misses_total", "counter", "Buffer and connection pool misses.");
+    tb_printf(&tb, "tunnel_pool_misses_total %llu\n", misses);
+    tb_metric(&tb, "tunnel_pool_idle_bytes", "gauge", "Memory held by idle pooled buffers.");
+    tb_printf(&tb, "tunnel_pool_idle_bytes %zu\n", idle_bytes);
+    tb_histogram(&tb, "tunnel_header_parse_seconds", "From accept to a complete SCGI header block.", &m.parse);
+    tb_histogram(&tb, "tunnel_target_write_seconds", "From queueing a body to its last byte reaching the target.", &m.write);
+    tb_histogram(&tb, "tunnel_drain_seconds", "Time spent reading what the target has.", &m.drain);
+    tb_metric(&tb, "tunnel_session_requests_total", "counter", "Requests per named session.");
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_lock(&workers[i].table_lock);
+        for (size_t b = 0; b < SESSION_BUCKETS; b++)
+            for (struct session *s = workers[i].sessions[b]; s; s = s->next)
+                if (s->id[0]) tb_printf(&tb, "tunnel_session_requests_total{session=\"%.8s\"} %llu\n", s->id, RELAXED_GET(s->requests));
+        pthread_mutex_unlock(&workers[i].table_lock);
+    }
+    tb_metric(&tb, "tunnel_session_bytes_total", "counter", "Bytes forwarded per named session.");
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_lock(&workers[i].table_lock);
+        for (size_t b = 0; b < SESSION_BUCKETS; b++)
+            for (struct session *s = workers[i].sessions[b]; s; s = s->next)
+                if (s->id[0]) tb_printf(&tb, "tunnel_session_bytes_total{session=\"%.8s\",dir=\"up\"} %llu\n"
+                                        "tunnel_session_bytes_total{session=\"%.8s\",dir=\"down\"} %llu\n",
+                                        s->id, RELAXED_GET(s->bytes_up), s->id, RELAXED_GET(s->bytes_down));
+        pthread_mutex_unlock(&workers[i].table_lock);
+    }
+    c->resp = tb.p; c->resp_cap = tb.cap; c->resp_len = tb.len;
+    RELAXED_ADD(metrics.replies_2xx, 1);
+    int hlen = reply_status(c, "200 OK");
+    hlen += snprintf(c->hdr + hlen, sizeof(c->hdr) - (size_t)hlen,
+                     "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", c->resp_len);
+    c->hdr_len = (size_t)hlen;
+    c->sent = 0;
+    c->state = CS_REPLY;
+    conn_write(c);
+}
+
+// Headers are complete: validate them and set up the body read.
+static void start_request(struct conn *c) {
+    struct scgi_req req;
+    int bad = 0;
+    if (c->http) bad = http_index(c->in, c->body_off, &req);
+    else scgi_index(c->in + c->ns_off, c->ns_len, &req);
+    if (!c->handed_off) {
+        RELAXED_ADD(metrics.requests, 1);
+        hist_observe(&metrics.parse, now_us() - c->t_start);
+    }
+    if (c->http) {
+        if (bad < 0) { reply_error(c, "400 Bad Request", "invalid request line"); return; }
+        if (req.transfer_encoding) { reply_error(c, "411 Length Required", "send the body with Content-Length"); return; }
+        c->keep_alive = strcmp(req.protocol, "HTTP/1.1") == 0 && !(req.connection && strcasestr(req.connection, "close"));
+        if (!req.content_length) req.content_length = "0";
+    } else if (!req.scgi || strcmp(req.scgi, "1") != 0 || !req.content_length) {
+        reply_error(c, "400 Bad Request", "missing SCGI or CONTENT_LENGTH");
+        return;
+    }
+    long body_len = strtol(req.content_length, NULL, 10);
+    if (body_len < 0 || body_len > (long)MAX_BODY) {
+        reply_error(c, "413 Payload Too Large", "body too large");
+        return;
+    }
+    size_t have = c->in_len - c->body_off;
+    if (have > (size_t)body_len) have = (size_t)body_len;
+    c->req_end = c->body_off + have;
+    if (metrics_enabled && req.path_info && strcmp(req.path_info, "/metrics") == 0) {
+        c->body_done = have == (size_t)body_len;
+        reply_metrics(c);
+        return;
+    }
+
+    // Resolve the tunnel session this request belongs to
+    const char *sid = req.session ? req.session : "";
+    if (sid[0] && !session_id_valid(sid)) {
+        reply_error(c, "400 Bad Request", "invalid session id");
+        return;
+    }
+    if (worker_count > 1) {
+        int owner = (int)((session_hash(sid) >> 16) % (uint32_t)worker_count);
+        if (owner != self->id) { c->handoff_to = owner; c->state = CS_HANDOFF; return; }
+    }
+    c->sess = get_session(sid);
+    if (!c->sess) {
+        reply_error(c, "503 Service Unavailable", "too many sessions");
+        return;
+    }
+    c->sess->conns++;
+    c->has_offset = req.offset != NULL;
+    c->has_ack = req.ack != NULL;
+    if (req.offset) c->offset = strtoull(req.offset, NULL, 10);
+    if (req.ack) c->ack = strtoull(req.ack, NULL, 10);
+    c->window = MAX_RESP;
+    if (req.window && strtoull(req.window, NULL, 10) < MAX_RESP) c->window = (size_t)strtoull(req.window, NULL, 10);
+    c->fresh = req.stripe != NULL;
+    if (c->sess->closed && !(c->has_ack && c->sess->replay_len > 0)) {
+        c->sess->finished = true;
+        reply_error(c, "410 Gone", "session closed");
+        return;
+    }
+    RELAXED_ADD(c->sess->requests, 1);
+    c->close_req = req.close != NULL;
+    if (req.wait) {
+        long w = strtol(req.wait, NULL, 10);
+        if (w > 0) c->wait_ms = (unsigned long)w < long_poll_max_ms ? (unsigned long)w : long_poll_max_ms;
+    }
+    if (req.dir && strcmp(req.dir, "up") == 0) {
+        c->upload_only = true;
+        c->wait_ms = 0;
+    } else if (req.dir && strcmp(req.dir, "stream") == 0) {
+        c->stream = true;
+    }
+    if (req.encoding && strcmp(req.encoding, "deflate") != 0) {
+        reply_error(c, "415 Unsupported Media Type", "unknown X-Tunnel-Encoding");
+        return;
+    }
+    c->body_deflated = req.encoding != NULL;
+    c->accept_deflate = req.accept_encoding && strstr(req.accept_encoding, "deflate");
+
+    // Body bytes that arrived together with the headers
+    c->body_len = (size_t)body_len;
+    if (c->http && req.expect && strcasecmp(req.expect, "100-continue") == 0 && have < c->body_len) {
+        // fits an empty send buffer; a partial interim reply would corrupt the stream
+        ssize_t w;
+        while ((w = send(c->w.fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+        if (w != 25) { conn_close(c); return; }
+    }
+    // a retried body that overlaps what the session has must be trimmed in memory
+    if (use_splice && !c->body_deflated && c->body_len >= SPLICE_MIN_BODY && have < c->body_len &&
+        (!c->has_offset || c->offset == c->sess->up_seq) && pipe_get(&c->pipe) == 0) {
+        c->splice_body = true;
+        c->body_got = have;
+        c->state = CS_BODY;
+        return;
+    }
+    if (c->body_len > 0) {
+        c->body = (char*)pool_get(c->body_len, &c->body_cap);
+        if (!c->body) { conn_close(c); return; }
+        memcpy(c->body, c->in + c->body_off, have);
+        c->body_got = have;
+    }
+    c->state = CS_BODY;
+}
+
+static void queue_body(struct conn *c);
+
+// The whole body is in memory: queue it for the target, or just drain.
+static void dispatch_body(struct conn *c) {
+    watch_set(&c->w, 0);
+    if (!c->splice_body) c->body_done = true;
+    if (c->body_deflated && c->body_len > 0) {
+        char *raw; size_t raw_len, raw_cap;
+        int r = inflate_body(c->body, c->body_len, &raw, &raw_len, &raw_cap);
+        if (r == -2) { reply_error(c, "413 Payload Too Large", "body too large"); return; }
+        if (r < 0) { reply_error(c, "400 Bad Request", "corrupt deflate body"); return; }
+        RELAXED_ADD(metrics.deflate_raw, raw_len); RELAXED_ADD(metrics.deflate_wire, c->body_len);
+        pool_put(c->body, c->body_cap);
+        c->body = raw; c->body_len = raw_len; c->body_cap = raw_cap;
+    }
+    queue_body(c);
+}
+
+// Bodies held for a gap that is now filled go next, in offset order.
+static void session_release_held(struct session *s) {
+    while (s->held && s->held->offset <= s->up_seq) {
+        struct conn *c = s->held;
+        s->held = c->wnext;
+        s->held_bytes -= c->body_len;
+        c->wnext = NULL;
+        c->state = CS_DRAIN;
+        queue_body(c);
+    }
+}
+
+// The gap will never fill: answer the held requests (410, or the replay).
+static void session_drop_held(struct session *s) {
+    while (s->held) {
+        struct conn *c = s->held;
+        s->held = c->wnext;
+        s->held_bytes -= c->body_len;
+        c->wnext = NULL;
+        finish_request(c, false);
+    }
+}
+
+// Hand an inflated body to the session: hold it until the stream reaches its
+// offset, trim what the session already took, and queue the rest.
+static void queue_body(struct conn *c) {
+    struct session *s = c->sess;
+    if (c->has_offset && c->body_len > 0 && !c->splice_body && c->offset > s->up_seq && !s->closed) {
+        // a striped post overtook an earlier one
+        if (s->held_bytes + c->body_len > queue_max) {
+            RELAXED_ADD(metrics.throttled, 1);
+            reply_error(c, "429 Too Many Requests", "too much held ahead of a gap");
+            return;
+        }
+        struct conn **pp = &s->held;
+        while (*pp && (*pp)->offset <= c->offset) pp = &(*pp)->wnext;
+        c->wnext = *pp;
+        *pp = c;
+        s->held_bytes += c->body_len;
+        c->state = CS_HELD;
+        RELAXED_ADD(metrics.held_bodies, 1);
+        watch_set(&c->w, EPOLLRDHUP);       // notice the client giving up
+        timer_set(c, now_ms() + CONN_IDLE_MS);
+        return;
+    }
+    if (c->has_offset && c->body_len > 0) {
+        // the spliced body cannot be trimmed: it had to line up when it started
+        if (c->splice_body ? c->offset != s->up_seq : upstream_dedup(s, c->body, &c->body_len, c->offset) < 0) {
+            reply_error(c, "409 Conflict", "body offset past the upstream stream");
+            return;
+        }
+    }
+    // the target is gone: the body has nowhere to go, but unacknowledged replies do
+    if (c->body_len == 0 || s->closed) { finish_request(c, true); return; }
+    if (s->wq_head && s->queued + c->body_len > queue_max) {
+        // the target is not keeping up: make the frontend slow down
+        RELAXED_ADD(metrics.throttled, 1);
+        char queue_hdr[48];
+        snprintf(queue_hdr, sizeof(queue_hdr), "X-Tunnel-Queue: %zu\r\n", s->queued);
+        reply_error_hdrs(c, "429 Too Many Requests", queue_hdr, "write queue full");
+        return;
+    }
+    c->state = CS_TARGET;
+    c->t_start = now_us();
+    if (s->wq_tail) s->wq_tail->wnext = c; else s->wq_head = c;
+    s->wq_tail = c;
+    RELAXED_ADD(s->queued, c->body_len);
+    s->up_seq += c->body_len;
+    session_release_held(s);
+    if (s->wq_head == c) session_pump(s);
+    if (c->state == CS_TARGET && c->upload_only && !c->splice_body) reply_queued(c);
+}
+
+// Pass a conn whose session lives on another worker to that worker's pipe.
+// It carries everything read so far; from here on only the owner touches it.
+static void handoff(struct conn *c) {
+    timer_del(c);
+    watch_set(&c->w, 0);
+    uring_buf_forget(c->in);    // registered with this worker's ring only
+    uring_buf_forget(c->resp);
+    if (write(workers[c->handoff_to].handoff_wr, &c, sizeof(c)) == (ssize_t)sizeof(c)) return;
+    // the owner's pipe is full: it is far behind, so shed the request here
+    if (watch_set(&c->w, EPOLLIN) < 0 || timer_set(c, now_ms() + CONN_IDLE_MS) < 0) { conn_close(c); return; }
+    reply_error(c, "503 Service Unavailable", "worker busy");
+}
+
+// Make room for `need` bytes of request head in c->in.
+static int in_grow(struct conn *c, size_t need) {
+    if (need <= c->in_cap) return 0;
+    size_t ncap;
+    char *nin = (char*)pool_get(need, &ncap);
+    if (!nin) return -1;
+    memcpy(nin, c->in, c->in_len);
+    pool_put(c->in, c->in_cap);
+    c->in = nin; c->in_cap = ncap;
+    return 0;
+}
+
+// Look for a complete request head in c->in and start the request once it
+// is there. Returns false when the conn has moved on (answered, handed off
+// or closed) and the caller must leave it alone.
+static bool conn_parse_head(struct conn *c) {
+    if (c->http) {
+        char *end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+        if (!end) {
+            if (c->in_len < c->in_cap) return true;
+            if (c->in_cap < MAX_HDRS && in_grow(c, c->in_cap + 1) == 0) return true;
+            reply_error(c, "431 Request Header Fields Too Large", "request head too large");
+            return false;
+        }
+        c->body_off = (size_t)(end - c->in) + 4;
+    } else {
+        if (c->state == CS_NETSTRING) {
+            int p = parse_netstring_len(c->in, c->in_len, &c->ns_off, &c->ns_len);
+            if (p < 0) { reply_error(c, "400 Bad Request", "invalid SCGI netstring"); return false; }
+            if (p == 0) return true;
+            if (in_grow(c, c->ns_off + c->ns_len + 1) < 0) { conn_close(c); return false; }
+            c->state = CS_HEADERS;
+        }
+        if (c->in_len < c->ns_off + c->ns_len + 1) return true;
+        if (c->in[c->ns_off + c->ns_len] != ',') {
+            reply_error(c, "400 Bad Request", "invalid SCGI netstring");
+            return false;
+        }
+        c->in[c->ns_off + c->ns_len] = 0;
+        c->body_off = c->ns_off + c->ns_len + 1;
+    }
+    start_request(c);
+    if (c->state == CS_HANDOFF) { handoff(c); return false; }
+    return c->state == CS_BODY;
+}
+
+static bool conn_read_buf(struct watch *w, char **dst, size_t *room) {
+    struct conn *c = (struct conn*)w;
+    if (w->kind != W_CLIENT) return false;
+    if (c->state == CS_BODY && !c->splice_body) {
+        *dst = c->body + c->body_got; *room = c->body_len - c->body_got;
+        return *room > 0;
+    }
+    if (c->state != CS_NETSTRING && c->state != CS_HEADERS) return false;
+    *dst = c->in + c->in_len; *room = c->in_cap - c->in_len;
+    return true;
+}
+
+// Take in n bytes read from the client; 0 means it hung up. Returns false
+// when the conn has moved on and the caller must leave it alone.
+static bool conn_got(struct conn *c, size_t n) {
+    if (n == 0) {
+        if (c->state == CS_BODY) reply_error(c, "400 Bad Request", "short body");
+        else if (c->in_len == 0) conn_close(c);
+        else reply_error(c, "400 Bad Request", c->http ? "truncated request head" : "invalid SCGI netstring");
+        return false;
+    }
+    timer_set(c, now_ms() + CONN_IDLE_MS);
+    if (c->state == CS_BODY) { c->body_got += n; return true; }
+    if (c->in_len == 0 && c->t_start == 0) c->t_start = now_us();
+    c->in_len += n;
+    return conn_parse_head(c);
+}
+
+// On an io_uring worker the reads are the READs uring_flush() posts for
+// an EPOLLIN watch; conn_read() only dispatches a complete body.
+static void conn_read(struct conn *c) {
+    for (;;) {
+        char *dst = NULL; size_t room = 0;
+        if (c->state == CS_BODY && (c->body_got == c->body_len || c->splice_body)) { dispatch_body(c); return; }
+        if (ring_fd >= 0) { watch_set(&c->w, EPOLLIN); return; }
+        conn_read_buf(&c->w, &dst, &room);
+        ssize_t r = recv(c->w.fd, dst, room, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            conn_close(c);
+            return;
+        }
+        if (!conn_got(c, (size_t)r)) return;
+    }
+}
+
+// An HTTP request is answered: keep the connection for the next one, along
+// with any bytes of it that came in early.
+static void conn_reuse(struct conn *c) {
+    if (c->sess) session_release(c->sess);
+    pipe_put(&c->pipe, c->pipe_len);
+    pool_put(c->body, c->body_cap);
+    size_t left = c->in_len - c->req_end;
+    memmove(c->in, c->in + c->req_end, left);
+    struct conn keep = *c;
+    memset(c, 0, sizeof(*c));
+    c->w = keep.w;
+    c->in = keep.in; c->in_cap = keep.in_cap; c->in_len = left;
+    c->resp = keep.resp; c->resp_cap = keep.resp_cap;
+    c->deadline = keep.deadline; c->timer_idx = keep.timer_idx;
+    c->pipe.rd = c->pipe.wr = -1;
+    c->http = true;
+    c->state = CS_HEADERS;
+    if (watch_set(&c->w, EPOLLIN) < 0 || timer_set(c, now_ms() + CONN_IDLE_MS) < 0) { conn_close(c); return; }
+    if (left == 0) return;
+    c->t_start = now_us();
+    if (conn_parse_head(c)) conn_read(c);   // pipelined
+}
+
+// io_uring: queue what is left of the reply, the headers linked to the body
+// so they go out in order. Returns 1 once all of it is out, 0 while a write
+// is in flight (reply_sent() carries on) and -1 when the client failed.
+static int reply_send(struct conn *c) {
+    if (uring_busy(&c->w, URING_SEND)) return 0;
+    if (c->send_err) { c->send_err = 0; return -1; }
+    if (c->sent >= c->hdr_len + c->resp_len) return 1;
+    size_t body_off = c->sent > c->hdr_len ? c->sent - c->hdr_len : 0;
+    if (c->sent < c->hdr_len &&
+        !uring_write(&c->w, URING_SEND, c->w.fd, c->hdr + c->sent, c->hdr_len - c->sent, c->resp_len > 0)) return -1;
+    if (body_off < c->resp_len &&
+        !uring_write(&c->w, URING_SEND, c->w.fd, c->resp + body_off, c->resp_len - body_off, false)) return -1;
+    timer_set(c, now_ms() + CONN_IDLE_MS);
+    return 0;
+}
+
+static void conn_write(struct conn *c) {
+    if (ring_fd >= 0) {
+        int r = reply_send(c);
+        if (r == 0) { watch_set(&c->w, 0); return; }
+        if (r < 0) c->keep_alive = false;
+    }
+    while (c->sent < c->hdr_len + c->resp_len) {
+        ssize_t w = send_reply(c, c->pipe_len ? MSG_MORE : 0);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch_set(&c->w, EPOLLOUT);
+                timer_set(c, now_ms() + CONN_IDLE_MS);
+                return;
+            }
+            c->keep_alive = false;
+            break;
+        }
+        c->sent += (size_t)w;
+    }
+    while (c->pipe_len > 0) {
+        ssize_t w = splice(c->pipe.rd, NULL, c->w.fd, NULL, c->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch_set(&c->w, EPOLLOUT);
+                timer_set(c, now_ms() + CONN_IDLE_MS);
+                return;
+            }
+            c->keep_alive = false;
+            break;
+        }
+        c->pipe_len -= (size_t)w;
+    }
+    if (c->state == CS_TARGET) {
+        // replied early: drop the client, keep the body queued; a stalled
+        // target holds it (and the session's later posts get 429)
+        timer_del(c);
+        watch_close(&c->w);
+        c->detached = true;
+        return;
+    }
+    if (c->keep_alive) { conn_reuse(c); return; }
+    conn_close(c);  // one request per SCGI connection
+}
+
+static void on_client_event(struct conn *c, uint32_t events) {
+    if (events & EPOLLERR) { conn_close(c); return; }
+    switch (c->state) {
+    case CS_NETSTRING: case CS_HEADERS: case CS_BODY:
+        conn_read(c); break;
+    case CS_REPLY:
+        conn_write(c); break;
+    case CS_STREAM:
+        if (events & (EPOLLHUP | EPOLLRDHUP)) conn_close(c);
+        else stream_pump(c);
+        break;
+    case CS_TARGET:
+        if (c->hdr_len > 0) { conn_write(c); break; }  // early reply
+        if (c->splice_body && c->sess->wq_head == c) { session_pump(c->sess); break; }
+        if (events & (EPOLLHUP | EPOLLRDHUP)) conn_close(c);
+        break;
+    default:
+        if (events & (EPOLLHUP | EPOLLRDHUP)) conn_close(c);
+        break;
+    }
+}
+
+static void on_target_event(struct session *s, uint32_t events) {
+    // a failed socket shows up as a send or recv error
+    if (s->wq_head && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) session_pump(s);
+    if (s->stream && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && stream_wants_data(s->stream))
+        stream_pump(s->stream);
+    if (s->waiters && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) session_wake_waiters(s);
+}
+
+// io_uring completions for the reads and writes a conn started.
+
+static void conn_read_done(struct conn *c, int res) {
+    if (c->w.fd < 0 || res == -ECANCELED || !keep_running) return;
+    if (res < 0) { conn_close(c); return; }
+    if (conn_got(c, (size_t)res)) conn_read(c);
+}
+
+// last: no other part of the reply is in flight.
+static void reply_sent(struct conn *c, int res, bool last) {
+    if (res > 0) c->sent += (size_t)res;
+    else if (res != -ECANCELED) c->send_err = res < 0 ? -res : EPIPE;    // the body behind failed headers is cancelled
+    if (!last || c->w.fd < 0 || !keep_running) return;
+    if (c->state == CS_STREAM) stream_pump(c);
+    else conn_write(c);
+}
+
+// The next conn waiting to drain the target takes its turn.
+static void drain_next(struct session *s) {
+    while (!s->rx && s->rxq) {
+        struct conn *c = s->rxq;
+        s->rxq = c->wnext;
+        c->wnext = NULL;
+        c->rx_queued = false;
+        if (c->state == CS_STREAM) stream_pump(c);
+        else finish_request(c, c->rx_may_wait);
+    }
+    session_update_watch(s);
+}
+
+// c's write to or drain of the target completed. The session's side (the
+// bytes, a target that hung up) is settled even when c has gone.
+static void target_done(struct conn *c, int res) {
+    struct session *s = c->io_sess;
+    bool live = (c->w.fd >= 0 || c->detached) && keep_running;
+    c->io_sess = NULL;
+    if (s->tx == c) {
+        s->tx = NULL;
+        if (res > 0) {
+            c->body_sent += (size_t)res;
+            RELAXED_ADD(s->bytes_up, (size_t)res); RELAXED_ADD(metrics.bytes_up, (size_t)res);
+        } else {
+            s->tx_err = res < 0 ? -res : EPIPE;
+        }
+        if (keep_running) { session_pump(s); session_settle(s); }
+        return;
+    }
+    s->rx = NULL;
+    size_t got = res > 0 ? (size_t)res : 0;
+    RELAXED_ADD(s->bytes_down, got); RELAXED_ADD(metrics.bytes_down, got);
+    hist_observe(&metrics.drain, now_us() - s->rx_start);
+    bool stream = c->state == CS_STREAM;
+    if (!stream && conn_replays(c)) s->replay_len += got;
+    if (!keep_running) return;
+    if (res == 0 || (res < 0 && res != -EAGAIN && res != -EINTR && res != -ECANCELED)) {
+        stream_draining = stream;   // an error counts as a close, as in drain_target()
+        target_gone(s);
+        stream_draining = false;
+    }
+    if (!live) {
+        // the bytes stay in the replay buffer for the next poll
+    } else if (stream) {
+        if (got > 0) { c->resp_len = got; stream_pump(c); }
+        else stream_idle(c, 0);
+    } else if (conn_replays(c)) {
+        size_t from, end = replay_end(s, c->fresh, c->window, &from);
+        reply_replay(c, replay_take(s, c->fresh, from, end), from, false);
+    } else {
+        c->resp_len = got;
+        reply_drained(c, (ssize_t)got, 0, got == c->window, c->rx_may_wait);
+    }
+    drain_next(s);
+    session_settle(s);
+}
 
-    close_target();
-    close(srv);
+static void uring_done(struct watch *w, unsigned kind, int res, bool last) {
+    struct conn *c = (struct conn*)w;     // only client conns start reads and writes
+    if (kind == URING_READ) conn_read_done(c, res);
+    else if (kind == URING_SEND) reply_sent(c, res, last);
+    else target_done(c, res);
+}
+
+static void conn_open(int fd, bool http) {
+    struct conn *c = conn_new();
+    size_t in_cap = 0;
+    char *in = (char*)pool_get(IN_BUF_INIT, &in_cap);
+    if (!c || !in) { free(c); pool_put(in, in_cap); close(fd); return; }
+    c->w.kind = W_CLIENT; c->w.fd = fd;
+    c->in = in; c->in_cap = in_cap;
+    c->timer_idx = SIZE_MAX;
+    c->t_start = now_us();
+    c->pipe.rd = c->pipe.wr = -1;
+    c->http = http;
+    c->state = http ? CS_HEADERS : CS_NETSTRING;
+    if (watch_set(&c->w, EPOLLIN) < 0 || timer_set(c, now_ms() + CONN_IDLE_MS) < 0) {
+        watch_set(&c->w, 0); close(fd); pool_put(in, in_cap); free(c);
+    }
+}
+
+static void accept_clients(int srv, bool http) {
+    for (;;) {
+        int fd = accept4(srv, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        conn_open(fd, http);
+    }
+}
+
+// Conns handed over by other workers resume where start_request() left off.
+// A NULL pointer is only a wake-up, to look at keep_running and dump_gen.
+static void accept_handoffs(int fd) {
+    struct conn *batch[64];
+    for (;;) {
+        ssize_t r = read(fd, batch, sizeof(batch));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return;
+        for (size_t i = 0; i < (size_t)r / sizeof(batch[0]); i++) {
+            struct conn *c = batch[i];
+            if (!c) continue;
+            c->handed_off = true;
+            if (watch_set(&c->w, EPOLLIN) < 0 || timer_set(c, now_ms() + CONN_IDLE_MS) < 0) { conn_close(c); continue; }
+            start_request(c);
+            if (c->state == CS_BODY) conn_read(c);
+        }
+    }
+}
+
+static void wake_workers(void) {
+    struct conn *none = NULL;
+    for (int i = 0; i < worker_count; i++)
+        if (i != self->id && write(workers[i].handoff_wr, &none, sizeof(none)) < 0) { /* already awake */ }
+}
+
+// A parked long-poll that reaches its deadline answers with whatever is
+// there (usually nothing); an idle stream ends; anything else has stalled
+// and is dropped.
+static void run_timers(void) {
+    uint64_t now = now_ms();
+    while (timer_count > 0 && timers[0]->deadline <= now) {
+        struct conn *c = timers[0];
+        if (c->state == CS_WAIT) {
+            session_unqueue(c);
+            timer_set(c, now + CONN_IDLE_MS);
+            finish_request(c, false);
+        } else {
+            conn_close(c);
+        }
+    }
+}
+
+static int next_timeout(void) {
+    if (timer_count == 0) return -1;
+    uint64_t now = now_ms();
+    if (timers[0]->deadline <= now) return 0;
+    uint64_t d = timers[0]->deadline - now;
+    return d > 1000 ? 1000 : (int)d;
+}
+
+static void dispatch(struct watch *w, uint32_t events) {
+    if (w->fd < 0) return;      // closed earlier in this batch
+    switch (w->kind) {
+    case W_LISTENER: accept_clients(w->fd, false); break;
+    case W_HTTP_LISTENER: accept_clients(w->fd, true); break;
+    case W_CLIENT: on_client_event((struct conn*)w, events); break;
+    case W_TARGET: on_target_event((struct session*)w, events); break;
+    case W_HANDOFF: accept_handoffs(w->fd); break;
+    }
+}
+
+// Handles every completion the kernel has posted.
+static void uring_reap(void) {
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        uint64_t tag = cqe->user_data;
+        int res = cqe->res;
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+        uint32_t idx = (uint32_t)tag & 0xffffff;
+        unsigned kind = (unsigned)(tag >> 24) & 0xff;
+        if (!idx || idx >= ring.nslots) continue;   // a cancel or a close
+        struct uring_slot *sl = &ring.slots[idx];
+        struct watch *w = sl->w;
+        if (kind != URING_POLL) {
+            // a read or write: its slot was held until now
+            bool last = --sl->ops[kind] == 0;
+            ring.inflight--;
+            if (kind == URING_READ) uring_mark(idx);   // posted again while wanted
+            uring_done(w, kind, res, last);
+            if (w->slot) uring_slot_put(w);
+            continue;
+        }
+        if (!w || sl->gen != (uint32_t)(tag >> 32) || !keep_running) continue;     // stale
+        if (!more) { sl->armed = 0; uring_mark(idx); }             // re-armed before the next wait
+        if (w->kind == W_LISTENER || w->kind == W_HTTP_LISTENER) {
+            if (res >= 0) conn_open(res, w->kind == W_HTTP_LISTENER);
+            else if (res != -EAGAIN && res != -EINTR) { errno = -res; perror("accept"); }
+            continue;
+        }
+        dispatch(w, res < 0 ? EPOLLERR : (uint32_t)res);
+    }
+}
+
+// The io_uring counterpart of epoll_wait() and the dispatch loop: submits
+// what the last batch queued, waits, and handles every completion.
+static int uring_run(int timeout_ms) {
+    uring_flush();
+    bool ready = *ring.cq_head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    if (uring_enter(!ready && timeout_ms != 0, timeout_ms) < 0) return -1;
+    uring_reap();
     return 0;
 }
+
+// At shutdown: cancel everything and wait for the reads and writes, whose
+// buffers are the kernel's until they complete.
+static void uring_quiesce(void) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    }
+    for (int i = 0; i < 50 && ring.inflight > 0; i++) {
+        if (uring_enter(true, 100) < 0 && errno != EINTR) break;
+        uring_reap();
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <scgi_listen_port> <target_local_port>\n"
+            "  --long-poll-max MS   longest X-Tunnel-Wait honoured (default 30000, 0 disables)\n"
+            "  --no-splice          copy bodies through user space instead of splice()\n"
+            "  --queue-max BYTES    per-session write queue bound before 429 (default 4194304)\n"
+            "  --replay-max BYTES   per-session unacknowledged reply bytes kept for resending (default 1048576)\n"
+            "  --workers N          event loops on N threads, sessions sharded by id (default 1)\n"
+            "  --http PORT          also serve the tunnel as plain HTTP/1.1 with keep-alive on PORT\n"
+            "  --target-pool N      keep N spare target connections per worker for new sessions (default 0, max 64)\n"
+            "  --io-uring           do the socket I/O on io_uring instead of epoll (falls back to epoll)\n"
+            "  --metrics            serve Prometheus metrics at PATH_INFO /metrics\n",
+            prog);
+}
+
+static pthread_barrier_t workers_ready;
+
+static int open_listener(int port) {
+    int srv = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv < 0) { perror("socket"); return -1; }
+    int one = 1;
+    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // one listener per worker; the kernel spreads new connections over them
+    if (worker_count > 1 && setsockopt(srv, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT"); close(srv); return -1;
+    }
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(srv); return -1; }
+    if (listen(srv, 64) < 0) { perror("listen"); close(srv); return -1; }
+    return srv;
+}
+
+// One event loop. Worker 0 runs on the main thread, which is the only one
+// that takes signals; it passes shutdown and SIGUSR1 on to the others.
+static void *worker_run(void *arg) {
+    struct worker *wk = (struct worker*)arg;
+    self = wk;
+    wk->metrics = &metrics;
+    wk->sessions = sessions;
+    wk->session_count = &session_count;
+    wk->conn_count = &conns_open;
+    wk->target_pool_len = &target_pool_len;
+    wk->pool = pool;
+    wk->pool_hits = &pool_hits; wk->pool_misses = &pool_misses;
+    struct watch listener = { W_LISTENER, wk->listen_fd, 0, 0 }, http_listener = { W_HTTP_LISTENER, wk->http_fd, 0, 0 };
+    bool ok = use_uring ? uring_setup() == 0 : (epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0;
+    if (!ok || watch_set(&listener, EPOLLIN) < 0 || watch_set(&http_listener, EPOLLIN) < 0 ||
+        watch_set(&wk->handoff, EPOLLIN) < 0) {
+        perror(use_uring ? "io_uring" : "epoll");
+        keep_running = 0;
+    }
+    pthread_barrier_wait(&workers_ready);   // every worker's state is reachable now
+
+    char label[32] = "pool";
+    if (worker_count > 1) snprintf(label, sizeof(label), "worker %d pool", wk->id);
+    int seen_gen = dump_gen;
+    struct epoll_event evs[MAX_EVENTS];
+    while (keep_running) {
+        target_pool_refill();
+        int n = use_uring ? uring_run(next_timeout()) : epoll_wait(epfd, evs, MAX_EVENTS, next_timeout());
+        if (n < 0) {
+            if (errno != EINTR) { perror(use_uring ? "io_uring_enter" : "epoll_wait"); keep_running = 0; break; }
+            n = 0;  // a signal: fall through to the housekeeping below
+        }
+        for (int i = 0; i < n; i++) dispatch((struct watch*)evs[i].data.ptr, evs[i].events);
+        run_timers();
+        free_dead_conns();
+        free_dead_sessions();
+        expire_sessions(time(NULL));
+        target_pool_sweep(time(NULL));
+        if (dump_gen != seen_gen) {
+            seen_gen = dump_gen;
+            if (wk->id == 0) wake_workers();
+            pool_log_stats(label);
+            if (target_pool_size)
+                fprintf(stderr, "%s: target spares=%zu hits=%llu misses=%llu dropped=%llu\n", label, target_pool_len,
+                        metrics.target_pool_hits, metrics.target_pool_misses, metrics.target_pool_dropped);
+        }
+    }
+    if (wk->id == 0) wake_workers();        // let the others see keep_running == 0
+    pthread_barrier_wait(&workers_ready);   // no /metrics reads another worker's state past here
+
+    while (timer_count > 0) conn_close(timers[0]);
+    if (ring_fd >= 0) uring_quiesce();
+    free_dead_conns();
+    free(timers);
+    free_all_sessions();
+    free_pipe_pool();
+    target_pool_release();
+    while (conn_pool_len > 0) free(conn_pool[--conn_pool_len]);
+    pool_log_stats(label);
+    pool_release();
+    if (epfd >= 0) close(epfd);
+    uring_release();
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "long-poll-max", required_argument, NULL, 'l' },
+        { "no-splice", no_argument, NULL, 'S' },
+        { "metrics", no_argument, NULL, 'M' },
+        { "queue-max", required_argument, NULL, 'q' },
+        { "replay-max", required_argument, NULL, 'r' },
+        { "workers", required_argument, NULL, 'w' },
+        { "http", required_argument, NULL, 'H' },
+        { "target-pool", required_argument, NULL, 'P' },
+        { "io-uring", no_argument, NULL, 'U' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt, http_port = 0;
+    while ((opt = getopt_long(argc, argv, "l:", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'l': long_poll_max_ms = strtoul(optarg, NULL, 10); break;
+        case 'S': use_splice = false; break;
+        case 'M': metrics_enabled = true; break;
+        case 'q': queue_max = strtoul(optarg, NULL, 10); break;
+        case 'r': replay_max = strtoul(optarg, NULL, 10); break;
+        case 'w': worker_count = atoi(optarg); break;
+        case 'H': http_port = atoi(optarg); break;
+        case 'P': target_pool_size = strtoul(optarg, NULL, 10); break;
+        case 'U': use_uring = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2 || worker_count < 1 || worker_count > MAX_WORKERS || replay_max == 0 || replay_max > MAX_RESP ||
+        target_pool_size > TARGET_POOL_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+    int scgi_port = atoi(argv[optind]);
+    if (http_port < 0 || http_port > 65535) { fprintf(stderr, "invalid port\n"); return 1; }
+    int target_port = atoi(argv[optind + 1]);
+    if (scgi_port <= 0 || scgi_port > 65535 || target_port <= 0 || target_port > 65535) {
+        fprintf(stderr, "invalid port\n");
+        return 1;
+    }
+    target_port_g = (uint16_t)target_port;
+    hist_init();
+    if (use_uring) {
+        // a kernel or sandbox without io_uring gets the epoll engine
+        if (uring_setup() < 0) {
+            fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+            use_uring = false;
+        }
+        uring_release();
+    }
+    if (use_uring) use_splice = false;      // ring splices would run on io-wq threads
+
+    signal(SIGINT, on_sigint);
+    signal(SIGTERM, on_sigint);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, on_sigusr1);
+    if (use_splice) devnull_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    int started = 0, rc = 1;
+    for (int i = 0; i < worker_count; i++) {
+        struct worker *wk = &workers[i];
+        int p[2];
+        wk->id = i;
+        wk->listen_fd = open_listener(scgi_port);
+        if (wk->listen_fd < 0) goto out;
+        wk->http_fd = http_port ? open_listener(http_port) : -1;
+        if (http_port && wk->http_fd < 0) { close(wk->listen_fd); goto out; }
+        if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe2"); close(wk->listen_fd); if (wk->http_fd >= 0) close(wk->http_fd); goto out;
+        }
+        wk->handoff = (struct watch){ W_HANDOFF, p[0], 0, 0 };
+        wk->handoff_wr = p[1];
+        pthread_mutex_init(&wk->table_lock, NULL);
+        started++;
+    }
+    fprintf(stderr, "SCGI tunnel listening on 127.0.0.1:%d → localhost:%d (per-session persistent targets, %d worker%s)\n",
+            scgi_port, target_port, worker_count, worker_count > 1 ? "s" : "");
+    if (http_port) fprintf(stderr, "HTTP/1.1 tunnel listening on 127.0.0.1:%d\n", http_port);
+    if (use_uring) fprintf(stderr, "waiting for events with io_uring\n");
+
+    // signals stay with the main thread
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT); sigaddset(&block, SIGTERM); sigaddset(&block, SIGUSR1);
+    pthread_barrier_init(&workers_ready, NULL, (unsigned)worker_count);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (int i = 1; i < worker_count; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        if (err) { fprintf(stderr, "pthread_create: %s\n", strerror(err)); exit(1); }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    worker_run(&workers[0]);
+    for (int i = 1; i < worker_count; i++) pthread_join(workers[i].thread, NULL);
+    pthread_barrier_destroy(&workers_ready);
+    rc = 0;
+out:
+    for (int i = 0; i < started; i++) {
+        close(workers[i].listen_fd);
+        if (workers[i].http_fd >= 0) close(workers[i].http_fd);
+        close(workers[i].handoff.fd);
+        close(workers[i].handoff_wr);
+        pthread_mutex_destroy(&workers[i].table_lock);
+    }
+    if (devnull_fd >= 0) close(devnull_fd);
+    return rc;
+}
@@ -1,82 +1,1289 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <strings.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <curl/curl.h>
+#include <zlib.h>
 
 #define BUF_SIZE 65536
+#define OUT_RING 131072         // response bytes held back while the local side is slow
+#define MAX_EVENTS 64
+#define RTT_SHIFT 3             // smoothed RTT gain (1/8) and window fraction of it
+#define THROTTLE_MIN_MS 10      // first retry after a 429 from the backend
+#define THROTTLE_MAX_MS 1000    // ceiling while the 429s keep coming
+#define RETRY_MIN_MS 100        // first retry of a failed exchange
+#define RETRY_MAX_MS 5000       // ceiling while the failures keep coming
+#define ZMIN 512                // smaller posts are not worth compressing
+#define ZLEVEL Z_BEST_SPEED
+#define ZSKIP_MAX 64            // longest run of posts sent raw untried
+#define MAX_STRIPES 8           // most requests per direction a tunnel runs at once
 
-static ssize_t write_all(int fd, const void *buf, size_t n) {
-    size_t off = 0; const unsigned char *p = buf;
-    while (off < n) {
-        ssize_t w = write(fd, p + off, n - off);
-        if (w < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+static volatile sig_atomic_t keep_running = 1;
+static void on_sigint(int sig){ (void)sig; keep_running = 0; }
+static volatile sig_atomic_t dump_stats = 0;
+static void on_sigusr1(int sig){ (void)sig; dump_stats = 1; }
+
+static uint64_t now_ms(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// === Event loop plumbing ===
+// Every fd registered with epoll is described by a struct watch embedded as
+// the first member of its owner: the listener, a local connection, or a
+// socket libcurl asked us to monitor.
+enum watch_kind { W_LISTENER, W_LOCAL, W_CURL };
+
+struct watch {
+    enum watch_kind kind;
+    int fd;
+    uint32_t events;                // currently registered epoll mask
+};
+
+static int epfd = -1;
+
+// Register interest in events (0 removes the fd from epoll).
+static int watch_set(struct watch *w, uint32_t events) {
+    if (w->fd < 0 || events == w->events) return 0;
+    struct epoll_event ev; memset(&ev, 0, sizeof(ev));
+    ev.events = events; ev.data.ptr = w;
+    int op = !w->events ? EPOLL_CTL_ADD : (events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    if (epoll_ctl(epfd, op, w->fd, &ev) < 0) return -1;
+    w->events = events;
+    return 0;
+}
+
+// Session identifiers tie every request of one local connection to its own
+// target connection on the backend.
+static void make_session_id(char *out, size_t n) {
+    unsigned char rnd[16];
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, rnd, sizeof(rnd)) != (ssize_t)sizeof(rnd)) {
+        struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+        srand((unsigned)(ts.tv_nsec ^ ts.tv_sec ^ getpid()));
+        for (size_t i = 0; i < sizeof(rnd); i++) rnd[i] = (unsigned char)rand();
+    }
+    if (fd >= 0) close(fd);
+    size_t o = 0;
+    for (size_t i = 0; i < sizeof(rnd) && o + 2 < n; i++)
+        o += (size_t)snprintf(out + o, n - o, "%02x", rnd[i]);
+}
+
+// Tunnel control headers seen in a response
+struct exchange_info {
+    int closed;             // X-Tunnel-Closed: the target hung up
+    long wait_granted;      // X-Tunnel-Wait: the backend long-polled for this long
+    int stream;             // X-Tunnel-Stream: the reply is an open-ended stream
+    int deflate;            // X-Tunnel-Encoding: deflate: the body is compressed
+    int more;               // X-Tunnel-More: the reply stopped at the backend's cap
+    int has_offset;         // X-Tunnel-Offset: where the body starts downstream
+    unsigned long long offset;
+    int has_window;         // X-Tunnel-Window: room left in the session's write queue
+    size_t window;
+};
+
+static size_t curl_header_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t total = size * nmemb;
+    struct exchange_info *info = userdata;
+    static const char closed[] = "X-Tunnel-Closed:";
+    static const char wait[] = "X-Tunnel-Wait:";
+    static const char stream[] = "X-Tunnel-Stream:";
+    static const char enc[] = "X-Tunnel-Encoding:";
+    static const char more[] = "X-Tunnel-More:";
+    static const char offset[] = "X-Tunnel-Offset:";
+    static const char window[] = "X-Tunnel-Window:";
+    if (total >= sizeof(closed) - 1 && strncasecmp(ptr, closed, sizeof(closed) - 1) == 0)
+        info->closed = 1;
+    else if (total >= sizeof(wait) - 1 && strncasecmp(ptr, wait, sizeof(wait) - 1) == 0)
+        info->wait_granted = strtol(ptr + sizeof(wait) - 1, NULL, 10);
+    else if (total >= sizeof(stream) - 1 && strncasecmp(ptr, stream, sizeof(stream) - 1) == 0)
+        info->stream = 1;
+    else if (total >= sizeof(enc) - 1 && strncasecmp(ptr, enc, sizeof(enc) - 1) == 0)
+        info->deflate = memmem(ptr, total, "deflate", 7) != NULL;
+    else if (total >= sizeof(more) - 1 && strncasecmp(ptr, more, sizeof(more) - 1) == 0)
+        info->more = 1;
+    else if (total >= sizeof(offset) - 1 && strncasecmp(ptr, offset, sizeof(offset) - 1) == 0) {
+        info->has_offset = 1;
+        info->offset = strtoull(ptr + sizeof(offset) - 1, NULL, 10);
+    } else if (total >= sizeof(window) - 1 && strncasecmp(ptr, window, sizeof(window) - 1) == 0) {
+        info->has_window = 1;
+        info->window = (size_t)strtoull(ptr + sizeof(window) - 1, NULL, 10);
+    }
+    return total;
+}
+
+// === Compression ===
+// With --compress, posts of ZMIN bytes or more go up deflated (zlib format,
+// X-Tunnel-Encoding: deflate) when that saves at least an eighth, and
+// polls send X-Tunnel-Accept-Encoding: deflate so the backend may compress
+// replies the same way. A post that does not shrink (ciphertext, media)
+// goes raw, and the tunnel skips the attempt for its next few posts,
+// twice as many each time it fails again.
+struct zadapt { unsigned skip, backoff; };
+
+static void zadapt_result(struct zadapt *z, bool won) {
+    if (won) { z->backoff = 0; return; }
+    z->backoff = !z->backoff ? 1 : z->backoff * 2 < ZSKIP_MAX ? z->backoff * 2 : ZSKIP_MAX;
+    z->skip = z->backoff;
+}
+
+// Deflate src into dst (len bytes of room) when that saves at least an
+// eighth. Returns the compressed length, or 0 to send src as it is.
+static size_t deflate_if_smaller(const unsigned char *src, size_t len, unsigned char *dst) {
+    uLongf out = len - len / 8;
+    if (compress2(dst, &out, src, len, ZLEVEL) != Z_OK) return 0;
+    return out;
+}
+
+// === Tunnels: one per accepted local connection ===
+// By default a tunnel runs the original poll loop as a little state machine:
+// read local bytes (or wait for the poll timer), run one HTTP exchange
+// through the shared curl multi handle, write the response back, repeat.
+// In full-duplex mode local bytes go up on one transfer while a second one
+// keeps polling downstream, so neither direction waits for the other. In
+// stream mode that second transfer is one long-lived response whose bytes
+// are written locally as they arrive.
+// Response bytes always go straight to the local socket from curl's write
+// callback; only what the socket refuses is kept, in a fixed ring, and a
+// transfer that would overflow it is paused until the ring drains.
+// A compressed reply is inflated on the way; compressed bytes that would
+// overflow the ring wait in a backlog, and later chunks pause until it
+// has been inflated.
+// Small local writes are coalesced before they go up: a short window, a
+// fraction of the measured round trip, collects what follows them, and
+// the post leaves early once enough bytes are in or the socket goes quiet.
+// All tunnels progress concurrently from the one event loop.
+enum xfer_dir { DIR_BOTH, DIR_UP, DIR_DOWN, DIR_STREAM };
+
+// === Timing ===
+// Where an exchange's time goes, from libcurl's timers: name lookup, TCP
+// connect and TLS handshake (only for exchanges that opened a connection),
+// server time (request sent to first response byte), transfer (first byte
+// to last) and the total. Long polls and streams are left out of server and
+// total time, which they would swamp with time spent holding. pollwait is
+// how long a poll that found data had sat idle before it went out: an upper
+// bound on the latency the poll schedule added. Log-linear histograms with
+// two buckets per power of two, 1 us .. 33 s.
+#define HIST_BUCKETS 50
+
+struct histogram {
+    unsigned long long count, sum_us, max_us;
+    unsigned long long buckets[HIST_BUCKETS + 1];   // last one is +Inf
+};
+
+static struct {
+    struct histogram dns, connect, tls, server, transfer, total, pollwait;
+    unsigned long long bytes_up, bytes_down, handshakes;
+} timing;
+static uint64_t hist_bounds[HIST_BUCKETS];      // upper bounds in us: 1, 2, 3, 4, 6, 8, 12, ...
+
+static void hist_init(void) {
+    hist_bounds[0] = 1;
+    for (int i = 1; i < HIST_BUCKETS; i++)
+        hist_bounds[i] = (i & 1) ? (uint64_t)2 << (i / 2) : (uint64_t)3 << (i / 2 - 1);
+}
+
+static void hist_observe(struct histogram *h, curl_off_t v) {
+    uint64_t us = v > 0 ? (uint64_t)v : 0;
+    int lo = 0, hi = HIST_BUCKETS;      // first bound >= us, or HIST_BUCKETS
+    while (lo < hi) { int mid = (lo + hi) / 2; if (hist_bounds[mid] < us) lo = mid + 1; else hi = mid; }
+    h->buckets[lo]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) h->max_us = us;
+}
+
+// Upper bound of the bucket holding quantile q, in ms.
+static double hist_quantile_ms(const struct histogram *h, double q) {
+    unsigned long long rank = (unsigned long long)(q * (double)h->count + 0.999999), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return (double)(hist_bounds[i] < h->max_us ? hist_bounds[i] : h->max_us) / 1000.0;
+    }
+    return (double)h->max_us / 1000.0;
+}
+
+static void timing_record(CURL *easy, bool fresh, bool held) {
+    curl_off_t dns = 0, conn = 0, app = 0, pre = 0, start = 0, total = 0, up = 0, down = 0;
+    curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &conn);
+    curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &app);
+    curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &pre);
+    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &start);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    if (fresh) {
+        hist_observe(&timing.dns, dns);
+        hist_observe(&timing.connect, conn - dns);
+        if (app > 0) { hist_observe(&timing.tls, app - conn); timing.handshakes++; }
+    }
+    if (!held) {
+        hist_observe(&timing.server, start - pre);
+        hist_observe(&timing.total, total);
+        hist_observe(&timing.transfer, total - start);
+    }
+    timing.bytes_up += (unsigned long long)up;
+    timing.bytes_down += (unsigned long long)down;
+}
+
+static void timing_log_one(const char *name, const struct histogram *h) {
+    if (h->count == 0) return;
+    fprintf(stderr, "timing %-8s n=%llu avg=%.3fms p50<=%.3fms p90<=%.3fms p99<=%.3fms max=%.3fms\n",
+            name, h->count, (double)h->sum_us / (double)h->count / 1000.0, hist_quantile_ms(h, 0.5),
+            hist_quantile_ms(h, 0.9), hist_quantile_ms(h, 0.99), (double)h->max_us / 1000.0);
+}
+
+struct tunnel;
+
+// One HTTP exchange slot with its own easy handle
+struct xfer {
+    struct tunnel *t;
+    enum xfer_dir dir;
+    CURL *easy;
+    bool busy;                      // an exchange is in flight
+    bool close_req;                 // it tells the backend we are done
+    bool waited;                    // asked the backend to long-poll
+    uint64_t idle_ms;               // idle poll: how long since the previous one ended
+    bool paused;                    // waiting for room in the output ring, or for an earlier stripe
+    bool resend;                    // striped poll after a failure: ask for everything unacknowledged
+    unsigned char *body;            // upstream bytes it carries, swapped in from t->buf
+    unsigned char *zbody;           // body deflated, when that pays
+    size_t body_len;                // bytes of body it carries, until the backend takes them
+    uint64_t offset;                // upstream offset of body[0]
+    uint64_t retry_at;              // when a refused or failed body goes again
+    uint64_t done_at;               // bytes through in its direction when it started
+    size_t received;                // response bytes delivered so far
+    size_t window;                  // most reply bytes it asked for (X-Tunnel-Window)
+    struct curl_slist *hdrs;
+    struct exchange_info info;
+};
+
+// Per-direction striping state (see Striping)
+struct stripe_rate {
+    unsigned n;                     // stripes to keep busy
+    double rate;                    // smoothed delivery rate, bytes/ms
+    double chunk;                   // smoothed bytes per exchange
+};
+
+struct tunnel {
+    struct watch w;                 // local connection; must be first
+    char session[33];
+    struct xfer up[MAX_STRIPES];    // local bytes (and, half-duplex, the replies); [0] unless striping
+    struct xfer down[MAX_STRIPES];  // full-duplex only: downstream polls or stream
+    bool closing;                   // finish the close exchange, then close
+    bool target_closed;             // close once the pending output is written
+    bool local_eof;                 // send what is buffered, then close the session
+    unsigned char *buf;             // local bytes for the next upstream exchange (BUF_SIZE)
+    size_t buf_len;
+    uint64_t coalesce_start;        // when buf got its first byte
+    uint64_t flush_at;              // when buf goes up if nothing else fills it
+    bool throttled;                 // the backend refused a body with 429: hold local input
+    uint64_t retry_ms;              // current 429 retry delay
+    uint64_t up_seq;                // upstream offset of buf[0]
+    uint64_t up_done;               // upstream bytes the backend has taken
+    uint64_t down_seq;              // downstream bytes handed to the local side
+    unsigned retries;               // failed exchanges in a row
+    struct stripe_rate up_rate, down_rate;
+    size_t peer_window;             // the backend's last X-Tunnel-Window (SIZE_MAX until it sends one)
+    bool window_probe;              // the window was shut long enough: let one post through
+    uint64_t probe_at, probe_ms;    // when that happens, and the current pause
+    struct zadapt zup;              // upstream compression backoff
+    z_stream inflater;              // --compress only: for compressed replies
+    unsigned char *zin;             // compressed reply bytes not inflated yet
+    size_t zin_off, zin_len, zin_cap;
+    unsigned char out[OUT_RING];    // response bytes the local socket refused
+    size_t out_head, out_len;
+    uint64_t delay;                 // current gap between idle polls, ms
+    uint64_t next_poll;             // when to poll if the local side stays quiet
+    uint64_t last_poll;             // when the last poll ended
+    uint64_t last_data;             // when a poll last brought bytes back
+    double gap_ms;                  // smoothed time between polls that brought bytes
+    unsigned run;                   // polls in a row that brought bytes
+    double tokens;                  // --poll-budget: idle polls this session may still send
+    uint64_t tokens_at;             // when tokens was last topped up
+    struct tunnel *prev, *next;
+};
+
+static CURLM *multi = NULL;
+static const char *url_g = NULL;
+static long long_poll_ms = 0;
+static bool full_duplex = false;
+static bool stream_mode = false;
+static bool compress_mode = false;
+static long coalesce_max_ms = 10;       // longest coalescing window; 0 disables
+static size_t coalesce_bytes = 16384;   // post as soon as this much is buffered
+static double srtt_ms = 0;              // smoothed exchange round trip, 0 until measured
+static double min_rtt_ms = 0;           // lowest exchange round trip seen
+static unsigned max_stripes = 1;        // --stripes: most requests per direction at once
+static unsigned peak_up_stripes = 0, peak_down_stripes = 0;
+static unsigned long posts = 0, posted_bytes = 0, wire_bytes = 0, throttles = 0;
+static unsigned max_retries = 5;        // --retries: failed exchanges in a row before giving up
+static long exchange_timeout_ms = 30000;    // --exchange-timeout: no progress for this long fails it
+static unsigned long retried = 0;
+static size_t recv_window = 1u << 20;   // --window: reply bytes a tunnel takes in flight
+static unsigned long zero_windows = 0;  // replies that shut the backend's window
+static long http_version = CURL_HTTP_VERSION_NONE;     // --http2 / --h2c
+// Connection sharing: exchanges that had to open a connection, exchanges
+// that ran over HTTP/2, and the most exchanges seen in flight per open
+// connection (streams multiplexed on one connection under HTTP/2).
+static unsigned long exchanges = 0, fresh_conns = 0, h2_exchanges = 0;
+static size_t in_flight = 0, open_conns = 0;
+static double peak_streams = 0;
+static struct tunnel *tunnels = NULL;
+static struct tunnel *dead_tunnels = NULL;  // closed during this batch, freed after it
+static size_t tunnel_count = 0;
+
+// The transfer that polls for downstream data
+static struct xfer *tunnel_poller(struct tunnel *t) {
+    return full_duplex ? &t->down[0] : &t->up[0];
+}
+
+// An upstream transfer free to take buf: idle and not holding a refused body.
+static struct xfer *tunnel_free_up(struct tunnel *t) {
+    for (unsigned i = 0; i < t->up_rate.n; i++)
+        if (!t->up[i].busy && t->up[i].body_len == 0) return &t->up[i];
+    return NULL;
+}
+
+// After local EOF the session closes once every upstream byte is through.
+static bool tunnel_up_idle(struct tunnel *t) {
+    if (t->buf_len > 0) return false;
+    for (unsigned i = 0; i < MAX_STRIPES; i++)
+        if (t->up[i].busy || t->up[i].body_len > 0) return false;
+    return true;
+}
+
+static void note_streams(void) {
+    if (open_conns > 0 && (double)in_flight / (double)open_conns > peak_streams)
+        peak_streams = (double)in_flight / (double)open_conns;
+}
+
+// === Poll scheduling ===
+// After a poll comes back, the tunnel's scheduler picks the gap before the
+// next idle one, bounded by --poll-min and --poll-max. Streams and granted
+// long polls re-poll at once and a post pulls the next poll in to
+// --poll-min whatever the scheduler says; the rest is up to it.
+//   backoff   the original rule: poll-min after data, doubling per empty
+//             poll up to poll-max.
+//   adaptive  (default) learns the session's pace. A reply that stopped at
+//             the backend's cap, or the second data-bearing poll in a row,
+//             is followed at once: data comes in runs. Empty polls double
+//             the gap, but while traffic keeps its usual pace the gap stays
+//             under half the smoothed time between data, so the first byte
+//             after a pause is not left waiting; after four such gaps of
+//             silence it backs off to poll-max.
+// --poll-budget N caps each session at N idle polls a minute (a token
+// bucket holding a tenth of that, at least one), whichever scheduler runs.
+struct poll_sched {
+    const char *name;
+    uint64_t (*next_delay)(struct tunnel *t, size_t got, bool more);
+};
+
+static uint64_t poll_min_ms = 100, poll_max_ms = 10000;
+static double poll_budget = 0;          // idle polls per minute per session; 0 = no limit
+static unsigned long polls = 0, empty_polls = 0, capped_polls = 0, budget_waits = 0;
+
+static uint64_t clamp_delay(uint64_t d) {
+    return d < poll_min_ms ? poll_min_ms : d > poll_max_ms ? poll_max_ms : d;
+}
+
+static uint64_t sched_backoff(struct tunnel *t, size_t got, bool more) {
+    (void)more;
+    if (got > 0) return poll_min_ms;
+    return clamp_delay(t->delay * 2);
+}
+
+static uint64_t sched_adaptive(struct tunnel *t, size_t got, bool more) {
+    uint64_t now = now_ms();
+    if (got > 0) {
+        if (t->last_data) {
+            double gap = (double)(now - t->last_data);
+            if (gap > (double)poll_max_ms) gap = (double)poll_max_ms;
+            t->gap_ms = t->gap_ms > 0 ? t->gap_ms + (gap - t->gap_ms) / 4 : gap;
         }
-        off += (size_t)w;
+        t->last_data = now;
+        t->run++;
+        return more || t->run > 1 ? 0 : poll_min_ms;
     }
-    return (ssize_t)off;
+    t->run = 0;
+    uint64_t d = t->delay * 2;
+    if (t->gap_ms > 0 && (double)(now - t->last_data) < 4 * t->gap_ms && d > (uint64_t)(t->gap_ms / 2))
+        d = (uint64_t)(t->gap_ms / 2);
+    return clamp_delay(d);
 }
 
-struct mem_buf {
-    unsigned char *data;
-    size_t len;
+static const struct poll_sched poll_scheds[] = {
+    { "adaptive", sched_adaptive },
+    { "backoff", sched_backoff },
 };
+static const struct poll_sched *sched = &poll_scheds[0];
+
+// Take one poll from the session's budget, or say when one will be there.
+static bool poll_budget_take(struct tunnel *t, uint64_t now, uint64_t *retry_at) {
+    if (poll_budget <= 0) return true;
+    double cap = poll_budget / 10 > 1 ? poll_budget / 10 : 1;
+    t->tokens += (double)(now - t->tokens_at) * poll_budget / 60000.0;
+    if (t->tokens > cap) t->tokens = cap;
+    t->tokens_at = now;
+    if (t->tokens >= 1) { t->tokens -= 1; return true; }
+    *retry_at = now + (uint64_t)((1 - t->tokens) * 60000.0 / poll_budget) + 1;
+    return false;
+}
+
+// === Striping ===
+// With --stripes N a full-duplex tunnel runs up to N posts and N polls at
+// once, each its own request (over HTTP/1.1, its own connection), so a
+// bulk transfer is not held to what one connection's window carries per
+// round trip. Posts are tagged with X-Tunnel-Offset and the backend holds
+// one that overtakes the posts before it. Polls send X-Tunnel-Stripe and
+// get only bytes no other reply carried; a reply that lands ahead of
+// down_seq is paused until the stripes before it are in, and one that
+// overlaps (a resend after a failure) skips what was delivered already.
+// The number in use follows the bandwidth-delay product: every finished
+// exchange samples its direction's delivery rate, and the tunnel keeps
+// enough average-sized exchanges going to cover rate x the lowest round
+// trip seen, plus one to find out whether more would go faster. An empty
+// poll drops a download stripe. Striped polls are not compressed.
+
+static unsigned stripes_for(const struct stripe_rate *r) {
+    if (r->chunk < 1 || min_rtt_ms <= 0) return 1;
+    double n = r->rate * min_rtt_ms / r->chunk + 1.999;
+    return n >= (double)max_stripes ? max_stripes : (unsigned)n;
+}
+
+// Fold a finished exchange into its direction: done is the direction's
+// bytes through now, bytes what this one moved, ms how long it took.
+static void stripe_sample(struct stripe_rate *r, const struct xfer *x, uint64_t done, size_t bytes, double ms) {
+    double rate = (double)(done - x->done_at) / (ms > 0.001 ? ms : 0.001);
+    r->rate = r->rate > 0 ? r->rate + (rate - r->rate) / 4 : rate;
+    r->chunk = r->chunk > 0 ? r->chunk + ((double)bytes - r->chunk) / 4 : (double)bytes;
+    r->n = stripes_for(r);
+}
+
+// Note how many exchanges the direction x belongs to has in flight.
+static void stripe_note_peak(struct tunnel *t, const struct xfer *x) {
+    const struct xfer *set = x->dir == DIR_DOWN ? t->down : t->up;
+    unsigned *peak = x->dir == DIR_DOWN ? &peak_down_stripes : &peak_up_stripes, busy = 0;
+    for (unsigned i = 0; i < MAX_STRIPES; i++) busy += set[i].busy;
+    if (busy > *peak) *peak = busy;
+}
+
+// === Flow control ===
+// Each side advertises a receive window in X-Tunnel-Window and the other
+// never sends beyond it. Polls offer --window less what the tunnel already
+// holds: output the local socket has not taken, and room promised to the
+// other replies in flight (a striped poll gets a share of it). The backend
+// replies with the room left in the session's write queue, and local input
+// is read only as far as that allows, less the posts still in flight. A
+// shut window is probed like a 429: after a pause that doubles while it
+// stays shut, one post goes through and its reply reopens the window or
+// throttles it.
+
+static size_t tunnel_recv_credit(const struct tunnel *t) {
+    size_t held = t->out_len + t->zin_len;
+    for (unsigned i = 0; i < 2 * MAX_STRIPES; i++) {
+        const struct xfer *x = i < MAX_STRIPES ? &t->up[i] : &t->down[i - MAX_STRIPES];
+        if (x->busy && x->window > x->received) held += x->window - x->received;
+    }
+    return recv_window > held ? recv_window - held : 0;
+}
+
+static size_t tunnel_send_credit(const struct tunnel *t) {
+    size_t inflight = 0;
+    for (unsigned i = 0; i < MAX_STRIPES; i++) inflight += t->up[i].body_len;
+    if (t->window_probe) return inflight ? 0 : BUF_SIZE;
+    return t->peer_window > inflight ? t->peer_window - inflight : 0;
+}
+
+static void window_update(struct tunnel *t, const struct exchange_info *info) {
+    if (!info->has_window) return;
+    t->peer_window = info->window;
+    t->window_probe = false;
+    if (t->peer_window > 0) { t->probe_ms = 0; return; }
+    t->probe_ms = t->probe_ms ? t->probe_ms * 2 : THROTTLE_MIN_MS;
+    if (t->probe_ms > THROTTLE_MAX_MS) t->probe_ms = THROTTLE_MAX_MS;
+    t->probe_at = now_ms() + t->probe_ms;
+    zero_windows++;
+}
+
+static void xfer_release(struct xfer *x) {
+    free(x->body);
+    free(x->zbody);
+    if (!x->easy) return;
+    if (x->busy) { curl_multi_remove_handle(multi, x->easy); in_flight--; }
+    curl_easy_cleanup(x->easy);
+    curl_slist_free_all(x->hdrs);
+}
+
+static void xfers_release(struct tunnel *t) {
+    for (unsigned i = 0; i < MAX_STRIPES; i++) {
+        xfer_release(&t->up[i]);
+        xfer_release(&t->down[i]);
+    }
+}
+
+static void tunnel_close(struct tunnel *t) {
+    if (t->w.fd < 0) return;
+    xfers_release(t);
+    if (compress_mode) inflateEnd(&t->inflater);
+    free(t->zin);
+    watch_set(&t->w, 0);
+    close(t->w.fd);
+    t->w.fd = -1;
+    if (t->prev) t->prev->next = t->next; else tunnels = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->next = dead_tunnels;
+    dead_tunnels = t;
+    tunnel_count--;
+}
+
+struct curl_sock;
+static void free_dead_socks(void);
+
+static void free_dead_tunnels(void) {
+    while (dead_tunnels) { struct tunnel *t = dead_tunnels; dead_tunnels = t->next; free(t->buf); free(t); }
+    free_dead_socks();
+}
+
+// Local bytes are read whenever an upstream transfer is free; half-duplex
+// tunnels also flush pending response bytes before reading more.
+static void tunnel_update_watch(struct tunnel *t) {
+    uint32_t ev = 0;
+    bool pending = t->out_len > 0;
+    if (pending) ev |= EPOLLOUT;
+    if (tunnel_free_up(t) && !t->closing && !t->local_eof && !t->throttled && (full_duplex || !pending) &&
+        tunnel_send_credit(t) > t->buf_len)
+        ev |= EPOLLIN;
+    watch_set(&t->w, ev);
+}
+
+// Send len response bytes to the local socket, keeping what it refuses in
+// the ring; the caller has checked they fit. Returns -1 if the socket failed.
+static int local_deliver(struct tunnel *t, const unsigned char *p, size_t len) {
+    size_t off = 0;
+    t->down_seq += len;
+    if (t->out_len == 0) {
+        while (off < len) {
+            ssize_t w = send(t->w.fd, p + off, len - off, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                perror("write");
+                return -1;
+            }
+            off += (size_t)w;
+        }
+    }
+    while (off < len) {
+        size_t tail = (t->out_head + t->out_len) % OUT_RING;
+        size_t n = OUT_RING - tail < len - off ? OUT_RING - tail : len - off;
+        memcpy(t->out + tail, p + off, n);
+        t->out_len += n; off += n;
+    }
+    return 0;
+}
+
+// Inflate the compressed backlog for as long as the ring has room.
+// Returns -1 on corrupt data or a failed local socket.
+static int tunnel_inflate(struct tunnel *t) {
+    unsigned char chunk[16384];
+    while (t->zin_len > 0 && t->out_len < OUT_RING) {
+        size_t room = OUT_RING - t->out_len;
+        t->inflater.next_in = t->zin + t->zin_off;
+        t->inflater.avail_in = (uInt)t->zin_len;
+        t->inflater.next_out = chunk;
+        t->inflater.avail_out = (uInt)(room < sizeof(chunk) ? room : sizeof(chunk));
+        int ret = inflate(&t->inflater, Z_NO_FLUSH);
+        size_t used = t->zin_len - t->inflater.avail_in;
+        size_t made = (size_t)(t->inflater.next_out - chunk);
+        t->zin_off += used; t->zin_len -= used;
+        if (ret == Z_STREAM_END) { inflateReset(&t->inflater); t->zin_len = 0; }
+        else if (ret != Z_OK) return -1;
+        if (made > 0 && local_deliver(t, chunk, made) < 0) return -1;
+    }
+    if (t->zin_len == 0) t->zin_off = 0;
+    return 0;
+}
 
+// Hand response bytes to the local socket as curl delivers them. The ring
+// only takes what the socket refuses; when it cannot take a whole chunk the
+// transfer is paused, and curl offers the same chunk again once resumed.
 static size_t curl_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
-    size_t total = size * nmemb;
-    struct mem_buf *mb = userdata;
-    unsigned char *nbuf = realloc(mb->data, mb->len + total);
-    if (!nbuf) return 0;
-    memcpy(nbuf + mb->len, ptr, total);
-    mb->data = nbuf;
-    mb->len += total;
+    struct xfer *x = userdata;
+    struct tunnel *t = x->t;
+    size_t total = size * nmemb, skip = 0;
+    if (max_stripes == 1 && x->received == 0 && x->info.has_offset && x->info.offset != t->down_seq) {
+        fprintf(stderr, "reply starts at offset %llu, expected %llu\n", x->info.offset, (unsigned long long)t->down_seq);
+        return 0;       // bytes were lost or would be doubled: fail the tunnel
+    }
+    if (max_stripes > 1 && x->info.has_offset) {
+        // wait for the stripes carrying the bytes before these; skip what a
+        // resent reply shares with ones that got here first
+        uint64_t at = x->info.offset + x->received;
+        if (at > t->down_seq) {
+            x->paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        skip = t->down_seq - at < total ? (size_t)(t->down_seq - at) : total;
+    }
+    if (t->zin_len > 0 || (t->out_len > 0 && OUT_RING - t->out_len < total - skip)) {
+        x->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if (x->info.deflate) {
+        if (total > t->zin_cap) {
+            unsigned char *nz = realloc(t->zin, total);
+            if (!nz) return 0;
+            t->zin = nz; t->zin_cap = total;
+        }
+        memcpy(t->zin, ptr, total);
+        t->zin_len = total;
+        if (tunnel_inflate(t) < 0) {
+            fprintf(stderr, "bad compressed reply\n");
+            return 0;   // fails the transfer, which closes the tunnel
+        }
+    } else if (total - skip > OUT_RING || local_deliver(t, (const unsigned char*)ptr + skip, total - skip) < 0) {
+        return 0;       // fails the transfer, which closes the tunnel
+    }
+    if (t->out_len > 0) tunnel_update_watch(t);
+    x->received += total;
     return total;
 }
 
-static int http_exchange(CURL *curl, const char *url,
-                         const unsigned char *body, size_t body_len,
-                         unsigned char **out, size_t *out_len) {
-    struct mem_buf mb = {0};
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+// Start an HTTP exchange carrying the transfer's body (none for a poll).
+// close_req tells the backend the local side is gone so it can drop the
+// session.
+static int exchange_start(struct xfer *x, bool close_req) {
+    struct tunnel *t = x->t;
+    CURL *curl = x->easy;
+    size_t body_len = x->body_len;
+    // Idle polls may be held by the backend; data-carrying posts never are
+    long wait_ms = (body_len == 0 && !close_req && x->dir != DIR_UP) ? long_poll_ms : 0;
+    memset(&x->info, 0, sizeof(x->info));
+    x->waited = wait_ms > 0;
+    x->idle_ms = body_len == 0 && !close_req && x == tunnel_poller(t) ? now_ms() - t->last_poll : 0;
+    x->received = 0;
+    x->done_at = x->dir == DIR_DOWN ? t->down_seq : t->up_done;
+    bool stripe = max_stripes > 1 && x->dir == DIR_DOWN && !x->resend;
+    bool replies = x->dir != DIR_UP && x->dir != DIR_STREAM && !close_req;
+    x->window = replies ? tunnel_recv_credit(t) : 0;
+    if (stripe && x->window > recv_window / t->down_rate.n) x->window = recv_window / t->down_rate.n;
+    x->resend = false;
+    const unsigned char *body = body_len > 0 ? x->body : (const unsigned char*)"";
+    size_t wire_len = body_len;
+    if (compress_mode && body_len >= ZMIN) {
+        if (t->zup.skip > 0) {
+            t->zup.skip--;
+        } else if (x->zbody || (x->zbody = malloc(BUF_SIZE)) != NULL) {
+            size_t zlen = deflate_if_smaller(x->body, body_len, x->zbody);
+            zadapt_result(&t->zup, zlen > 0);
+            if (zlen > 0) { body = x->zbody; wire_len = zlen; }
+        }
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url_g);
     curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body_len > 0 ? (const char*)body : "");
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body_len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (const char*)body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)wire_len);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &mb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, x);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &x->info);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, x);
     curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    char sess_hdr[128];
+    snprintf(sess_hdr, sizeof(sess_hdr), "X-Tunnel-Session: %s", t->session);
+    curl_slist_free_all(x->hdrs);
     struct curl_slist *hdrs = NULL;
     hdrs = curl_slist_append(hdrs, "Content-Type: application/octet-stream");
     hdrs = curl_slist_append(hdrs, "Expect:");
+    hdrs = curl_slist_append(hdrs, sess_hdr);
+    char wait_hdr[64];
+    if (wait_ms > 0) {
+        snprintf(wait_hdr, sizeof(wait_hdr), "X-Tunnel-Wait: %ld", wait_ms);
+        hdrs = curl_slist_append(hdrs, wait_hdr);
+    }
+    char seq_hdr[64];
+    if (body_len > 0) {
+        snprintf(seq_hdr, sizeof(seq_hdr), "X-Tunnel-Offset: %llu", (unsigned long long)x->offset);
+        hdrs = curl_slist_append(hdrs, seq_hdr);
+    }
+    char window_hdr[64];
+    if (replies) {
+        snprintf(seq_hdr, sizeof(seq_hdr), "X-Tunnel-Ack: %llu", (unsigned long long)t->down_seq);
+        hdrs = curl_slist_append(hdrs, seq_hdr);
+        snprintf(window_hdr, sizeof(window_hdr), "X-Tunnel-Window: %zu", x->window);
+        hdrs = curl_slist_append(hdrs, window_hdr);
+    }
+    if (x->dir == DIR_UP) hdrs = curl_slist_append(hdrs, "X-Tunnel-Dir: up");
+    else if (x->dir == DIR_DOWN) hdrs = curl_slist_append(hdrs, "X-Tunnel-Dir: down");
+    else if (x->dir == DIR_STREAM) hdrs = curl_slist_append(hdrs, "X-Tunnel-Dir: stream");
+    if (stripe) hdrs = curl_slist_append(hdrs, "X-Tunnel-Stripe: 1");
+    if (close_req) hdrs = curl_slist_append(hdrs, "X-Tunnel-Close: 1");
+    if (body == x->zbody) hdrs = curl_slist_append(hdrs, "X-Tunnel-Encoding: deflate");
+    // streamed replies stay raw, as do striped ones, which are spliced by offset
+    if (compress_mode && !close_req && x->dir != DIR_UP && x->dir != DIR_STREAM && !(max_stripes > 1 && x->dir == DIR_DOWN))
+        hdrs = curl_slist_append(hdrs, "X-Tunnel-Accept-Encoding: deflate");
+    x->hdrs = hdrs;
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
-    CURLcode res = curl_easy_perform(curl);
-    curl_slist_free_all(hdrs);
-    if (res != CURLE_OK) { free(mb.data); return -1; }
-    long code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-    if (code != 200) { free(mb.data); return -1; }
-    *out = mb.data;
-    *out_len = mb.len;
+    // a stalled exchange fails (and is retried) once it makes no progress
+    // for the timeout on top of any hold it asked for; streams idle freely
+    long stall_s = x->dir == DIR_STREAM || exchange_timeout_ms <= 0 ? 0 : (wait_ms + exchange_timeout_ms + 999) / 1000;
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, stall_s ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, stall_s);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, exchange_timeout_ms > 0 ? exchange_timeout_ms : 0L);
+    if (curl_multi_add_handle(multi, curl) != CURLM_OK) return -1;
+    x->busy = true;
+    in_flight++;
+    x->close_req = close_req;
+    if (body_len > 0) { posts++; posted_bytes += body_len; wire_bytes += wire_len; }
+    if (close_req) t->closing = true;
+    if (max_stripes > 1) stripe_note_peak(t, x);
+    tunnel_update_watch(t);
+    return 0;
+}
+
+// Write out the ring, refilling it from the compressed backlog; end the
+// tunnel once the target is gone.
+static void tunnel_flush(struct tunnel *t) {
+    for (;;) {
+        while (t->out_len > 0) {
+            size_t n = OUT_RING - t->out_head < t->out_len ? OUT_RING - t->out_head : t->out_len;
+            ssize_t w = send(t->w.fd, t->out + t->out_head, n, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) { tunnel_update_watch(t); return; }
+                perror("write");
+                tunnel_close(t);
+                return;
+            }
+            t->out_head = (t->out_head + (size_t)w) % OUT_RING;
+            t->out_len -= (size_t)w;
+        }
+        t->out_head = 0;
+        if (t->zin_len == 0) break;
+        if (tunnel_inflate(t) < 0) {
+            fprintf(stderr, "bad compressed reply\n");
+            tunnel_close(t);
+            return;
+        }
+    }
+    // resuming may deliver more bytes right away, straight from curl
+    for (unsigned i = 0; i < 2 * MAX_STRIPES; i++) {
+        struct xfer *x = i < MAX_STRIPES ? &t->up[i] : &t->down[i - MAX_STRIPES];
+        if (!x->paused) continue;
+        x->paused = false;
+        curl_easy_pause(x->easy, CURLPAUSE_CONT);
+        if (t->out_len > 0) return;
+    }
+    if (t->target_closed) {
+        // target on the far side hung up; end the local connection too
+        tunnel_close(t);
+        return;
+    }
+    tunnel_update_watch(t);
+}
+
+// A failed or stalled exchange is tried again, up to --retries times in a
+// row with a growing pause, instead of ending the tunnel. Sequence numbers
+// make that safe: the post goes again with the same X-Tunnel-Offset and the
+// poll with the same X-Tunnel-Ack, so the backend drops what it already
+// took and resends what never arrived (a striped poll asks for all of it).
+// Streams and close requests are not retried.
+static bool exchange_retry(struct xfer *x) {
+    struct tunnel *t = x->t;
+    if (x->close_req || x->dir == DIR_STREAM || t->retries >= max_retries) return false;
+    uint64_t pause = RETRY_MIN_MS << t->retries;
+    if (pause > RETRY_MAX_MS) pause = RETRY_MAX_MS;
+    t->retries++;
+    retried++;
+    fprintf(stderr, "http exchange failed, retrying in %llu ms\n", (unsigned long long)pause);
+    x->paused = false;
+    if (compress_mode && x->info.deflate) {
+        // the rest of the reply comes again, compressed afresh
+        t->zin_len = t->zin_off = 0;
+        inflateReset(&t->inflater);
+    }
+    if (x->body_len > 0) {
+        // the transfer keeps the bytes; hold local input until they are through
+        t->throttled = true;
+        x->retry_at = now_ms() + pause;
+    }
+    if (x == tunnel_poller(t)) t->next_poll = now_ms() + pause;
+    else if (x->dir == DIR_DOWN) x->retry_at = now_ms() + pause;
+    x->resend = true;
+    tunnel_flush(t);
+    return true;
+}
+
+static void exchange_done(struct xfer *x, CURLcode res) {
+    struct tunnel *t = x->t;
+    note_streams();
+    curl_multi_remove_handle(multi, x->easy);
+    x->busy = false;
+    in_flight--;
+    long code = 0, conns = 0, version = 0;
+    curl_easy_getinfo(x->easy, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(x->easy, CURLINFO_NUM_CONNECTS, &conns);
+    curl_easy_getinfo(x->easy, CURLINFO_HTTP_VERSION, &version);
+    exchanges++;
+    if (conns > 0) fresh_conns++;
+    if (version == CURL_HTTP_VERSION_2_0) h2_exchanges++;
+    if (res == CURLE_OK) timing_record(x->easy, conns > 0, x->waited || x->dir == DIR_STREAM);
+    if (x->close_req) { tunnel_close(t); return; }
+    if (res == CURLE_OK && code == 410) {
+        // the session ended while no request was there to see it
+        t->target_closed = true;
+        tunnel_flush(t);
+        return;
+    }
+    if (res == CURLE_OK && code == 429 && x->body_len > 0) {
+        // the session's write queue is full: keep the bytes, stop reading
+        // the local side (so the sender feels it) and offer them again
+        t->retry_ms = t->retry_ms ? t->retry_ms * 2 : THROTTLE_MIN_MS;
+        if (t->retry_ms > THROTTLE_MAX_MS) t->retry_ms = THROTTLE_MAX_MS;
+        t->throttled = true;
+        x->retry_at = now_ms() + t->retry_ms;
+        throttles++;
+        tunnel_flush(t);
+        return;
+    }
+    if ((res != CURLE_OK || code >= 500) && exchange_retry(x)) return;
+    if (res != CURLE_OK || code != 200) {
+        fprintf(stderr, "http exchange failed\n");
+        tunnel_close(t);
+        return;
+    }
+    t->retries = 0;
+    window_update(t, &x->info);
+    size_t got = x->received, body_len = x->body_len;
+    if (x->info.closed) t->target_closed = true;
+    double secs = 0;
+    curl_easy_getinfo(x->easy, CURLINFO_TOTAL_TIME, &secs);
+    double ms = secs * 1000.0;
+    if (!x->waited && x->dir != DIR_STREAM) {
+        srtt_ms = srtt_ms > 0 ? srtt_ms + (ms - srtt_ms) / (1 << RTT_SHIFT) : ms;
+        if (min_rtt_ms == 0 || ms < min_rtt_ms) min_rtt_ms = ms;
+    }
+    if (body_len > 0) {
+        x->body_len = 0;
+        t->up_done += body_len;
+        t->retry_ms = 0;
+        t->throttled = false;
+        if (max_stripes > 1) stripe_sample(&t->up_rate, x, t->up_done, body_len, ms);
+    }
+    if (x->dir == DIR_DOWN && max_stripes > 1) {
+        if (got > 0) stripe_sample(&t->down_rate, x, t->down_seq, got, ms);
+        else if (t->down_rate.n > 1) t->down_rate.n--;
+    }
+    if (x->dir != DIR_DOWN && x->dir != DIR_STREAM && t->local_eof && tunnel_up_idle(t)) {
+        if (exchange_start(&t->up[0], true) < 0) tunnel_close(t);
+        return;
+    }
+    if (body_len == 0 && (x == tunnel_poller(t) || x->dir == DIR_DOWN)) {
+        polls++;
+        if (got == 0) empty_polls++;
+        else hist_observe(&timing.pollwait, (curl_off_t)x->idle_ms * 1000);
+        if (x->info.more) capped_polls++;
+    }
+    if (x == tunnel_poller(t)) {
+        if (x->info.stream) {
+            // the stream only ends once it has idled out: reopen it at once
+            t->delay = 0;
+        } else if (got == 0 && body_len == 0 && x->info.wait_granted > 0) {
+            // the backend already waited for us; poll again right away
+            t->delay = 0;
+        } else if (got == 0 && body_len > 0) {
+            t->delay = poll_min_ms;
+        } else {
+            t->delay = sched->next_delay(t, got, x->info.more);
+        }
+        t->last_poll = now_ms();
+        t->next_poll = t->last_poll + t->delay;
+    } else if (body_len > 0 && t->delay > poll_min_ms) {
+        // data just went up, so a reply is likely: cut the idle backoff short
+        t->delay = poll_min_ms;
+        uint64_t soon = now_ms() + t->delay;
+        if (t->next_poll > soon) t->next_poll = soon;
+    }
+    tunnel_flush(t);
+}
+
+// Coalescing window: a fraction of the smoothed round trip, so it stays
+// small next to the latency the exchange adds anyway.
+static uint64_t coalesce_window(void) {
+    uint64_t w = (uint64_t)srtt_ms >> RTT_SHIFT;
+    return w < (uint64_t)coalesce_max_ms ? w : (uint64_t)coalesce_max_ms;
+}
+
+// Hand the buffered local bytes to a free upstream transfer and send them;
+// buf starts over empty, so with a stripe to spare reading goes on.
+static void tunnel_post(struct tunnel *t) {
+    struct xfer *x = tunnel_free_up(t);
+    if (!x) return;
+    unsigned char *spare = x->body ? x->body : malloc(BUF_SIZE);
+    if (!spare) { tunnel_close(t); return; }
+    x->body = t->buf;
+    x->body_len = t->buf_len;
+    x->offset = t->up_seq;
+    t->buf = spare;
+    t->up_seq += t->buf_len;
+    t->buf_len = 0;
+    if (exchange_start(x, false) < 0) tunnel_close(t);
+}
+
+static void on_local_event(struct tunnel *t, uint32_t events) {
+    if (t->out_len > 0 && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        tunnel_flush(t);
+        if (t->w.fd < 0) return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) || !(t->w.events & EPOLLIN)) return;
+    size_t limit = tunnel_send_credit(t);
+    if (limit > BUF_SIZE) limit = BUF_SIZE;
+    if (t->buf_len >= limit) return;
+    ssize_t rd = read(t->w.fd, t->buf + t->buf_len, limit - t->buf_len);
+    if (rd < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return;
+        perror("read");
+        tunnel_close(t);
+        return;
+    }
+    uint64_t now = now_ms();
+    if (rd == 0) {
+        // peer closed: send what is left, let the backend drop the session
+        t->local_eof = true;
+        tunnel_update_watch(t);
+        if (t->buf_len > 0) t->flush_at = now;
+        else if (tunnel_up_idle(t) && exchange_start(&t->up[0], true) < 0) tunnel_close(t);
+        return;
+    }
+    if (t->buf_len == 0) t->coalesce_start = now;
+    t->buf_len += (size_t)rd;
+    uint64_t win = coalesce_window();
+    if (win == 0 || t->buf_len >= coalesce_bytes || t->buf_len == limit) {
+        tunnel_post(t);
+        return;
+    }
+    // hold the bytes until the window closes or the socket goes quiet
+    uint64_t quiet = win >> 2 ? win >> 2 : 1;
+    t->flush_at = now + quiet < t->coalesce_start + win ? now + quiet : t->coalesce_start + win;
+}
+
+static int xfer_init(struct tunnel *t, struct xfer *x, enum xfer_dir dir) {
+    x->t = t;
+    x->dir = dir;
+    x->easy = curl_easy_init();
+    if (!x->easy) return -1;
+    if (http_version != CURL_HTTP_VERSION_NONE) {
+        curl_easy_setopt(x->easy, CURLOPT_HTTP_VERSION, http_version);
+        // wait for a connection that may multiplex rather than open another
+        curl_easy_setopt(x->easy, CURLOPT_PIPEWAIT, 1L);
+    }
+    return 0;
+}
+
+static void tunnel_open(int fd) {
+    struct tunnel *t = calloc(1, sizeof(*t));
+    // every stripe gets its transfer up front; a stream is one download
+    unsigned ups = full_duplex ? max_stripes : 1, downs = !full_duplex ? 0 : stream_mode ? 1 : max_stripes;
+    bool ok = t && (t->buf = malloc(BUF_SIZE)) != NULL;
+    for (unsigned i = 0; ok && i < ups; i++) ok = xfer_init(t, &t->up[i], full_duplex ? DIR_UP : DIR_BOTH) == 0;
+    for (unsigned i = 0; ok && i < downs; i++) ok = xfer_init(t, &t->down[i], stream_mode ? DIR_STREAM : DIR_DOWN) == 0;
+    if (!ok) {
+        fprintf(stderr, "curl init failed\n");
+        if (t) { xfers_release(t); free(t->buf); free(t); }
+        close(fd);
+        return;
+    }
+    if (compress_mode && inflateInit(&t->inflater) != Z_OK) {
+        fprintf(stderr, "zlib init failed\n");
+        xfers_release(t); free(t->buf); free(t);
+        close(fd);
+        return;
+    }
+    t->up_rate.n = t->down_rate.n = 1;
+    t->peer_window = SIZE_MAX;
+    t->w.kind = W_LOCAL; t->w.fd = fd;
+    make_session_id(t->session, sizeof(t->session));
+    t->delay = poll_min_ms;
+    t->last_poll = t->tokens_at = now_ms();
+    t->tokens = poll_budget / 10 > 1 ? poll_budget / 10 : 1;
+    // a full-duplex tunnel starts its downstream poll right away
+    t->next_poll = full_duplex ? 0 : t->last_poll + t->delay;
+    t->next = tunnels;
+    if (tunnels) tunnels->prev = t;
+    tunnels = t;
+    tunnel_count++;
+    tunnel_update_watch(t);
+}
+
+static void accept_locals(int srv) {
+    for (;;) {
+        int fd = accept4(srv, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        tunnel_open(fd);
+    }
+}
+
+// === libcurl multi-socket integration ===
+static uint64_t curl_deadline = 0;  // 0: libcurl wants no timeout
+
+struct curl_sock {
+    struct watch w;                 // must be first
+    struct curl_sock *next_dead;
+};
+
+static struct curl_sock *dead_socks = NULL; // released during this batch, freed after it
+
+static void free_dead_socks(void) {
+    while (dead_socks) { struct curl_sock *cs = dead_socks; dead_socks = cs->next_dead; free(cs); }
+}
+
+static int curl_socket_cb(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    (void)easy; (void)userp;
+    struct curl_sock *cs = socketp;
+    if (what == CURL_POLL_REMOVE) {
+        if (cs) {
+            watch_set(&cs->w, 0);
+            cs->w.fd = -1;
+            open_conns--;
+            cs->next_dead = dead_socks;
+            dead_socks = cs;
+            curl_multi_assign(multi, s, NULL);
+        }
+        return 0;
+    }
+    if (!cs) {
+        cs = calloc(1, sizeof(*cs));
+        if (!cs) return -1;
+        cs->w.kind = W_CURL; cs->w.fd = s;
+        curl_multi_assign(multi, s, cs);
+        open_conns++;
+        note_streams();
+    }
+    uint32_t ev = 0;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) ev |= EPOLLIN;
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) ev |= EPOLLOUT;
+    watch_set(&cs->w, ev);
+    return 0;
+}
+
+static int curl_timer_cb(CURLM *m, long timeout_ms, void *userp) {
+    (void)m; (void)userp;
+    curl_deadline = timeout_ms < 0 ? 0 : now_ms() + (uint64_t)timeout_ms;
     return 0;
 }
 
+static void check_multi_info(void) {
+    CURLMsg *msg; int left;
+    while ((msg = curl_multi_info_read(multi, &left))) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        struct xfer *x = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&x);
+        if (x) exchange_done(x, msg->data.result);
+    }
+}
+
+static void on_curl_event(struct curl_sock *cs, uint32_t events) {
+    int flags = 0, running;
+    if (events & EPOLLIN) flags |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+    curl_multi_socket_action(multi, cs->w.fd, flags, &running);
+    check_multi_info();
+}
+
+// Fire due poll timers and libcurl's timeout, then say how long epoll may
+// sleep.
+static int run_timers(void) {
+    uint64_t now = now_ms();
+    if (curl_deadline && curl_deadline <= now) {
+        int running;
+        curl_deadline = 0;
+        curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        check_multi_info();
+    }
+    uint64_t next = 0;
+    for (struct tunnel *t = tunnels, *n; t; t = n) {
+        n = t->next;
+        if (t->closing) continue;
+        // refused or failed bodies go again once their pause is over
+        bool failed = false;
+        for (unsigned i = 0; i < MAX_STRIPES && !failed; i++) {
+            struct xfer *x = &t->up[i];
+            if (x->busy || x->body_len == 0) continue;
+            if (x->retry_at <= now) failed = exchange_start(x, false) < 0;
+            else if (!next || x->retry_at < next) next = x->retry_at;
+        }
+        if (failed) { tunnel_close(t); continue; }
+        if (t->peer_window == 0 && !t->window_probe) {
+            if (t->probe_at <= now) { t->window_probe = true; tunnel_update_watch(t); }
+            else if (!next || t->probe_at < next) next = t->probe_at;
+        }
+        if (t->buf_len > 0 && !t->throttled && tunnel_free_up(t)) {
+            if (t->flush_at <= now) { tunnel_post(t); continue; }
+            if (!next || t->flush_at < next) next = t->flush_at;
+            if (!full_duplex) continue;     // the post doubles as the poll
+        }
+        if (t->out_len > 0) continue;
+        struct xfer *p = tunnel_poller(t);
+        if (!p->busy && p->body_len == 0 && tunnel_recv_credit(t) > 0) {
+            if (t->next_poll <= now) {
+                if (!poll_budget_take(t, now, &t->next_poll)) budget_waits++;
+                else if (exchange_start(p, false) < 0) { tunnel_close(t); continue; }
+            }
+            if (!p->busy && (!next || t->next_poll < next)) next = t->next_poll;
+        }
+        // more download stripes while the rate calls for them, and any that
+        // failed, to fetch again what they lost
+        for (unsigned i = 1; i < MAX_STRIPES; i++) {
+            struct xfer *x = &t->down[i];
+            if (!x->easy || x->busy || (i >= t->down_rate.n && !x->resend) || tunnel_recv_credit(t) == 0) continue;
+            if (x->retry_at > now) { if (!next || x->retry_at < next) next = x->retry_at; continue; }
+            if (exchange_start(x, false) < 0) { tunnel_close(t); break; }
+        }
+    }
+    // starting exchanges above may have moved libcurl's deadline
+    if (curl_deadline && (!next || curl_deadline < next)) next = curl_deadline;
+    if (!next) return -1;
+    now = now_ms();
+    return next <= now ? 0 : (int)(next - now);
+}
+
+// Connection reuse and the timing histograms: on SIGUSR1 and on exit.
+static void stats_log(void) {
+    fprintf(stderr, "exchanges=%lu new_conns=%lu reuse=%.1f%% tls_handshakes=%llu h2=%lu peak_streams_per_conn=%.1f "
+            "bytes_up=%llu bytes_down=%llu retries=%lu\n",
+            exchanges, fresh_conns, exchanges ? 100.0 * (double)(exchanges - fresh_conns) / (double)exchanges : 0.0,
+            timing.handshakes, h2_exchanges, peak_streams, timing.bytes_up, timing.bytes_down, retried);
+    fprintf(stderr, "polls=%lu scheduler=%s empty=%.1f%% capped=%lu budget_waits=%lu\n",
+            polls, sched->name, polls ? 100.0 * (double)empty_polls / (double)polls : 0.0, capped_polls, budget_waits);
+    fprintf(stderr, "window=%zu zero_windows=%lu\n", recv_window, zero_windows);
+    if (max_stripes > 1)
+        fprintf(stderr, "stripes max=%u peak_up=%u peak_down=%u min_rtt_ms=%.3f\n",
+                max_stripes, peak_up_stripes, peak_down_stripes, min_rtt_ms);
+    timing_log_one("dns", &timing.dns);
+    timing_log_one("connect", &timing.connect);
+    timing_log_one("tls", &timing.tls);
+    timing_log_one("server", &timing.server);
+    timing_log_one("transfer", &timing.transfer);
+    timing_log_one("total", &timing.total);
+    timing_log_one("pollwait", &timing.pollwait);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <listen_port> <url>\n"
+            "  --long-poll MS         let the backend hold idle polls up to MS milliseconds\n"
+            "  --full-duplex          send local data and poll for replies on separate requests\n"
+            "  --stream               full duplex, with replies on one long-lived streamed response\n"
+            "  --coalesce MS          longest window for gathering small local writes (default 10, 0 disables)\n"
+            "  --coalesce-bytes N     post at once when this much local data is buffered (default 16384)\n"
+            "  --compress             deflate posts and accept deflated replies when that pays\n"
+            "  --http2                HTTP/2 over TLS (ALPN), all sessions multiplexed on one connection\n"
+            "  --h2c                  HTTP/2 without TLS, by prior knowledge (plain-text test backends)\n"
+            "  --poll-scheduler NAME  idle poll timing: adaptive (default) or backoff\n"
+            "  --poll-min MS          shortest gap between idle polls (default 100, at least 1)\n"
+            "  --poll-max MS          longest gap between idle polls (default 10000)\n"
+            "  --poll-budget N        at most N idle polls a minute per session (default 0, no limit)\n"
+            "  --retries N            retry a failed exchange up to N times in a row (default 5)\n"
+            "  --exchange-timeout MS  fail an exchange that makes no progress this long (default 30000, 0 disables)\n"
+            "  --stripes N            run up to N posts and N polls per tunnel at once, as many as the\n"
+            "                         bandwidth-delay product calls for (default 1, at most 8; implies --full-duplex)\n"
+            "  --window BYTES         most reply bytes a tunnel takes in flight (default 1048576, at least 4096)\n",
+            prog);
+}
+
 int main(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <listen_port> <url>\n", argv[0]);
+    static const struct option opts[] = {
+        { "long-poll", required_argument, NULL, 'l' },
+        { "full-duplex", no_argument, NULL, 'd' },
+        { "stream", no_argument, NULL, 's' },
+        { "coalesce", required_argument, NULL, 'c' },
+        { "coalesce-bytes", required_argument, NULL, 'b' },
+        { "compress", no_argument, NULL, 'z' },
+        { "http2", no_argument, NULL, '2' },
+        { "h2c", no_argument, NULL, 'P' },
+        { "poll-scheduler", required_argument, NULL, 'S' },
+        { "poll-min", required_argument, NULL, 'm' },
+        { "poll-max", required_argument, NULL, 'M' },
+        { "poll-budget", required_argument, NULL, 'B' },
+        { "retries", required_argument, NULL, 'r' },
+        { "exchange-timeout", required_argument, NULL, 't' },
+        { "stripes", required_argument, NULL, 'T' },
+        { "window", required_argument, NULL, 'W' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:dsc:b:z", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'l': long_poll_ms = strtol(optarg, NULL, 10); break;
+        case 'd': full_duplex = true; break;
+        case 's': full_duplex = stream_mode = true; break;
+        case 'c': coalesce_max_ms = strtol(optarg, NULL, 10); break;
+        case 'b': coalesce_bytes = strtoul(optarg, NULL, 10); break;
+        case 'z': compress_mode = true; break;
+        case '2': http_version = CURL_HTTP_VERSION_2TLS; break;
+        case 'P': http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE; break;
+        case 'S':
+            sched = NULL;
+            for (size_t i = 0; i < sizeof(poll_scheds) / sizeof(poll_scheds[0]); i++)
+                if (strcmp(optarg, poll_scheds[i].name) == 0) sched = &poll_scheds[i];
+            if (!sched) { usage(argv[0]); return 1; }
+            break;
+        case 'm': poll_min_ms = strtoull(optarg, NULL, 10); break;
+        case 'M': poll_max_ms = strtoull(optarg, NULL, 10); break;
+        case 'B': poll_budget = strtod(optarg, NULL); break;
+        case 'r': max_retries = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 't': exchange_timeout_ms = strtol(optarg, NULL, 10); break;
+        case 'T': max_stripes = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'W': recv_window = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2 || poll_min_ms == 0 || poll_min_ms > poll_max_ms || max_stripes < 1 || max_stripes > MAX_STRIPES ||
+        recv_window < 4096) {
+        usage(argv[0]);
         return 1;
     }
-    int listen_port = atoi(argv[1]);
-    const char *url = argv[2];
+    if (max_stripes > 1) full_duplex = true;
+    if (http_version == CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE) {
+        // libcurl 7.88.x fails every request after the first on a prior-knowledge connection
+        const curl_version_info_data *cv = curl_version_info(CURLVERSION_NOW);
+        if (cv->version_num >= 0x075800 && cv->version_num < 0x080000) {
+            fprintf(stderr, "--h2c: libcurl %s cannot reuse a prior-knowledge HTTP/2 connection; use --http2 over TLS\n",
+                    cv->version);
+            return 1;
+        }
+    }
+    int listen_port = atoi(argv[optind]);
+    url_g = argv[optind + 1];
 
-    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    signal(SIGINT, on_sigint);
+    signal(SIGTERM, on_sigint);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, on_sigusr1);
+    hist_init();
+
+    int srv = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (srv < 0) { perror("socket"); return 1; }
     int one = 1; setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
     struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
@@ -84,75 +1291,47 @@ int main(int argc, char **argv) {
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     addr.sin_port = htons((uint16_t)listen_port);
     if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(srv); return 1; }
-    if (listen(srv, 1) < 0) { perror("listen"); close(srv); return 1; }
-    fprintf(stderr, "frontend listening on 127.0.0.1:%d -> %s\n", listen_port, url);
-    int conn = accept(srv, NULL, NULL);
-    if (conn < 0) { perror("accept"); close(srv); return 1; }
+    if (listen(srv, 64) < 0) { perror("listen"); close(srv); return 1; }
 
     curl_global_init(CURL_GLOBAL_DEFAULT);
-    CURL *curl = curl_easy_init();
-    if (!curl) { fprintf(stderr, "curl init failed\n"); close(conn); close(srv); return 1; }
-
-    double delay = 0.1;
-    const double max_delay = 10.0;
-    unsigned char buf[BUF_SIZE];
-
-    while (1) {
-        fd_set rfds; FD_ZERO(&rfds); FD_SET(conn, &rfds);
-        struct timeval tv;
-        tv.tv_sec = (int)delay;
-        tv.tv_usec = (int)((delay - tv.tv_sec) * 1000000.0);
-        int r = select(conn + 1, &rfds, NULL, NULL, &tv);
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            break;
-        }
-
-        size_t send_len = 0;
-        if (r > 0 && FD_ISSET(conn, &rfds)) {
-            ssize_t rd = read(conn, buf, sizeof(buf));
-            if (rd < 0) {
-                if (errno == EINTR) continue;
-                perror("read");
-                break;
-            }
-            if (rd == 0) {
-                // peer closed
-                break;
-            }
-            send_len = (size_t)rd;
-        }
+    multi = curl_multi_init();
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!multi || epfd < 0) { fprintf(stderr, "curl init failed\n"); close(srv); return 1; }
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, curl_socket_cb);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+    if (http_version != CURL_HTTP_VERSION_NONE) curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    struct watch listener = { W_LISTENER, srv, 0 };
+    if (watch_set(&listener, EPOLLIN) < 0) { perror("epoll_ctl"); close(srv); return 1; }
+    fprintf(stderr, "frontend listening on 127.0.0.1:%d -> %s\n", listen_port, url_g);
 
-        unsigned char *resp = NULL; size_t resp_len = 0;
-        if (http_exchange(curl, url, send_len ? buf : NULL, send_len, &resp, &resp_len) != 0) {
-            fprintf(stderr, "http exchange failed\n");
-            free(resp);
-            break;
+    struct epoll_event evs[MAX_EVENTS];
+    while (keep_running) {
+        int n = epoll_wait(epfd, evs, MAX_EVENTS, run_timers());
+        if (n < 0) {
+            if (errno != EINTR) { perror("epoll_wait"); break; }
+            n = 0;
         }
-        if (resp_len > 0) {
-            if (write_all(conn, resp, resp_len) < 0) {
-                perror("write");
-                free(resp);
-                break;
-            }
-            free(resp);
-            delay = 0.1;
-        } else {
-            free(resp);
-            if (send_len == 0) {
-                delay *= 2;
-                if (delay > max_delay) delay = max_delay;
-            } else {
-                delay = 0.1;
+        for (int i = 0; i < n; i++) {
+            struct watch *w = (struct watch*)evs[i].data.ptr;
+            if (w->fd < 0) continue;    // closed earlier in this batch
+            switch (w->kind) {
+            case W_LISTENER: accept_locals(w->fd); break;
+            case W_LOCAL: on_local_event((struct tunnel*)w, evs[i].events); break;
+            case W_CURL: on_curl_event((struct curl_sock*)w, evs[i].events); break;
             }
         }
+        free_dead_tunnels();
+        if (dump_stats) { dump_stats = 0; stats_log(); }
     }
 
-    curl_easy_cleanup(curl);
+    while (tunnels) tunnel_close(tunnels);
+    free_dead_tunnels();
+    fprintf(stderr, "posts=%lu avg_bytes=%lu wire_bytes=%lu throttled=%lu srtt_ms=%.1f\n",
+            posts, posts ? posted_bytes / posts : 0, wire_bytes, throttles, srtt_ms);
+    stats_log();
+    curl_multi_cleanup(multi);
     curl_global_cleanup();
-    close(conn);
+    close(epfd);
     close(srv);
     return 0;
 }
-